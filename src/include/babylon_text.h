@@ -0,0 +1,290 @@
+
+#ifndef H_BABYLON_TEXT
+#define H_BABYLON_TEXT
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+#define BABYLON_EPARAM        (-1)
+#define BABYLON_EFREAD        (-2)
+#define BABYLON_EINCLUDE      (-3)
+#define BABYLON_ETRANSFORM    (-4)
+#define BABYLON_EFWRITE       (-5)
+#define BABYLON_ECANCEL       (-6)
+
+// The levels of babylon_text_log_level(); a level includes the ones
+// before it.
+#define BABYLON_LOG_NONE      (0)
+#define BABYLON_LOG_ERR       (1)
+#define BABYLON_LOG_WARN      (2)
+#define BABYLON_LOG_INFO      (3)
+#define BABYLON_LOG_DEBUG     (4)
+
+// The kernels of babylon_text_scan_kernel() that the lexer finds the
+// end of a token with; a processor that has a kernel has those before
+// it.
+#define BABYLON_SCAN_AUTO     (0)
+#define BABYLON_SCAN_SCALAR   (1)
+#define BABYLON_SCAN_SSE42    (2)
+#define BABYLON_SCAN_AVX2     (3)
+
+typedef struct babylon_text_t babylon_text_t;
+typedef struct babylon_macro_t babylon_macro_t;
+
+// The memory functions that the library allocates everything with. They
+// behave like malloc(), realloc() and free() and are passed 'ctx'. The
+// library never asks for zero bytes and never frees NULL.
+typedef struct babylon_allocator_t {
+   void *(*alloc) (void *ctx, size_t size);
+   void *(*realloc) (void *ctx, void *ptr, size_t size);
+   void (*free) (void *ctx, void *ptr);
+   void *ctx;
+} babylon_allocator_t;
+
+// A macro set compiled into C by babylon_bamc. The names, bodies and
+// segments of the macros are offsets into 'source', the text of the macro
+// file, so that the tables are plain constants; the macros are sorted by
+// name. The layout is private to the library and changes along with
+// BABYLON_MSET_VERSION.
+#define BABYLON_MSET_VERSION  (1)
+
+struct babylon_mseg_t {
+   uint8_t type;
+   uint32_t off;
+   uint32_t len;
+   uint32_t arg;
+};
+
+struct babylon_mdef_t {
+   uint32_t name_off;
+   uint32_t name_len;
+   uint32_t body_off;
+   uint32_t body_len;
+   uint32_t seg_first;
+   uint32_t nsegs;
+};
+
+struct babylon_mset_t {
+   uint32_t version;
+   const char *filename;
+   const char *source;
+   uint32_t source_len;
+   const struct babylon_mdef_t *macros;
+   uint32_t nmacros;
+   const struct babylon_mseg_t *segs;
+   uint32_t nsegs;
+};
+
+// An attribute of a tag, as passed to the start_tag event. The strings
+// are not NUL-terminated and are only valid during the call.
+typedef struct babylon_attr_t {
+   const char *name;
+   size_t namelen;
+   const char *value;
+   size_t valuelen;
+} babylon_attr_t;
+
+// The events of babylon_text_sax(). Any of them may be NULL; each returns
+// false to stop the parse. Names and text are only valid during the call.
+typedef struct babylon_sax_t {
+   bool (*start_tag) (void *ctx, const char *name, size_t namelen,
+                      const babylon_attr_t *attrs, size_t nattrs);
+   bool (*end_tag) (void *ctx, const char *name, size_t namelen);
+   // Called for every word of text.
+   bool (*text) (void *ctx, const char *text, size_t len);
+   bool (*include_begin) (void *ctx, const char *filename);
+   bool (*include_end) (void *ctx, const char *filename);
+} babylon_sax_t;
+
+// Receives the output of a transform, in order, in pieces. Returns false
+// to stop the transform.
+typedef bool (babylon_sink_fn) (void *ctx, const char *data, size_t len);
+
+// Memory that output is appended to, grown as needed with the library's
+// allocator. 'data' holds 'len' bytes followed by a NUL and is freed by
+// the caller with babylon_free(). A zeroed buffer is empty; setting
+// 'len' to zero empties it again while keeping its memory for reuse.
+typedef struct babylon_buffer_t {
+   char *data;
+   size_t len;
+   size_t size;
+} babylon_buffer_t;
+
+// A document of a batch: read from 'input' and expanded into the file
+// 'output'. babylon_text_batch() sets 'errcode', zero on success, and
+// 'errmsg', which the caller must free with babylon_free().
+typedef struct babylon_job_t {
+   const char *input;
+   const char *output;
+   int errcode;
+   char *errmsg;
+} babylon_job_t;
+
+// What it took to read and expand a document; see babylon_text_stats().
+// Times are wall-clock seconds. The transform figures are those of the
+// last transform of the document.
+typedef struct babylon_stats_t {
+   double read_time;
+   double index_time;
+   double transform_time;
+   // Source bytes parsed; files loaded from the parse cache are not.
+   size_t bytes_lexed;
+   size_t nfiles;
+   size_t nincludes;
+   size_t nnodes;
+   size_t nattrs;
+   size_t nexpansions;
+   size_t bytes_written;
+   // Subtrees written from the expansion cache, those expanded because
+   // they were not in it, and entries evicted to keep it within its
+   // limit; see babylon_text_memo_limit().
+   size_t memo_hits;
+   size_t memo_misses;
+   size_t memo_evictions;
+   // The memory held by the tree, its indexes, its sources and its
+   // expansion cache.
+   size_t bytes_allocated;
+} babylon_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Makes the library allocate with 'allocator', or with malloc() if it
+   // is NULL. Memory is freed with the allocator it came from, so this is
+   // called before anything else and while no document, macro set or
+   // string of the library exists. The allocator is shared by all
+   // threads, including those of a parallel read or a batch.
+   void babylon_set_allocator (const babylon_allocator_t *allocator);
+   // Frees a string that the library returned to the caller.
+   void babylon_free (void *ptr);
+
+   // Sets which diagnostics the library writes to stderr
+   // (BABYLON_LOG_WARN unless set).
+   void babylon_text_log_level (int level);
+   // Makes the lexer use 'kernel', or the fastest one the processor has
+   // if it is BABYLON_SCAN_AUTO or one the processor lacks. Returns the
+   // kernel now in use. The kernels give the same tokens, so this is for
+   // checking them against each other; it is set while nothing is read.
+   int babylon_text_scan_kernel (int kernel);
+
+   babylon_macro_t *babylon_macro_read (const char *filename);
+   void babylon_macro_del (babylon_macro_t *bm);
+   void babylon_macro_dump (babylon_macro_t *bm, FILE *outf);
+   // Uses a macro set compiled into the program. Nothing is read or
+   // compiled; the set refers to the constants in 'set'.
+   babylon_macro_t *babylon_macro_static (const struct babylon_mset_t *set);
+   // Writes the macro set as C source defining a babylon_mset_t named
+   // 'symbol', for babylon_macro_static().
+   bool babylon_macro_write_c (babylon_macro_t *bm, const char *symbol,
+                               FILE *outf);
+
+
+   babylon_text_t *babylon_text_read (const char *filename);
+   // Parses the file without building a tree, reporting every tag, word
+   // and included file to 'sax' in document order. Memory use depends
+   // only on how deeply tags and includes are nested. Returns zero, or
+   // the BABYLON_E* error that ended the parse (BABYLON_ECANCEL if a
+   // callback stopped it).
+   int babylon_text_sax (const char *filename, const babylon_sax_t *sax,
+                         void *ctx);
+   // Reads included files in parallel on 'nthreads' threads (zero for
+   // one per processor). The resulting tree is the same as that read by
+   // babylon_text_read().
+   babylon_text_t *babylon_text_read_parallel (const char *filename,
+                                               size_t nthreads);
+   // Reads like babylon_text_read_parallel(), but loads every file whose
+   // parse tree is in the binary cache (.babc) instead of parsing it, and
+   // caches the trees of the files it does parse. The cache files are
+   // kept next to the sources or, if 'cachedir' is not NULL, in that
+   // directory named by the hash of the source's contents.
+   babylon_text_t *babylon_text_read_cached (const char *filename,
+                                             const char *cachedir,
+                                             size_t nthreads);
+   // Reads the document again, parsing only the files that changed since
+   // 'prev' was read. 'prev' remains valid and must be deleted by the
+   // caller. The memo limit of 'prev' carries over but its cached
+   // expansions do not, as they refer to the tree of 'prev': the first
+   // transform of the new document expands it in full.
+   babylon_text_t *babylon_text_reread (babylon_text_t *prev,
+                                        size_t nthreads);
+   // True if any file the document was read from has changed since.
+   bool babylon_text_changed (babylon_text_t *b);
+   // Writes the include dependencies of the document as make rules.
+   bool babylon_text_deps (babylon_text_t *b, FILE *outf);
+   void babylon_text_del (babylon_text_t *b);
+
+   // Expands the document with the macros in 'bm', writing the output to
+   // 'sink' as it is produced. Returns false on error, with the error
+   // recorded in 'src'.
+   bool babylon_text_transform (babylon_text_t *src,
+                                const babylon_macro_t *bm,
+                                babylon_sink_fn *sink, void *ctx);
+   // Writes the output to 'outf' (stdout if NULL) as babylon_text_write()
+   // writes the tree.
+   bool babylon_text_transform_file (babylon_text_t *src,
+                                     const babylon_macro_t *bm, FILE *outf);
+   // Returns the output as a string that the caller must free with
+   // babylon_free(), with its length in 'len' if that is not NULL.
+   char *babylon_text_transform_str (babylon_text_t *src,
+                                     const babylon_macro_t *bm,
+                                     size_t *len);
+   // Appends the output to 'buf'. On error 'buf' is left as it was.
+   bool babylon_text_transform_buffer (babylon_text_t *src,
+                                       const babylon_macro_t *bm,
+                                       babylon_buffer_t *buf);
+   // Reads and expands every job with the macros in 'bm' on 'nthreads'
+   // threads (zero for one per processor), sharing the macro set between
+   // them. Returns the number of jobs that failed.
+   size_t babylon_text_batch (babylon_job_t *jobs, size_t njobs,
+                              const babylon_macro_t *bm, size_t nthreads);
+
+   // A variable that a node does not set is inherited from the nearest
+   // enclosing node that does. When 'warn' is set the transform reports
+   // every such variable as a warning, subject to the log level;
+   // babylon_text_inherited() returns how many there were in the last
+   // transform either way.
+   void babylon_text_warn_inherited (babylon_text_t *b, bool warn);
+   size_t babylon_text_inherited (babylon_text_t *b);
+
+   // A subtree that occurs more than once in the document, and whose
+   // expansion depends on nothing outside it, can be expanded once and
+   // its later copies written from a cache that the document keeps
+   // across transforms. Sets how many bytes the cache may hold, evicting
+   // the least recently used entries beyond that; zero, the default,
+   // turns it off. The cache is not used while inherited variables are
+   // being reported. Output is only reused for a subtree that is the same
+   // node for node; macro sets are told apart by a hash of their text.
+   void babylon_text_memo_limit (babylon_text_t *b, size_t limit);
+
+   // [link target=name] refers to [section name=name]; the targets are
+   // indexed when the document is read. In a macro, $(_id_) is the ID of
+   // a section that is linked to and $(_ref_) the ID of the section a
+   // link refers to. Writes every link to an unknown target, every link
+   // to $(tag.name) outside a for-each over 'tag' and every target
+   // defined more than once, with its location, to 'outf' (stderr if
+   // NULL) and returns how many there were.
+   size_t babylon_text_check_links (babylon_text_t *b, FILE *outf);
+
+   // Writes the tree, node by node, to 'outf' (stdout if NULL), or
+   // appends it to 'buf'. Output to a file is written in large blocks
+   // straight to its descriptor once whatever 'outf' has buffered is
+   // flushed.
+   bool babylon_text_write (babylon_text_t *b, FILE *outf);
+   bool babylon_text_write_buffer (babylon_text_t *b, babylon_buffer_t *buf);
+
+   // Fills 'stats' in for the document. Returns false if either is NULL.
+   bool babylon_text_stats (babylon_text_t *b, babylon_stats_t *stats);
+
+   int babylon_text_errcode (babylon_text_t *b);
+   const char *babylon_text_errmsg (babylon_text_t *b);
+
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "babylon_text.h"
+
+#define PROG_ERR(...)      do {\
+   fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
+   fprintf (stderr, __VA_ARGS__);\
+   fprintf (stderr, "\n");\
+} while (0)
+
+// Compiles a macro file into a C source file holding the macro set as
+// constant tables, so that a program can link it in and use it through
+// babylon_macro_static() without reading or compiling anything.
+
+static void print_help (const char *progname)
+{
+   printf ("Usage: %s input.bam symbol output.c\n"
+           "Writes the macros in [input.bam] to [output.c] as a\n"
+           "'const struct babylon_mset_t' named [symbol].\n",
+           progname);
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   babylon_macro_t *m = NULL;
+   FILE *outf = NULL;
+
+   if (argc != 4) {
+      print_help (argv[0]);
+      goto errorexit;
+   }
+
+   const char *input = argv[1],
+              *symbol = argv[2],
+              *output = argv[3];
+
+   if (!(m = babylon_macro_read (input))) {
+      PROG_ERR ("Failed to read macros from [%s]\n", input);
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (output, "w"))) {
+      PROG_ERR ("Failed to open [%s] for writing:%m\n", output);
+      goto errorexit;
+   }
+
+   if (!(babylon_macro_write_c (m, symbol, outf))) {
+      PROG_ERR ("Failed to write [%s]\n", output);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+
+   if (outf && fclose (outf) != 0) {
+      PROG_ERR ("Failed to write [%s]:%m\n", argv[3]);
+      ret = EXIT_FAILURE;
+   }
+
+   // A partly written file must not be mistaken for a current one.
+   if (ret != EXIT_SUCCESS && outf)
+      remove (argv[3]);
+
+   babylon_macro_del (m);
+
+   return ret;
+}
@@ -0,0 +1,461 @@
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef PLATFORM_POSIX
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#define CHDIR(path)     chdir ((path))
+#define GETCWD(b, n)    getcwd ((b), (n))
+#endif
+
+#ifdef PLATFORM_Windows
+#include <windows.h>
+#include <direct.h>
+#define CHDIR(path)     _chdir ((path))
+#define GETCWD(b, n)    _getcwd ((b), (n))
+#endif
+
+#include "babylon_text.h"
+
+#define PROG_ERR(...)      do {\
+   fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
+   fprintf (stderr, __VA_ARGS__);\
+   fprintf (stderr, "\n");\
+} while (0)
+
+// Measures one scenario written by babylon_corpus: the directory's
+// main.bab is read and expanded with its macros.bam, the best of several
+// runs is kept, and the results are compared with those stored for the
+// scenario in a baseline file.
+//
+// Peak RSS is the high-water mark of the whole process, so each scenario
+// needs a process of its own. Allocations are counted by giving the
+// library an allocator that counts its calls.
+
+#define DEFAULT_REPEATS    (10)
+#define DEFAULT_TOLERANCE  (25.0)
+
+/* ***************************************************************** */
+
+static size_t nallocs;
+
+static void *count_alloc (void *ctx, size_t size)
+{
+   (void)ctx;
+   __atomic_add_fetch (&nallocs, 1, __ATOMIC_RELAXED);
+   return malloc (size);
+}
+
+static void *count_realloc (void *ctx, void *ptr, size_t size)
+{
+   (void)ctx;
+   __atomic_add_fetch (&nallocs, 1, __ATOMIC_RELAXED);
+   return realloc (ptr, size);
+}
+
+static void count_free (void *ctx, void *ptr)
+{
+   (void)ctx;
+   free (ptr);
+}
+
+static size_t allocs (void)
+{
+   return __atomic_load_n (&nallocs, __ATOMIC_RELAXED);
+}
+
+static double now (void)
+{
+#ifdef PLATFORM_POSIX
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+#ifdef PLATFORM_Windows
+   LARGE_INTEGER count, freq;
+   QueryPerformanceCounter (&count);
+   QueryPerformanceFrequency (&freq);
+   return (double)count.QuadPart / (double)freq.QuadPart;
+#endif
+}
+
+// In kilobytes; zero where it cannot be measured.
+static size_t peak_rss (void)
+{
+#ifdef PLATFORM_POSIX
+   struct rusage ru;
+   if (getrusage (RUSAGE_SELF, &ru) == 0)
+      return (size_t)ru.ru_maxrss;
+#endif
+   return 0;
+}
+
+/* ***************************************************************** */
+
+// The output is counted by the library's statistics and then dropped.
+static bool discard_output (void *ctx, const char *data, size_t len)
+{
+   (void)ctx;
+   (void)data;
+   (void)len;
+   return true;
+}
+
+/* ***************************************************************** */
+
+enum metric_t {
+   metric_PARSE = 0,
+   metric_NODES,
+   metric_XFORM,
+   metric_RSS,
+   metric_READ_ALLOCS,
+   metric_XFORM_ALLOCS,
+   metric_COUNT
+};
+
+static const struct {
+   const char *name;
+   bool higher_is_better;
+} metrics[metric_COUNT] = {
+   { "parse MB/s",      true  },
+   { "nodes/s",         true  },
+   { "transform MB/s",  true  },
+   { "peak RSS KB",     false },
+   { "read allocs",     false },
+   { "transform allocs", false },
+};
+
+// A baseline file has a line for every scenario: its name followed by
+// the metrics in the order above. Lines starting with '#' are comments.
+static bool baseline_find (const char *path, const char *name,
+                           double *values)
+{
+   bool ret = false;
+   char line[1024];
+   FILE *inf = fopen (path, "r");
+
+   if (!inf)
+      return false;
+
+   while (!ret && fgets (line, sizeof line, inf)) {
+      char *tok = strtok (line, " \t\r\n");
+      if (!tok || *tok == '#' || strcmp (tok, name))
+         continue;
+      ret = true;
+      for (size_t i=0; ret && i<metric_COUNT; i++) {
+         char *end = NULL;
+         if (!(tok = strtok (NULL, " \t\r\n")))
+            ret = false;
+         else
+            values[i] = strtod (tok, &end);
+         if (ret && (!end || *end))
+            ret = false;
+      }
+   }
+
+   fclose (inf);
+   return ret;
+}
+
+// Replaces the line for 'name' in the baseline, or adds one.
+static bool baseline_update (const char *path, const char *name,
+                             const double *values)
+{
+   bool error = true;
+   char line[1024];
+   char *text = NULL;
+   size_t len = 0;
+   bool found = false;
+   FILE *inf = fopen (path, "r"),
+        *outf = NULL;
+
+   while (inf && fgets (line, sizeof line, inf)) {
+      size_t namelen = strlen (name);
+      char entry[1024];
+      const char *add = line;
+      if (!strncmp (line, name, namelen) &&
+          (line[namelen] == ' ' || line[namelen] == '\t')) {
+         int n = snprintf (entry, sizeof entry, "%s", name);
+         for (size_t i=0; i<metric_COUNT; i++)
+            n += snprintf (&entry[n], sizeof entry - n, " %.6g", values[i]);
+         snprintf (&entry[n], sizeof entry - n, "\n");
+         add = entry;
+         found = true;
+      }
+      char *tmp = realloc (text, len + strlen (add) + 1);
+      if (!tmp) {
+         PROG_ERR ("OOM\n");
+         goto errorexit;
+      }
+      text = tmp;
+      strcpy (&text[len], add);
+      len += strlen (add);
+   }
+
+   if (!(outf = fopen (path, "w"))) {
+      PROG_ERR ("Failed to open [%s] for writing:%m\n", path);
+      goto errorexit;
+   }
+
+   if (!inf) {
+      fprintf (outf, "# name");
+      for (size_t i=0; i<metric_COUNT; i++)
+         fprintf (outf, " | %s", metrics[i].name);
+      fprintf (outf, "\n");
+   }
+   if (text)
+      fputs (text, outf);
+   if (!found) {
+      fprintf (outf, "%s", name);
+      for (size_t i=0; i<metric_COUNT; i++)
+         fprintf (outf, " %.6g", values[i]);
+      fprintf (outf, "\n");
+   }
+
+   error = false;
+
+errorexit:
+
+   if (inf)
+      fclose (inf);
+   if (outf && fclose (outf) != 0) {
+      PROG_ERR ("Failed to write [%s]:%m\n", path);
+      error = true;
+   }
+   free (text);
+
+   return !error;
+}
+
+/* ***************************************************************** */
+
+static bool run (const char *dir, size_t repeats, double *values,
+                 babylon_stats_t *st)
+{
+   bool error = true;
+   char cwd[4096];
+   babylon_macro_t *bm = NULL;
+   babylon_text_t *b = NULL;
+   double best_read = 0,
+          best_xform = 0;
+
+   if (!GETCWD (cwd, sizeof cwd)) {
+      PROG_ERR ("Failed to get the current directory:%m\n");
+      return false;
+   }
+
+   // Included paths are relative to the directory of the document.
+   if (CHDIR (dir) != 0) {
+      PROG_ERR ("Failed to change to [%s]:%m\n", dir);
+      return false;
+   }
+
+   if (!(bm = babylon_macro_read ("macros.bam"))) {
+      PROG_ERR ("Failed to read [%s/macros.bam]\n", dir);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<repeats; i++) {
+      size_t a0 = allocs ();
+      double t0 = now ();
+
+      if (!(b = babylon_text_read ("main.bab")) || babylon_text_errcode (b)) {
+         PROG_ERR ("Failed to read [%s/main.bab]: %s\n", dir,
+                   b ? babylon_text_errmsg (b) : "OOM");
+         goto errorexit;
+      }
+
+      double t1 = now ();
+      size_t a1 = allocs ();
+
+      if (!(babylon_text_transform (b, bm, discard_output, NULL))) {
+         PROG_ERR ("Failed to expand [%s/main.bab]: %s\n", dir,
+                   babylon_text_errmsg (b));
+         goto errorexit;
+      }
+
+      double t2 = now ();
+      size_t a2 = allocs ();
+
+      if (i == 0 || t1 - t0 < best_read)
+         best_read = t1 - t0;
+      if (i == 0 || t2 - t1 < best_xform)
+         best_xform = t2 - t1;
+      values[metric_READ_ALLOCS] = (double)(a1 - a0);
+      values[metric_XFORM_ALLOCS] = (double)(a2 - a1);
+
+      babylon_text_stats (b, st);
+      babylon_text_del (b);
+      b = NULL;
+   }
+
+   values[metric_PARSE] = (double)st->bytes_lexed / 1e6 / best_read;
+   values[metric_NODES] = (double)st->nnodes / best_read;
+   values[metric_XFORM] = (double)st->bytes_written / 1e6 / best_xform;
+   values[metric_RSS] = (double)peak_rss ();
+
+   error = false;
+
+errorexit:
+
+   babylon_text_del (b);
+   babylon_macro_del (bm);
+
+   if (CHDIR (cwd) != 0) {
+      PROG_ERR ("Failed to change back to [%s]:%m\n", cwd);
+      error = true;
+   }
+
+   return !error;
+}
+
+// Prints the results beside the baseline's and returns the number of
+// metrics that are worse by more than 'tolerance' percent.
+static size_t report (const char *name, const double *values,
+                      const double *base, double tolerance)
+{
+   size_t ret = 0;
+
+   printf ("%-18s %14s %14s %9s\n", name, "this run",
+           base ? "baseline" : "", base ? "change" : "");
+
+   for (size_t i=0; i<metric_COUNT; i++) {
+      printf ("  %-16s %14.6g", metrics[i].name, values[i]);
+      if (!base) {
+         printf ("\n");
+         continue;
+      }
+
+      double change = base[i] ? (values[i] - base[i]) * 100.0 / base[i]
+                              : 0.0;
+      bool worse = metrics[i].higher_is_better ? change < -tolerance
+                                               : change > tolerance;
+      printf (" %14.6g %+8.1f%%%s\n", base[i], change,
+              worse ? "  REGRESSION" : "");
+      if (worse)
+         ret++;
+   }
+
+   return ret;
+}
+
+static void print_help (const char *progname)
+{
+   printf ("Usage: %s [options] scenario-dir\n"
+           "Reads and expands [scenario-dir/main.bab] with\n"
+           "[scenario-dir/macros.bam] and reports how fast that was.\n"
+           "  -r N          Keep the best of N runs [%i]\n"
+           "  -b FILE       Compare with the baseline in FILE and fail if\n"
+           "                any metric is worse than the tolerance\n"
+           "  -t PERCENT    The tolerance [%.0f]\n"
+           "  -u FILE       Store the results as the baseline in FILE\n"
+           "  -n NAME       Name the scenario [the directory's name]\n"
+           "  -h, --help    Show this message\n",
+           progname, DEFAULT_REPEATS, DEFAULT_TOLERANCE);
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   size_t repeats = DEFAULT_REPEATS;
+   double tolerance = DEFAULT_TOLERANCE;
+   const char *baseline = NULL,
+              *update = NULL,
+              *name = NULL,
+              *dir = NULL;
+
+   babylon_stats_t st;
+   double values[metric_COUNT],
+          base[metric_COUNT];
+
+   for (int i=1; i<argc; i++) {
+      if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+         print_help (argv[0]);
+         return EXIT_SUCCESS;
+      } else if (argv[i][0] == '-' && strchr ("rbtun", argv[i][1])
+                  && argv[i][1] && !argv[i][2]) {
+         if (++i >= argc) {
+            PROG_ERR ("Missing argument to [%s]\n", argv[i - 1]);
+            goto errorexit;
+         }
+         char *end = NULL;
+         switch (argv[i - 1][1]) {
+            case 'r':   repeats = strtoul (argv[i], &end, 10);   break;
+            case 't':   tolerance = strtod (argv[i], &end);      break;
+            case 'b':   baseline = argv[i];                      break;
+            case 'u':   update = argv[i];                        break;
+            case 'n':   name = argv[i];                          break;
+         }
+         if (end && (*end || repeats == 0)) {
+            PROG_ERR ("Invalid value [%s] for [%s]\n", argv[i],
+                      argv[i - 1]);
+            goto errorexit;
+         }
+      } else if (!dir) {
+         dir = argv[i];
+      } else {
+         PROG_ERR ("Unexpected argument [%s]\n", argv[i]);
+         goto errorexit;
+      }
+   }
+
+   if (!dir) {
+      print_help (argv[0]);
+      goto errorexit;
+   }
+
+   if (!name) {
+      size_t len = strlen (dir);
+      while (len > 1 && dir[len - 1] == '/')
+         len--;
+      const char *s = dir + len;
+      while (s > dir && s[-1] != '/')
+         s--;
+      static char buf[256];
+      snprintf (buf, sizeof buf, "%.*s", (int)(dir + len - s), s);
+      name = buf;
+   }
+
+   static const babylon_allocator_t counter = {
+      count_alloc, count_realloc, count_free, NULL
+   };
+   babylon_set_allocator (&counter);
+
+   memset (&st, 0, sizeof st);
+   if (!(run (dir, repeats, values, &st)))
+      goto errorexit;
+
+   printf ("%s: %zu bytes in %zu files, %zu nodes, %zu bytes out\n",
+           name, st.bytes_lexed, st.nfiles, st.nnodes, st.bytes_written);
+
+   bool have_base = baseline && baseline_find (baseline, name, base);
+   if (baseline && !have_base)
+      printf ("No baseline for [%s] in [%s]\n", name, baseline);
+
+   size_t nworse = report (name, values, have_base ? base : NULL,
+                           tolerance);
+
+   if (update && !(baseline_update (update, name, values)))
+      goto errorexit;
+
+   if (nworse) {
+      PROG_ERR ("[%s]: %zu metrics regressed by more than %.0f%%\n", name,
+                nworse, tolerance);
+      goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+
+   return ret;
+}
@@ -1,8 +1,31 @@
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <errno.h>
+
+#ifdef PLATFORM_POSIX
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#define MKDIR(path)     mkdir ((path), 0777)
+#endif
+
+#ifdef PLATFORM_Windows
+#include <windows.h>
+#include <direct.h>
+#define MKDIR(path)     _mkdir ((path))
+#endif
 
 #include "babylon_text.h"
 
+#include "ds_str.h"
+
 #define PROG_ERR(...)      do {\
    fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
    fprintf (stderr, __VA_ARGS__);\
@@ -12,40 +35,628 @@
 #define TEST_INPUT   ("test_input.bab")
 #define TEST_MACRO   ("test_macro.bam")
 
-int main (void)
+// Built with BUILTIN_BAM=file.bam, the program carries that macro set.
+#ifdef BABYLON_BUILTIN_MACROS
+extern const struct babylon_mset_t babylon_builtin_macros;
+#endif
+
+// How often watch mode checks the input files for changes.
+#define WATCH_INTERVAL_MS     (500)
+
+// What batch mode replaces the extension of each input with.
+#define BATCH_EXT             (".html")
+
+static void print_help (const char *progname)
 {
-   int ret = EXIT_FAILURE;
+   printf ("Usage: %s [options] [input [macros]]\n"
+           "       %s [options] -o DIR [-m macros] [inputs...]\n"
+           "  -w, --watch       Re-read the input whenever one of its files\n"
+           "                    changes, parsing only the changed files\n"
+           "  -t, --transform   Write the input expanded with the macros\n"
+           "                    instead of dumping the tree and macros\n"
+#ifdef BABYLON_BUILTIN_MACROS
+           "  -b, --builtin     Use the macros built into the program\n"
+           "                    instead of reading a macro file\n"
+#endif
+           "  --warn-inherited  Warn about variables that the expansion takes\n"
+           "                    from an enclosing tag\n"
+           "  --memo BYTES      Expand repeated subtrees once, keeping up to\n"
+           "                    BYTES of their output for reuse\n"
+           "  -s, --sax         Write the parse events without building a\n"
+           "                    tree\n"
+           "  -d, --deps        Write the include dependencies as make rules\n"
+           "  -j, --jobs N      Read included files on N threads (0 for one\n"
+           "                    per processor)\n"
+           "  -c, --cache       Keep a binary cache of each file's parse tree\n"
+           "                    next to the file\n"
+           "  --cache-dir DIR   Keep the binary cache in DIR instead\n"
+           "  -o, --outdir DIR  Batch mode: expand every input into DIR,\n"
+           "                    under its own path with the extension\n"
+           "                    replaced, on the threads given by -j\n"
+           "  -l, --list FILE   Batch mode: also expand every file named in\n"
+           "                    FILE, one to a line ('-' for stdin)\n"
+           "  --ext EXT         The extension of batch outputs [%s]\n"
+           "  -m, --macros FILE Read the macros from FILE\n"
+           "  --stats           Write the time and size of each phase\n"
+           "  -v, --verbose     Write what the library is doing; twice for\n"
+           "                    more detail\n"
+           "  -h, --help        Show this message\n"
+           "Without arguments [%s] and [%s] are read.\n",
+           progname, progname, BATCH_EXT, TEST_INPUT, TEST_MACRO);
+}
 
-   babylon_text_t *b = NULL;
-   babylon_macro_t *m = NULL;
+static void sleep_ms (unsigned int ms)
+{
+#ifdef PLATFORM_POSIX
+   struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+   nanosleep (&ts, NULL);
+#endif
+#ifdef PLATFORM_Windows
+   Sleep (ms);
+#endif
+}
 
-   printf ("Starting babylon processing\n");
+// Writes the parse events, one to a line and indented by depth.
+static int sax_depth;
 
-   if (!(b = babylon_text_read (TEST_INPUT))) {
-      PROG_ERR ("Failed to read input from file [%s]:%m\n", TEST_INPUT);
-      goto errorexit;
+static bool sax_start_tag (void *ctx, const char *name, size_t namelen,
+                           const babylon_attr_t *attrs, size_t nattrs)
+{
+   fprintf (ctx, "%*s[%.*s", sax_depth++ * 3, "", (int)namelen, name);
+   for (size_t i=0; i<nattrs; i++) {
+      fprintf (ctx, " %.*s=%.*s", (int)attrs[i].namelen, attrs[i].name,
+                                  (int)attrs[i].valuelen, attrs[i].value);
+   }
+   fprintf (ctx, "\n");
+   return true;
+}
+
+static bool sax_end_tag (void *ctx, const char *name, size_t namelen)
+{
+   fprintf (ctx, "%*s]%.*s\n", --sax_depth * 3, "", (int)namelen, name);
+   return true;
+}
+
+static bool sax_text (void *ctx, const char *text, size_t len)
+{
+   fprintf (ctx, "%*s%.*s\n", sax_depth * 3, "", (int)len, text);
+   return true;
+}
+
+static bool sax_include_begin (void *ctx, const char *filename)
+{
+   fprintf (ctx, "%*s#include %s\n", sax_depth++ * 3, "", filename);
+   return true;
+}
+
+static bool sax_include_end (void *ctx, const char *filename)
+{
+   fprintf (ctx, "%*s#end %s\n", --sax_depth * 3, "", filename);
+   return true;
+}
+
+static babylon_macro_t *load_macros (const char *macros, bool builtin)
+{
+#ifdef BABYLON_BUILTIN_MACROS
+   if (builtin)
+      return babylon_macro_static (&babylon_builtin_macros);
+#endif
+   (void)builtin;
+   return babylon_macro_read (macros);
+}
+
+// Reads the lines of 'inf' onto 'list', skipping empty lines.
+static bool read_list (FILE *inf, char ***list, size_t *nlist,
+                       size_t *list_size)
+{
+   char *line = NULL;
+   size_t len = 0,
+          size = 0;
+   int c = 0;
+
+   do {
+      c = fgetc (inf);
+      if (c != EOF && c != '\n') {
+         if (len + 2 > size) {
+            size_t newsize = size ? size * 2 : 128;
+            char *tmp = realloc (line, newsize);
+            if (!tmp)
+               goto errorexit;
+            line = tmp;
+            size = newsize;
+         }
+         line[len++] = (char)c;
+         continue;
+      }
+
+      while (len && line[len - 1] == '\r')
+         len--;
+      if (!len)
+         continue;
+      line[len] = 0;
+      len = 0;
+
+      if (*nlist >= *list_size) {
+         size_t newsize = *list_size ? *list_size * 2 : 64;
+         char **tmp = realloc (*list, newsize * sizeof *tmp);
+         if (!tmp)
+            goto errorexit;
+         *list = tmp;
+         *list_size = newsize;
+      }
+      if (!((*list)[*nlist] = ds_str_dup (line)))
+         goto errorexit;
+      (*nlist)++;
+   } while (c != EOF);
+
+   free (line);
+   return !ferror (inf);
+
+errorexit:
+   PROG_ERR ("OOM\n");
+   free (line);
+   return false;
+}
+
+// The output of an input in batch mode is the input's path below
+// 'outdir' with its extension replaced by 'ext'. The path is normalized
+// first: empty and '.' components are dropped and every '..' removes the
+// component before it, or nothing at the top, so that the output stays
+// within 'outdir' and two spellings of one input give the same output.
+static char *batch_output (const char *outdir, const char *input,
+                           const char *ext)
+{
+   char *rel = malloc (strlen (input) + 1),
+        *ret = NULL;
+   size_t len = 0;
+
+   if (!rel) {
+      PROG_ERR ("OOM\n");
+      return NULL;
+   }
+
+   for (const char *s=input; *s; ) {
+      const char *end = strchr (s, '/');
+      size_t n = end ? (size_t)(end - s) : strlen (s);
+      if (n == 2 && !strncmp (s, "..", 2)) {
+         while (len && rel[len - 1] != '/')
+            len--;
+         if (len)
+            len--;
+      } else if (n && !(n == 1 && *s == '.')) {
+         if (len)
+            rel[len++] = '/';
+         memcpy (&rel[len], s, n);
+         len += n;
+      }
+      s += n;
+      if (*s == '/')
+         s++;
+   }
+   rel[len] = 0;
+
+   if (!len) {
+      PROG_ERR ("Input [%s] names no file below [%s]\n", input, outdir);
+      free (rel);
+      return NULL;
+   }
+
+   const char *base = strrchr (rel, '/');
+   base = base ? base + 1 : rel;
+   const char *dot = strrchr (base, '.');
+   size_t stem = dot && dot != base ? (size_t)(dot - rel) : len;
+
+   ds_str_printf (&ret, "%s/%.*s%s", outdir, (int)stem, rel, ext);
+   if (!ret)
+      PROG_ERR ("OOM\n");
+   free (rel);
+   return ret;
+}
+
+// Creates the directories leading up to the file 'path'.
+static bool make_dirs (const char *path)
+{
+   char *tmp = ds_str_dup (path);
+   bool ret = tmp != NULL;
+
+   for (char *s=tmp ? tmp + 1 : NULL; ret && s && *s; s++) {
+      if (*s != '/')
+         continue;
+      *s = 0;
+      if (MKDIR (tmp) != 0 && errno != EEXIST) {
+         PROG_ERR ("Failed to create directory [%s]:%m\n", tmp);
+         ret = false;
+      }
+      *s = '/';
+   }
+
+   free (tmp);
+   return ret;
+}
+
+static int job_cmp (const void *lhs, const void *rhs)
+{
+   const babylon_job_t *const *a = lhs,
+                       *const *b = rhs;
+   return strcmp ((*a)->output, (*b)->output);
+}
+
+// Expands every input into 'outdir' and reports the ones that failed.
+static bool run_batch (char **inputs, size_t ninputs, const char *outdir,
+                       const char *ext, const babylon_macro_t *m,
+                       size_t nthreads)
+{
+   bool error = true;
+   babylon_job_t *jobs = calloc (ninputs + 1, sizeof *jobs);
+   babylon_job_t **sorted = calloc (ninputs + 1, sizeof *sorted);
+   size_t nfailed = 0;
+
+   if (!jobs || !sorted) {
+      free (jobs);
+      free (sorted);
+      PROG_ERR ("OOM\n");
+      return false;
+   }
+
+   for (size_t i=0; i<ninputs; i++) {
+      jobs[i].input = inputs[i];
+      if (!(jobs[i].output = batch_output (outdir, inputs[i], ext)))
+         goto errorexit;
+      if (!(make_dirs (jobs[i].output)))
+         goto errorexit;
+      sorted[i] = &jobs[i];
    }
 
+   // Two inputs written to the same file would overwrite each other; the
+   // outputs are normalized, so this also catches two spellings of one
+   // input.
+   qsort (sorted, ninputs, sizeof *sorted, job_cmp);
+   for (size_t i=1; i<ninputs; i++) {
+      if (!strcmp (sorted[i - 1]->output, sorted[i]->output)) {
+         PROG_ERR ("Inputs [%s] and [%s] both write [%s]\n",
+                   sorted[i - 1]->input, sorted[i]->input,
+                   sorted[i]->output);
+         goto errorexit;
+      }
+   }
+
+   nfailed = babylon_text_batch (jobs, ninputs, m, nthreads);
+
+   for (size_t i=0; i<ninputs; i++) {
+      if (jobs[i].errcode)
+         fprintf (stderr, "FAILED %s: error %i: %s\n", jobs[i].input,
+                          jobs[i].errcode,
+                          jobs[i].errmsg ? jobs[i].errmsg : "");
+   }
+   fprintf (stderr, "%zu of %zu documents written to [%s], %zu failed\n",
+                    ninputs - nfailed, ninputs, outdir, nfailed);
+
+   error = nfailed > 0;
+
+errorexit:
+
+   for (size_t i=0; i<ninputs; i++) {
+      free ((char *)jobs[i].output);
+      babylon_free (jobs[i].errmsg);
+   }
+   free (jobs);
+   free (sorted);
+
+   return !error;
+}
+
+static void print_stats (babylon_text_t *b)
+{
+   babylon_stats_t st;
+
+   if (!(babylon_text_stats (b, &st)))
+      return;
+
+   double lexed = (double)st.bytes_lexed / 1e6,
+          written = (double)st.bytes_written / 1e6;
+
+   fprintf (stderr, "read:        %10.6fs  %zu bytes lexed",
+                    st.read_time, st.bytes_lexed);
+   if (st.read_time > 0)
+      fprintf (stderr, " (%.1f MB/s)", lexed / st.read_time);
+   fprintf (stderr, "\n"
+                    "index:       %10.6fs\n"
+                    "transform:   %10.6fs  %zu expansions, %zu bytes"
+                    " written",
+                    st.index_time, st.transform_time, st.nexpansions,
+                    st.bytes_written);
+   if (st.transform_time > 0)
+      fprintf (stderr, " (%.1f MB/s)", written / st.transform_time);
+   fprintf (stderr, "\n"
+                    "memo:        %10zu hits, %zu misses, %zu evictions\n"
+                    "files:       %10zu\n"
+                    "includes:    %10zu\n"
+                    "nodes:       %10zu\n"
+                    "attributes:  %10zu\n"
+                    "allocated:   %10zu bytes\n",
+                    st.memo_hits, st.memo_misses, st.memo_evictions,
+                    st.nfiles, st.nincludes, st.nnodes, st.nattrs,
+                    st.bytes_allocated);
+}
+
+// Writes the tree, or its expansion if 'm' is not NULL.
+static bool write_output (babylon_text_t *b, babylon_macro_t *m,
+                          const char *input, bool deps, bool warn,
+                          size_t memo, bool stats)
+{
+   babylon_text_warn_inherited (b, warn);
+   babylon_text_memo_limit (b, memo);
+
    if (babylon_text_errcode (b)) {
       PROG_ERR ("Error %i parsing [%s]:%s\n", babylon_text_errcode (b),
-                                              TEST_INPUT,
+                                              input,
                                               babylon_text_errmsg (b));
-      goto errorexit;
+      return false;
    }
 
-   if (!(babylon_text_write (b, stdout))) {
+   babylon_text_check_links (b, stderr);
+
+   if (m && !(babylon_text_transform_file (b, m, stdout))) {
+      PROG_ERR ("Error %i transforming [%s]:%s\n", babylon_text_errcode (b),
+                                                   input,
+                                                   babylon_text_errmsg (b));
+      return false;
+   }
+
+   if (warn && m && babylon_text_inherited (b))
+      fprintf (stderr, "%zu variables inherited from enclosing tags\n",
+                       babylon_text_inherited (b));
+
+   if (!m && !(babylon_text_write (b, stdout))) {
       PROG_ERR ("Error %i writing [%s]:%s\n", babylon_text_errcode (b),
-                                              TEST_INPUT,
+                                              input,
                                               babylon_text_errmsg (b));
+      return false;
+   }
+
+   if (deps && !(babylon_text_deps (b, stdout))) {
+      PROG_ERR ("Error writing dependencies of [%s]\n", input);
+      return false;
+   }
+
+   fflush (stdout);
+
+   if (stats)
+      print_stats (b);
+
+   return true;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+
+   babylon_text_t *b = NULL;
+   babylon_macro_t *m = NULL;
+
+   const char *input = TEST_INPUT,
+              *macros = TEST_MACRO;
+   const char *cachedir = NULL,
+              *outdir = NULL,
+              *listfile = NULL,
+              *ext = BATCH_EXT;
+   char **positional = NULL;
+   size_t npositional = 0,
+          positional_size = 0;
+   bool watch = false,
+        deps = false,
+        parallel = false,
+        cache = false,
+        transform = false,
+        builtin = false,
+        sax = false,
+        warn = false,
+        stats = false;
+   int log_level = BABYLON_LOG_WARN;
+   size_t nthreads = 0,
+          memo = 0;
+
+   for (int i=1; i<argc; i++) {
+      if (!strcmp (argv[i], "-w") || !strcmp (argv[i], "--watch")) {
+         watch = true;
+      } else if (!strcmp (argv[i], "-t")
+                  || !strcmp (argv[i], "--transform")) {
+         transform = true;
+#ifdef BABYLON_BUILTIN_MACROS
+      } else if (!strcmp (argv[i], "-b") || !strcmp (argv[i], "--builtin")) {
+         builtin = true;
+#endif
+      } else if (!strcmp (argv[i], "-s") || !strcmp (argv[i], "--sax")) {
+         sax = true;
+      } else if (!strcmp (argv[i], "--warn-inherited")) {
+         warn = true;
+      } else if (!strcmp (argv[i], "--memo")) {
+         if (++i >= argc) {
+            PROG_ERR ("Missing argument to [%s]\n", argv[i - 1]);
+            goto errorexit;
+         }
+         memo = (size_t)strtoull (argv[i], NULL, 10);
+      } else if (!strcmp (argv[i], "-d") || !strcmp (argv[i], "--deps")) {
+         deps = true;
+      } else if (!strcmp (argv[i], "-j") || !strcmp (argv[i], "--jobs")) {
+         if (++i >= argc) {
+            PROG_ERR ("Missing argument to [%s]\n", argv[i - 1]);
+            goto errorexit;
+         }
+         nthreads = (size_t)strtoul (argv[i], NULL, 10);
+         parallel = true;
+      } else if (!strcmp (argv[i], "-c") || !strcmp (argv[i], "--cache")) {
+         cache = true;
+      } else if (!strcmp (argv[i], "--cache-dir")) {
+         if (++i >= argc) {
+            PROG_ERR ("Missing argument to [%s]\n", argv[i - 1]);
+            goto errorexit;
+         }
+         cachedir = argv[i];
+         cache = true;
+      } else if (!strcmp (argv[i], "-o") || !strcmp (argv[i], "--outdir")
+                  || !strcmp (argv[i], "-l") || !strcmp (argv[i], "--list")
+                  || !strcmp (argv[i], "-m") || !strcmp (argv[i], "--macros")
+                  || !strcmp (argv[i], "--ext")) {
+         if (++i >= argc) {
+            PROG_ERR ("Missing argument to [%s]\n", argv[i - 1]);
+            goto errorexit;
+         }
+         const char *opt = argv[i - 1];
+         if (opt[1] == 'o' || !strcmp (opt, "--outdir"))
+            outdir = argv[i];
+         else if (opt[1] == 'l' || !strcmp (opt, "--list"))
+            listfile = argv[i];
+         else if (opt[1] == 'm' || !strcmp (opt, "--macros"))
+            macros = argv[i];
+         else
+            ext = argv[i];
+      } else if (!strcmp (argv[i], "--stats")) {
+         stats = true;
+      } else if (!strcmp (argv[i], "-v") || !strcmp (argv[i], "--verbose")) {
+         if (log_level < BABYLON_LOG_DEBUG)
+            log_level++;
+      } else if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+         print_help (argv[0]);
+         ret = EXIT_SUCCESS;
+         goto errorexit;
+      } else if (argv[i][0] == '-') {
+         PROG_ERR ("Unknown option [%s]\n", argv[i]);
+         print_help (argv[0]);
+         goto errorexit;
+      } else {
+         if (npositional >= positional_size) {
+            size_t newsize = positional_size ? positional_size * 2 : 16;
+            char **tmp = realloc (positional, newsize * sizeof *tmp);
+            if (!tmp) {
+               PROG_ERR ("OOM\n");
+               goto errorexit;
+            }
+            positional = tmp;
+            positional_size = newsize;
+         }
+         if (!(positional[npositional] = ds_str_dup (argv[i]))) {
+            PROG_ERR ("OOM\n");
+            goto errorexit;
+         }
+         npositional++;
+      }
+   }
+
+   babylon_text_log_level (log_level);
+
+   // In batch mode every argument is an input; otherwise there is the
+   // input and the macros.
+   if (outdir) {
+      FILE *inf = NULL;
+      if (listfile && !strcmp (listfile, "-"))
+         inf = stdin;
+      else if (listfile && !(inf = fopen (listfile, "r"))) {
+         PROG_ERR ("Failed to open [%s]:%m\n", listfile);
+         goto errorexit;
+      }
+      bool ok = !inf || read_list (inf, &positional, &npositional,
+                                   &positional_size);
+      if (inf && inf != stdin)
+         fclose (inf);
+      if (!ok) {
+         PROG_ERR ("Failed to read the list of inputs [%s]\n", listfile);
+         goto errorexit;
+      }
+
+      if (!(m = load_macros (macros, builtin))) {
+         PROG_ERR ("Failed to read macros from [%s]\n", macros);
+         goto errorexit;
+      }
+
+      if (run_batch (positional, npositional, outdir, ext, m, nthreads))
+         ret = EXIT_SUCCESS;
+      goto errorexit;
+   }
+
+   if (listfile) {
+      PROG_ERR ("[%s] needs an output directory (-o)\n", listfile);
+      goto errorexit;
+   }
+
+   if (npositional > 0)
+      input = positional[0];
+   if (npositional > 1)
+      macros = positional[1];
+   if (npositional > 2) {
+      PROG_ERR ("Unexpected argument [%s]\n", positional[2]);
+      goto errorexit;
+   }
+
+   if (sax) {
+      static const babylon_sax_t events = {
+         sax_start_tag, sax_end_tag, sax_text,
+         sax_include_begin, sax_include_end,
+      };
+      int err = babylon_text_sax (input, &events, stdout);
+      if (err) {
+         PROG_ERR ("Error %i parsing [%s]\n", err, input);
+         goto errorexit;
+      }
+      ret = EXIT_SUCCESS;
       goto errorexit;
    }
 
-   if (!(m = babylon_macro_read (TEST_MACRO))) {
-      PROG_ERR ("Failed to read macros from [%s]\n", TEST_MACRO);
+   // The expansion needs the macros before any output is written.
+   if (transform) {
+      if (!(m = load_macros (macros, builtin))) {
+         PROG_ERR ("Failed to read macros from [%s]\n", macros);
+         goto errorexit;
+      }
+   } else {
+      printf ("Starting babylon processing\n");
+   }
+
+   // Only a document read in parallel keeps the per-file trees that an
+   // incremental re-read can reuse.
+   if (cache)
+      b = babylon_text_read_cached (input, cachedir, nthreads);
+   else if (watch || parallel)
+      b = babylon_text_read_parallel (input, nthreads);
+   else
+      b = babylon_text_read (input);
+
+   if (!b) {
+      PROG_ERR ("Failed to read input from file [%s]:%m\n", input);
       goto errorexit;
    }
 
-   babylon_macro_dump (m, stdout);
+   if (!(write_output (b, m, input, deps, warn, memo, stats)) && !watch)
+      goto errorexit;
+
+   if (!transform) {
+      if (!(m = load_macros (macros, builtin))) {
+         PROG_ERR ("Failed to read macros from [%s]\n", macros);
+         goto errorexit;
+      }
+
+      babylon_macro_dump (m, stdout);
+   }
+
+   while (watch) {
+      sleep_ms (WATCH_INTERVAL_MS);
+
+      if (!(babylon_text_changed (b)))
+         continue;
+
+      babylon_text_t *nb = babylon_text_reread (b, nthreads);
+      if (!nb) {
+         PROG_ERR ("Failed to re-read [%s]\n", input);
+         continue;
+      }
+
+      babylon_text_del (b);
+      b = nb;
+
+      fprintf (stderr, "Re-read [%s]\n", input);
+      write_output (b, transform ? m : NULL, input, deps, warn, memo,
+                    stats);
+   }
 
    ret = EXIT_SUCCESS;
 
@@ -54,6 +665,9 @@ errorexit:
    babylon_text_del (b);
    babylon_macro_del (m);
 
+   for (size_t i=0; i<npositional; i++)
+      free (positional[i]);
+   free (positional);
+
    return ret;
 }
-
@@ -0,0 +1,350 @@
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifdef PLATFORM_POSIX
+#include <sys/stat.h>
+#include <sys/types.h>
+#define MKDIR(path)     mkdir ((path), 0777)
+#endif
+
+#ifdef PLATFORM_Windows
+#include <direct.h>
+#define MKDIR(path)     _mkdir ((path))
+#endif
+
+#define PROG_ERR(...)      do {\
+   fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
+   fprintf (stderr, __VA_ARGS__);\
+   fprintf (stderr, "\n");\
+} while (0)
+
+// Writes the synthetic documents that babylon_bench measures. Every
+// scenario is a directory holding main.bab, macros.bam and whatever
+// main.bab includes (by paths relative to the directory). The output
+// depends only on the scale, so a corpus can be generated again
+// anywhere and give the same numbers.
+
+/* ***************************************************************** */
+
+#define RNG_SEED     (0x9e3779b97f4a7c15ULL)
+
+static uint64_t rng_state = RNG_SEED;
+
+static uint32_t rng (uint32_t n)
+{
+   // xorshift64*
+   rng_state ^= rng_state >> 12;
+   rng_state ^= rng_state << 25;
+   rng_state ^= rng_state >> 27;
+   return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+static const char *words[] = {
+   "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+   "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+   "et", "dolore", "magna", "aliqua",
+};
+#define NWORDS    (sizeof words / sizeof words[0])
+
+static void write_words (FILE *outf, size_t n)
+{
+   for (size_t i=0; i<n; i++) {
+      fputs (words[rng (NWORDS)], outf);
+      fputc (i + 1 < n ? ' ' : '\n', outf);
+   }
+}
+
+// Joins the directory and the name into 'path', which holds PATH_SIZE
+// bytes.
+#define PATH_SIZE    (4096)
+
+static bool join_path (char *path, const char *dir, const char *name)
+{
+   int n = snprintf (path, PATH_SIZE, "%s/%s", dir, name);
+   if (n < 0 || n >= PATH_SIZE) {
+      PROG_ERR ("Path [%s/%s] is too long\n", dir, name);
+      return false;
+   }
+   return true;
+}
+
+static FILE *open_file (const char *dir, const char *name)
+{
+   char path[PATH_SIZE];
+   FILE *ret = NULL;
+
+   if (!(join_path (path, dir, name)))
+      return NULL;
+   if (!(ret = fopen (path, "w")))
+      PROG_ERR ("Failed to open [%s] for writing:%m\n", path);
+   return ret;
+}
+
+static bool close_file (FILE *outf)
+{
+   bool ret = !ferror (outf);
+   if (fclose (outf) != 0)
+      ret = false;
+   if (!ret)
+      PROG_ERR ("Failed to write file:%m\n");
+   return ret;
+}
+
+static bool make_dir (const char *path)
+{
+   if (MKDIR (path) != 0 && errno != EEXIST) {
+      PROG_ERR ("Failed to create directory [%s]:%m\n", path);
+      return false;
+   }
+   return true;
+}
+
+/* ***************************************************************** */
+
+// A tag's body starts with a child tag: words directly after the
+// attributes would be read as more attributes.
+
+// Chains of nested tags, each a few hundred levels deep.
+static bool gen_deep (FILE *doc, FILE *mac, size_t scale)
+{
+   const size_t nchains = 250 * scale,
+                depth = 200;
+
+   for (size_t i=0; i<nchains; i++) {
+      for (size_t d=0; d<depth; d++)
+         fprintf (doc, "[d n=%zu\n", d);
+      fprintf (doc, "[b x=%zu %s ]\n", i, words[rng (NWORDS)]);
+      for (size_t d=0; d<depth; d++) {
+         write_words (doc, 1 + rng (4));
+         fputs ("]\n", doc);
+      }
+   }
+
+   fputs ("d\n<div data-n=\"$(n)\">$(_body_)</div>\n\n"
+          "b\n<b data-x=\"$(x)\">$(_body_)</b>\n", mac);
+   return true;
+}
+
+// One level of many small tags between runs of text.
+static bool gen_wide (FILE *doc, FILE *mac, size_t scale)
+{
+   const size_t nitems = 100000 * scale;
+
+   for (size_t i=0; i<nitems; i++) {
+      fprintf (doc, "[i n=%zu %s ]\n", i, words[rng (NWORDS)]);
+      write_words (doc, 4 + rng (8));
+   }
+
+   fputs ("i\n<span id=\"i$(n)\">$(_body_)</span>\n", mac);
+   return true;
+}
+
+// Tags carrying many attributes, half of which the macro uses.
+static bool gen_attrs (FILE *doc, FILE *mac, size_t scale)
+{
+   const size_t ntags = 25000 * scale,
+                nattrs = 16;
+
+   for (size_t i=0; i<ntags; i++) {
+      fputs ("[a", doc);
+      for (size_t j=0; j<nattrs; j++)
+         fprintf (doc, " a%zu=%s%zu", j, words[rng (NWORDS)], i);
+      fprintf (doc, " %s ]\n", words[rng (NWORDS)]);
+   }
+
+   fputs ("a\n<p", mac);
+   for (size_t j=0; j<nattrs; j+=2)
+      fprintf (mac, " data-a%zu=\"$(a%zu)\"", j, j);
+   fputs (">$(_body_)</p>\n", mac);
+   return true;
+}
+
+// A document made of many included files, each of which includes the
+// same shared file.
+static bool gen_includes (const char *dir, FILE *doc, FILE *mac,
+                          size_t scale)
+{
+   const size_t nfiles = 400 * scale,
+                nsections = 20;
+   char path[PATH_SIZE];
+   FILE *outf = NULL;
+
+   if (!(join_path (path, dir, "inc")) || !(make_dir (path)))
+      return false;
+
+   if (!(outf = open_file (dir, "inc/common.bab")))
+      return false;
+   fputs ("[c common ]\n", outf);
+   write_words (outf, 32);
+   if (!(close_file (outf)))
+      return false;
+
+   for (size_t i=0; i<nfiles; i++) {
+      snprintf (path, sizeof path, "inc/f%04zu.bab", i);
+      fprintf (doc, "#include \"%s\"\n", path);
+      if (!(outf = open_file (dir, path)))
+         return false;
+      for (size_t j=0; j<nsections; j++) {
+         fprintf (outf, "[s n=%zu-%zu\n[c %s ]\n", i, j,
+                        words[rng (NWORDS)]);
+         write_words (outf, 16 + rng (16));
+         fputs ("]\n", outf);
+      }
+      fputs ("#include \"inc/common.bab\"\n", outf);
+      if (!(close_file (outf)))
+         return false;
+   }
+
+   fputs ("s\n<section id=\"s$(n)\">$(_body_)</section>\n\n"
+          "c\n<code>$(_body_)</code>\n", mac);
+   return true;
+}
+
+// A large macro set, every macro of which the document uses.
+static bool gen_macros (FILE *doc, FILE *mac, size_t scale)
+{
+   const size_t nmacros = 5000 * scale,
+                ntags = 50000 * scale;
+
+   for (size_t i=0; i<ntags; i++)
+      fprintf (doc, "[m%zu k=%zu %s ]\n", i % nmacros, i,
+                    words[rng (NWORDS)]);
+
+   for (size_t i=0; i<nmacros; i++) {
+      fprintf (mac, "%sm%zu\n<div class=\"m%zu\" data-k=\"$(k)\">\n",
+                    i ? "\n" : "", i, i);
+      for (size_t j=rng (3); j>0; j--)
+         write_words (mac, 4);
+      fputs ("$(_body_)\n</div>\n", mac);
+   }
+   return true;
+}
+
+/* ***************************************************************** */
+
+static const char *scenarios[] = {
+   "deep", "wide", "attrs", "includes", "macros",
+};
+#define NSCENARIOS   (sizeof scenarios / sizeof scenarios[0])
+
+static bool gen_scenario (const char *outdir, size_t n, size_t scale)
+{
+   bool error = true;
+   char dir[PATH_SIZE];
+   FILE *doc = NULL,
+        *mac = NULL;
+   bool ok = false;
+
+   // Each scenario is the same whichever others are generated with it.
+   rng_state = RNG_SEED;
+
+   if (!(join_path (dir, outdir, scenarios[n])) || !(make_dir (dir)))
+      goto errorexit;
+
+   if (!(doc = open_file (dir, "main.bab")) ||
+       !(mac = open_file (dir, "macros.bam")))
+      goto errorexit;
+
+   switch (n) {
+      case 0:  ok = gen_deep (doc, mac, scale);             break;
+      case 1:  ok = gen_wide (doc, mac, scale);             break;
+      case 2:  ok = gen_attrs (doc, mac, scale);            break;
+      case 3:  ok = gen_includes (dir, doc, mac, scale);    break;
+      case 4:  ok = gen_macros (doc, mac, scale);           break;
+   }
+   if (!ok) {
+      PROG_ERR ("Failed to generate [%s]\n", dir);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+
+   if (doc && !(close_file (doc)))
+      error = true;
+   if (mac && !(close_file (mac)))
+      error = true;
+
+   return !error;
+}
+
+static void print_help (const char *progname)
+{
+   printf ("Usage: %s [-s scale] outdir [scenario...]\n"
+           "Writes the benchmark scenarios (all of them if none are\n"
+           "named) to [outdir], each in its own directory. The scale\n"
+           "multiplies the size of every scenario [1].\n"
+           "Scenarios:",
+           progname);
+   for (size_t i=0; i<NSCENARIOS; i++)
+      printf (" %s", scenarios[i]);
+   printf ("\n");
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   size_t scale = 1;
+   const char *outdir = NULL;
+   int first = argc;
+
+   for (int i=1; i<argc; i++) {
+      if (!strcmp (argv[i], "-s") && i + 1 < argc) {
+         char *end = NULL;
+         unsigned long n = strtoul (argv[++i], &end, 10);
+         if (!end || *end || n == 0) {
+            PROG_ERR ("Invalid scale [%s]\n", argv[i]);
+            goto errorexit;
+         }
+         scale = n;
+      } else if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+         print_help (argv[0]);
+         return EXIT_SUCCESS;
+      } else {
+         outdir = argv[i];
+         first = i + 1;
+         break;
+      }
+   }
+
+   if (!outdir) {
+      print_help (argv[0]);
+      goto errorexit;
+   }
+
+   for (int j=first; j<argc; j++) {
+      size_t i = 0;
+      while (i < NSCENARIOS && strcmp (argv[j], scenarios[i]))
+         i++;
+      if (i == NSCENARIOS) {
+         PROG_ERR ("Unknown scenario [%s]\n", argv[j]);
+         goto errorexit;
+      }
+   }
+
+   if (!(make_dir (outdir)))
+      goto errorexit;
+
+   for (size_t i=0; i<NSCENARIOS; i++) {
+      bool wanted = first >= argc;
+      for (int j=first; j<argc && !wanted; j++)
+         wanted = !strcmp (argv[j], scenarios[i]);
+      if (wanted && !(gen_scenario (outdir, i, scale)))
+         goto errorexit;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+
+   return ret;
+}
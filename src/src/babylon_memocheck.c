@@ -0,0 +1,535 @@
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#ifdef PLATFORM_POSIX
+#include <unistd.h>
+#define CHDIR(path)     chdir ((path))
+#define GETCWD(b, n)    getcwd ((b), (n))
+#endif
+
+#ifdef PLATFORM_Windows
+#include <direct.h>
+#define CHDIR(path)     _chdir ((path))
+#define GETCWD(b, n)    _getcwd ((b), (n))
+#endif
+
+#include "babylon_text.h"
+
+#define PROG_ERR(...)      do {\
+   fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
+   fprintf (stderr, __VA_ARGS__);\
+   fprintf (stderr, "\n");\
+} while (0)
+
+// Checks the expansion cache against the expansion without it. Every
+// document is expanded once without the cache, then repeatedly with it
+// at several limits, and each output and count of inherited variables
+// must be the same as the first.
+//
+// The documents are the scenario directories named on the command line
+// (main.bab with macros.bam, as written by babylon_corpus) and random
+// ones written to the work directory. These repeat subtrees from a small
+// pool, in and out of for-each bodies, under different variables and
+// from included files, so that entries are both reused and rightly
+// turned down.
+//
+// Built with BABYLON_MEMO_COLLIDE, the library gives every subtree the
+// same key, and only comparing the subtrees keeps them apart.
+
+#define DEFAULT_COUNT      (200)
+#define NINCLUDES          (3)
+
+// The limits the cache is checked at: one that evicts all the time, one
+// that evicts now and then and one that never does.
+static const size_t limits[] = { 600, 8192, 64 << 20 };
+#define NLIMITS   (sizeof limits / sizeof limits[0])
+#define NPASSES   (2)
+
+/* ***************************************************************** */
+
+#define RNG_SEED     (0x9e3779b97f4a7c15ULL)
+
+static uint64_t rng_state = RNG_SEED;
+
+static uint32_t rng (uint32_t n)
+{
+   // xorshift64*
+   rng_state ^= rng_state >> 12;
+   rng_state ^= rng_state << 25;
+   rng_state ^= rng_state >> 27;
+   return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+// Variables are only used where they are set, and links only go to the
+// sections that every document starts with.
+static const char macros[] =
+   "item\n<i>$(name)</i>\n\n"
+   "badge\n<span class=\"badge\">$(_body_)</span>\n\n"
+   "b\n<b>$(_body_)</b>\n\n"
+   "outer\n<div>$(_body_)</div>\n\n"
+   "note\n<p style=\"$(color)\">$(_body_)</p>\n\n"
+   "opt\n<i $(_optional_ c=$(color))>$(_body_)</i>\n\n"
+   "list\n<ul>$(_body_)</ul>\n\n"
+   "li\n<li>$(_body_)</li>\n\n"
+   "section\n<section $(_optional_ id=\"$(_id_)\")>$(_body_)</section>\n\n"
+   "link\n<a href=\"#$(_ref_)\">$(_body_)</a>\n\n"
+   "wrap\n<div>$(_body_)</div>\n\n"
+   "inner\n<em k=\"$(k)\">$(_body_)</em>\n";
+
+#define NNAMES       (4)
+
+/* ***************************************************************** */
+
+// A string that random subtrees are built in.
+struct str_t {
+   char *data;
+   size_t len;
+   size_t size;
+};
+
+static bool str_add (struct str_t *s, const char *fmt, ...)
+   __attribute__ ((format (printf, 2, 3)));
+
+static bool str_add (struct str_t *s, const char *fmt, ...)
+{
+   va_list ap;
+
+   for (;;) {
+      size_t room = s->size - s->len;
+      va_start (ap, fmt);
+      int n = s->data ? vsnprintf (&s->data[s->len], room, fmt, ap) : -1;
+      va_end (ap);
+      if (n >= 0 && (size_t)n < room) {
+         s->len += (size_t)n;
+         return true;
+      }
+      size_t newsize = s->size ? s->size * 2 : 1024;
+      while (n >= 0 && newsize < s->len + (size_t)n + 1)
+         newsize *= 2;
+      char *tmp = realloc (s->data, newsize);
+      if (!tmp) {
+         PROG_ERR ("OOM\n");
+         return false;
+      }
+      s->data = tmp;
+      s->size = newsize;
+   }
+}
+
+// What the enclosing tags set for a subtree.
+struct ctx_t {
+   bool color;
+   bool k;
+   bool foreach;
+   bool include;
+};
+
+#define POOL_SIZE    (8)
+#define DEPTH_MAX    (4)
+
+// Earlier subtrees, which are written again for the cache to find; each
+// is kept with the context it needs and the depth it was made for, below
+// which it would be too deep.
+static struct {
+   char *tree;
+   struct ctx_t ctx;
+   size_t depth;
+} pool[POOL_SIZE];
+
+static bool fits (const struct ctx_t *need, const struct ctx_t *have)
+{
+   return (!need->color || have->color) && (!need->k || have->k)
+       && (!need->foreach || have->foreach)
+       && (!need->include || have->include);
+}
+
+static bool gen_tree (struct str_t *s, struct ctx_t *have, size_t depth,
+                      struct ctx_t *need);
+
+static bool gen_kids (struct str_t *s, struct ctx_t *have, size_t depth,
+                      struct ctx_t *need)
+{
+   for (uint32_t i=1 + rng (3); i>0; i--) {
+      if (!(str_add (s, " ")) || !(gen_tree (s, have, depth + 1, need)))
+         return false;
+   }
+   return str_add (s, " ]");
+}
+
+static bool gen_tree (struct str_t *s, struct ctx_t *have, size_t depth,
+                      struct ctx_t *need)
+{
+   // An earlier subtree comes back as it was.
+   uint32_t p = rng (POOL_SIZE);
+   if (rng (3) == 0 && pool[p].tree && pool[p].depth >= depth
+         && fits (&pool[p].ctx, have)) {
+      need->color |= pool[p].ctx.color;
+      need->k |= pool[p].ctx.k;
+      need->foreach |= pool[p].ctx.foreach;
+      need->include |= pool[p].ctx.include;
+      return str_add (s, "%s", pool[p].tree);
+   }
+
+   size_t start = s->len;
+   struct ctx_t mine = { false, false, false, false },
+                inner = *have;
+   bool ok = false;
+
+   switch (depth >= DEPTH_MAX ? rng (3) : rng (11)) {
+      case 0:
+         ok = str_add (s, "[b w%u ]", rng (NNAMES));
+         break;
+      case 1:
+         ok = str_add (s, "[badge [b n%u ] ]", rng (NNAMES));
+         break;
+      case 2:
+         if (have->foreach) {
+            mine.foreach = true;
+            ok = str_add (s, "[b $(item.name) ]");
+         } else {
+            ok = str_add (s, "[item name=w%u ]", rng (NNAMES));
+         }
+         break;
+      case 3:
+         inner.color = true;
+         ok = str_add (s, "[outer color=c%u", rng (NNAMES))
+           && gen_kids (s, &inner, depth, &mine);
+         mine.color = false;
+         break;
+      case 4:
+         mine.color = have->color;
+         ok = have->color ? str_add (s, "[note")
+                          : str_add (s, "[outer color=c%u [note",
+                                     rng (NNAMES));
+         ok = ok && gen_kids (s, &inner, depth, &mine)
+                 && (have->color || str_add (s, " ]"));
+         break;
+      case 5:
+         mine.color = have->color;
+         ok = str_add (s, "[opt") && gen_kids (s, &inner, depth, &mine);
+         break;
+      case 6:
+         // Each for-each goes over every item, so one in another would
+         // multiply the output.
+         if (have->foreach) {
+            ok = str_add (s, "[b w%u ]", rng (NNAMES));
+            break;
+         }
+         inner.foreach = true;
+         ok = str_add (s, "[list for-each=item [li")
+           && gen_kids (s, &inner, depth, &mine) && str_add (s, " ]");
+         mine.foreach = false;
+         break;
+      case 7:
+         ok = str_add (s, "[section name=s%u", rng (NNAMES))
+           && gen_kids (s, &inner, depth, &mine);
+         break;
+      case 8:
+         mine.foreach = have->foreach;
+         if (have->foreach && rng (2))
+            ok = str_add (s, "[link target=$(item.name)");
+         else
+            ok = str_add (s, "[link target=s%u", rng (NNAMES));
+         ok = ok && gen_kids (s, &inner, depth, &mine);
+         break;
+      case 9:
+         inner.k = true;
+         ok = str_add (s, "[wrap k=%u [inner", rng (NNAMES))
+           && gen_kids (s, &inner, depth, &mine) && str_add (s, " ]");
+         mine.k = false;
+         break;
+      case 10:
+         if (have->include) {
+            ok = str_add (s, "[b w%u ]", rng (NNAMES));
+            break;
+         }
+         mine.include = true;
+         ok = str_add (s, "[badge\n#include \"inc%u.bab\"\n]",
+                       rng (NINCLUDES));
+         break;
+   }
+   if (!ok)
+      return false;
+
+   need->color |= mine.color;
+   need->k |= mine.k;
+   need->foreach |= mine.foreach;
+   need->include |= mine.include;
+
+   if (rng (2)) {
+      char *tree = malloc (s->len - start + 1);
+      if (!tree) {
+         PROG_ERR ("OOM\n");
+         return false;
+      }
+      memcpy (tree, &s->data[start], s->len - start);
+      tree[s->len - start] = 0;
+      free (pool[p].tree);
+      pool[p].tree = tree;
+      pool[p].ctx = mine;
+      pool[p].depth = depth;
+   }
+   return true;
+}
+
+static bool write_file (const char *dir, const char *name, const char *data,
+                        size_t len)
+{
+   char path[4096];
+   FILE *outf = NULL;
+
+   int n = snprintf (path, sizeof path, "%s/%s", dir, name);
+   if (n < 0 || (size_t)n >= sizeof path) {
+      PROG_ERR ("Path [%s/%s] is too long\n", dir, name);
+      return false;
+   }
+   if (!(outf = fopen (path, "w"))) {
+      PROG_ERR ("Failed to open [%s] for writing:%m\n", path);
+      return false;
+   }
+
+   bool ret = fwrite (data, 1, len, outf) == len;
+   if (fclose (outf) != 0)
+      ret = false;
+   if (!ret)
+      PROG_ERR ("Failed to write [%s]:%m\n", path);
+   return ret;
+}
+
+// Writes main.bab, the files it includes and macros.bam to 'dir'.
+static bool write_random (const char *dir)
+{
+   bool error = true;
+   struct str_t s = { NULL, 0, 0 };
+   char name[32];
+
+   for (size_t i=0; i<POOL_SIZE; i++) {
+      free (pool[i].tree);
+      pool[i].tree = NULL;
+   }
+
+   // Included files may not include others, nor use anything that their
+   // includer might not set.
+   for (size_t i=0; i<NINCLUDES; i++) {
+      struct ctx_t have = { false, false, false, true },
+                   need = { false, false, false, false };
+      s.len = 0;
+      for (uint32_t j=1 + rng (3); j>0; j--) {
+         if (!(gen_tree (&s, &have, 1, &need)) || !(str_add (&s, "\n")))
+            goto errorexit;
+      }
+      snprintf (name, sizeof name, "inc%zu.bab", i);
+      if (!(write_file (dir, name, s.data, s.len)))
+         goto errorexit;
+   }
+
+   for (size_t i=0; i<POOL_SIZE; i++) {
+      free (pool[i].tree);
+      pool[i].tree = NULL;
+   }
+
+   s.len = 0;
+   for (size_t i=0; i<NNAMES; i++) {
+      if (!(str_add (&s, "[section name=s%zu [b t ] ]\n"
+                         "[section name=w%zu [b t ] ]\n"
+                         "[item name=w%zu ]\n", i, i, i)))
+         goto errorexit;
+   }
+   for (uint32_t i=4 + rng (40); i>0; i--) {
+      struct ctx_t have = { false, false, false, false },
+                   need = { false, false, false, false };
+      if (!(gen_tree (&s, &have, 0, &need)) || !(str_add (&s, "\n")))
+         goto errorexit;
+   }
+
+   if (!(write_file (dir, "main.bab", s.data, s.len))
+         || !(write_file (dir, "macros.bam", macros, sizeof macros - 1)))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+
+   free (s.data);
+   return !error;
+}
+
+/* ***************************************************************** */
+
+// The figures of a document over all the cached expansions.
+struct tally_t {
+   size_t hits;
+   size_t misses;
+   size_t evictions;
+};
+
+// Expands the document of 'dir' without the cache and then with it.
+// Returns false if the cache changed the output or the expansion failed;
+// '*mismatch' tells which.
+static bool check (const char *dir, struct tally_t *t, bool *mismatch)
+{
+   bool error = true;
+   char cwd[4096];
+   babylon_text_t *b = NULL;
+   babylon_macro_t *bm = NULL;
+   char *ref = NULL,
+        *out = NULL;
+   size_t reflen = 0,
+          len = 0;
+
+   *mismatch = false;
+
+   if (!GETCWD (cwd, sizeof cwd)) {
+      PROG_ERR ("Failed to get the current directory:%m\n");
+      return false;
+   }
+
+   // Included paths are relative to the directory of the document.
+   if (CHDIR (dir) != 0) {
+      PROG_ERR ("Failed to change to [%s]:%m\n", dir);
+      return false;
+   }
+
+   if (!(bm = babylon_macro_read ("macros.bam"))) {
+      PROG_ERR ("Failed to read [%s/macros.bam]\n", dir);
+      goto errorexit;
+   }
+
+   if (!(b = babylon_text_read ("main.bab")) || babylon_text_errcode (b)) {
+      PROG_ERR ("Failed to read [%s/main.bab]: %s\n", dir,
+                b ? babylon_text_errmsg (b) : "OOM");
+      goto errorexit;
+   }
+
+   if (!(ref = babylon_text_transform_str (b, bm, &reflen))) {
+      PROG_ERR ("Failed to expand [%s/main.bab]: %s\n", dir,
+                babylon_text_errmsg (b));
+      goto errorexit;
+   }
+   size_t inherited = babylon_text_inherited (b);
+
+   // Each limit starts with the entries left at the one before, which
+   // may have to be evicted first.
+   for (size_t i=0; i<NLIMITS; i++) {
+      babylon_text_memo_limit (b, limits[i]);
+      for (size_t pass=0; pass<NPASSES; pass++) {
+         babylon_stats_t st;
+
+         if (!(out = babylon_text_transform_str (b, bm, &len))) {
+            PROG_ERR ("Failed to expand [%s/main.bab] with the cache: %s\n",
+                      dir, babylon_text_errmsg (b));
+            goto errorexit;
+         }
+         if (len != reflen || memcmp (out, ref, len)
+               || babylon_text_inherited (b) != inherited) {
+            PROG_ERR ("The cache changed the output of [%s/main.bab] at "
+                      "limit %zu, pass %zu\n", dir, limits[i], pass + 1);
+            *mismatch = true;
+            goto errorexit;
+         }
+         babylon_free (out);
+         out = NULL;
+
+         babylon_text_stats (b, &st);
+         t->hits += st.memo_hits;
+         t->misses += st.memo_misses;
+         t->evictions += st.memo_evictions;
+      }
+   }
+
+   error = false;
+
+errorexit:
+
+   babylon_free (ref);
+   babylon_free (out);
+   babylon_text_del (b);
+   babylon_macro_del (bm);
+
+   if (CHDIR (cwd) != 0) {
+      PROG_ERR ("Failed to change back to [%s]:%m\n", cwd);
+      error = true;
+   }
+
+   return !error;
+}
+
+static void print_help (const char *progname)
+{
+   printf ("Usage: %s [-n count] workdir [scenario-dir...]\n"
+           "Expands every scenario named, and [count] random documents\n"
+           "written to [workdir], with and without the expansion cache\n"
+           "and fails if the cache changes the output [%i].\n",
+           progname, DEFAULT_COUNT);
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   size_t count = DEFAULT_COUNT;
+   const char *workdir = NULL;
+   int first = argc;
+   struct tally_t t = { 0, 0, 0 };
+   bool mismatch = false;
+
+   for (int i=1; i<argc; i++) {
+      if (!strcmp (argv[i], "-n") && i + 1 < argc) {
+         char *end = NULL;
+         count = strtoul (argv[++i], &end, 10);
+         if (!end || *end) {
+            PROG_ERR ("Invalid count [%s]\n", argv[i]);
+            goto errorexit;
+         }
+      } else if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+         print_help (argv[0]);
+         return EXIT_SUCCESS;
+      } else {
+         workdir = argv[i];
+         first = i + 1;
+         break;
+      }
+   }
+
+   if (!workdir) {
+      print_help (argv[0]);
+      goto errorexit;
+   }
+
+   // Reused section names are warned about in every document.
+   babylon_text_log_level (BABYLON_LOG_ERR);
+
+   for (int j=first; j<argc; j++) {
+      if (!(check (argv[j], &t, &mismatch)))
+         goto errorexit;
+   }
+
+   for (size_t i=0; i<count; i++) {
+      if (!(write_random (workdir)) || !(check (workdir, &t, &mismatch)))
+         goto errorexit;
+   }
+
+   printf ("%zu scenarios and %zu random documents expand alike with the "
+           "cache (%zu hits, %zu misses, %zu evictions)\n",
+           (size_t)(argc - first), count, t.hits, t.misses, t.evictions);
+   ret = EXIT_SUCCESS;
+
+errorexit:
+
+   // A document that the cache gets wrong is kept for a look.
+   if (mismatch && workdir)
+      fprintf (stderr, "The last random document is left in [%s]\n",
+               workdir);
+
+   for (size_t i=0; i<POOL_SIZE; i++)
+      free (pool[i].tree);
+
+   return ret;
+}
@@ -0,0 +1,317 @@
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "babylon_text.h"
+
+#define PROG_ERR(...)      do {\
+   fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
+   fprintf (stderr, __VA_ARGS__);\
+   fprintf (stderr, "\n");\
+} while (0)
+
+// Checks the lexer's scan kernels against each other. Every document is
+// read with each kernel the processor has, both into a tree and through
+// the SAX parser, and must come out the same as with the scalar kernel.
+//
+// The documents are the files named on the command line and random ones
+// written to the work directory. These are made of runs of every length
+// between the bytes the kernels stop at, so that a stop falls at each
+// position of a vector and in the tails, and they hold multi-byte and
+// invalid UTF-8.
+
+#define DEFAULT_COUNT      (2000)
+#define DOC_MAX            (4096)
+
+/* ***************************************************************** */
+
+#define RNG_SEED     (0x9e3779b97f4a7c15ULL)
+
+static uint64_t rng_state = RNG_SEED;
+
+static uint32_t rng (uint32_t n)
+{
+   // xorshift64*
+   rng_state ^= rng_state >> 12;
+   rng_state ^= rng_state << 25;
+   rng_state ^= rng_state >> 27;
+   return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+}
+
+static const char word_bytes[] = "abcxyz0129-_.$()/";
+
+// What goes between the runs; the empty string stands for a NUL.
+static const char *stops[] = {
+   " ", "\n", "\t", "\r", "\v", "\f", "", "\\", "\"", "#", "[", "]", "=",
+   "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xff", "\xc3",
+};
+#define NSTOPS    (sizeof stops / sizeof stops[0])
+
+static bool write_random (const char *path)
+{
+   FILE *outf = NULL;
+   size_t len = 1 + rng (DOC_MAX),
+          n = 0;
+
+   if (!(outf = fopen (path, "wb"))) {
+      PROG_ERR ("Failed to open [%s] for writing:%m\n", path);
+      return false;
+   }
+
+   while (n < len) {
+      for (size_t i=rng (70); i>0; i--, n++)
+         fputc (word_bytes[rng (sizeof word_bytes - 1)], outf);
+      const char *s = stops[rng (NSTOPS)];
+      if (*s)
+         fputs (s, outf);
+      else
+         fputc (0, outf);
+      n += *s ? strlen (s) : 1;
+   }
+
+   bool ret = !ferror (outf);
+   if (fclose (outf) != 0)
+      ret = false;
+   if (!ret)
+      PROG_ERR ("Failed to write [%s]:%m\n", path);
+   return ret;
+}
+
+/* ***************************************************************** */
+
+// The SAX events are written into a string, one to a line.
+struct events_t {
+   char *data;
+   size_t len;
+   size_t size;
+};
+
+static bool append (struct events_t *buf, const char *s, size_t len)
+{
+   if (buf->len + len + 1 > buf->size) {
+      size_t newsize = buf->size ? buf->size : 1024;
+      while (newsize < buf->len + len + 1)
+         newsize *= 2;
+      char *tmp = realloc (buf->data, newsize);
+      if (!tmp) {
+         PROG_ERR ("OOM\n");
+         return false;
+      }
+      buf->data = tmp;
+      buf->size = newsize;
+   }
+   memcpy (&buf->data[buf->len], s, len);
+   buf->len += len;
+   buf->data[buf->len] = 0;
+   return true;
+}
+
+static bool event (struct events_t *buf, const char *kind,
+                   const char *s, size_t len)
+{
+   return append (buf, kind, strlen (kind))
+       && append (buf, s, len)
+       && append (buf, "\n", 1);
+}
+
+static bool sax_start_tag (void *ctx, const char *name, size_t namelen,
+                           const babylon_attr_t *attrs, size_t nattrs)
+{
+   if (!(event (ctx, "start ", name, namelen)))
+      return false;
+   for (size_t i=0; i<nattrs; i++) {
+      if (!(event (ctx, "name ", attrs[i].name, attrs[i].namelen))
+            || !(event (ctx, "value ", attrs[i].value, attrs[i].valuelen)))
+         return false;
+   }
+   return true;
+}
+
+static bool sax_end_tag (void *ctx, const char *name, size_t namelen)
+{
+   return event (ctx, "end ", name, namelen);
+}
+
+static bool sax_text (void *ctx, const char *text, size_t len)
+{
+   return event (ctx, "text ", text, len);
+}
+
+static bool sax_include (void *ctx, const char *filename)
+{
+   return event (ctx, "include ", filename, strlen (filename));
+}
+
+/* ***************************************************************** */
+
+// What reading a document with one kernel gave.
+struct result_t {
+   int errcode;
+   bool written;
+   babylon_buffer_t tree;
+   int saxerr;
+   struct events_t sax;
+};
+
+static bool read_with (const char *path, struct result_t *r)
+{
+   static const babylon_sax_t events = {
+      sax_start_tag, sax_end_tag, sax_text, sax_include, sax_include,
+   };
+   babylon_text_t *b = NULL;
+
+   r->tree.len = 0;
+   r->sax.len = 0;
+
+   if (!(b = babylon_text_read (path))) {
+      PROG_ERR ("Failed to read [%s]\n", path);
+      return false;
+   }
+   r->errcode = babylon_text_errcode (b);
+   r->written = babylon_text_write_buffer (b, &r->tree);
+   babylon_text_del (b);
+
+   r->saxerr = babylon_text_sax (path, &events, &r->sax);
+   return true;
+}
+
+static bool same (const struct result_t *a, const struct result_t *b)
+{
+   return a->errcode == b->errcode && a->written == b->written
+       && a->tree.len == b->tree.len
+       && (!a->tree.len || !memcmp (a->tree.data, b->tree.data,
+                                    a->tree.len))
+       && a->saxerr == b->saxerr
+       && a->sax.len == b->sax.len
+       && (!a->sax.len || !memcmp (a->sax.data, b->sax.data, a->sax.len));
+}
+
+static const char *kernel_name (int kernel)
+{
+   switch (kernel) {
+      case BABYLON_SCAN_SCALAR:  return "scalar";
+      case BABYLON_SCAN_SSE42:   return "sse4.2";
+      case BABYLON_SCAN_AVX2:    return "avx2";
+   }
+   return "unknown";
+}
+
+// Reads the document with every kernel up to 'best'. Returns false on a
+// mismatch or an error, with 'mismatch' telling which.
+static bool check (const char *path, int best, struct result_t *results,
+                   bool *mismatch)
+{
+   *mismatch = false;
+
+   for (int k=BABYLON_SCAN_SCALAR; k<=best; k++) {
+      babylon_text_scan_kernel (k);
+      if (!(read_with (path, &results[k])))
+         return false;
+      if (k > BABYLON_SCAN_SCALAR
+            && !(same (&results[BABYLON_SCAN_SCALAR], &results[k]))) {
+         PROG_ERR ("The %s kernel disagrees with the scalar one on [%s]\n",
+                   kernel_name (k), path);
+         *mismatch = true;
+         return false;
+      }
+   }
+   return true;
+}
+
+static void print_help (const char *progname)
+{
+   printf ("Usage: %s [-n count] workdir [file...]\n"
+           "Reads every file named, and [count] random documents written\n"
+           "to [workdir], with each scan kernel the processor has and\n"
+           "fails if any of them differs from the scalar one [%i].\n",
+           progname, DEFAULT_COUNT);
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   size_t count = DEFAULT_COUNT;
+   const char *workdir = NULL;
+   int first = argc;
+   struct result_t results[BABYLON_SCAN_AVX2 + 1];
+   char path[4096];
+   bool mismatch = false;
+
+   memset (results, 0, sizeof results);
+
+   for (int i=1; i<argc; i++) {
+      if (!strcmp (argv[i], "-n") && i + 1 < argc) {
+         char *end = NULL;
+         count = strtoul (argv[++i], &end, 10);
+         if (!end || *end) {
+            PROG_ERR ("Invalid count [%s]\n", argv[i]);
+            goto errorexit;
+         }
+      } else if (!strcmp (argv[i], "-h") || !strcmp (argv[i], "--help")) {
+         print_help (argv[0]);
+         return EXIT_SUCCESS;
+      } else {
+         workdir = argv[i];
+         first = i + 1;
+         break;
+      }
+   }
+
+   if (!workdir) {
+      print_help (argv[0]);
+      goto errorexit;
+   }
+
+   int n = snprintf (path, sizeof path, "%s/scancheck.bab", workdir);
+   if (n < 0 || (size_t)n >= sizeof path) {
+      PROG_ERR ("Path [%s] is too long\n", workdir);
+      goto errorexit;
+   }
+
+   // Random documents are mostly not well formed and would fill stderr.
+   babylon_text_log_level (BABYLON_LOG_NONE);
+   int best = babylon_text_scan_kernel (BABYLON_SCAN_AUTO);
+
+   printf ("Kernels:");
+   for (int k=BABYLON_SCAN_SCALAR; k<=best; k++)
+      printf (" %s", kernel_name (k));
+   printf ("\n");
+   fflush (stdout);
+
+   for (int j=first; j<argc; j++) {
+      if (!(check (argv[j], best, results, &mismatch)))
+         goto errorexit;
+      mismatch = false;
+   }
+
+   for (size_t i=0; i<count; i++) {
+      if (!(write_random (path)) || !(check (path, best, results,
+                                             &mismatch)))
+         goto errorexit;
+   }
+
+   printf ("%zu files and %zu random documents read alike\n",
+           (size_t)(argc - first), count);
+   remove (path);
+   ret = EXIT_SUCCESS;
+
+errorexit:
+
+   // A document that tells the kernels apart is kept for a look.
+   if (mismatch)
+      fprintf (stderr, "The document is left in [%s]\n", path);
+
+   babylon_text_scan_kernel (BABYLON_SCAN_AUTO);
+   for (size_t k=0; k<sizeof results / sizeof results[0]; k++) {
+      babylon_free (results[k].tree.data);
+      free (results[k].sax.data);
+   }
+
+   return ret;
+}
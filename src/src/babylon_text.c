@@ -1,903 +1,7395 @@
 
+#ifdef PLATFORM_POSIX
+#define _XOPEN_SOURCE      700
+#endif
+
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef PLATFORM_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#endif
 
 #include "babylon_text.h"
 
-#include "ds_array.h"
-#include "ds_str.h"
-#include "ds_hmap.h"
+// Diagnostics are written when their level is no higher than the one
+// set with babylon_text_log_level(), which costs a single comparison
+// when they are not. Those above BABYLON_LOG_MAX are not compiled in.
+#ifndef BABYLON_LOG_MAX
+#ifdef DEBUG
+#define BABYLON_LOG_MAX       BABYLON_LOG_DEBUG
+#else
+#define BABYLON_LOG_MAX       BABYLON_LOG_INFO
+#endif
+#endif
+
+#define LOG_ENABLED(level)      \
+   ((level) <= BABYLON_LOG_MAX && (level) <= log_level)
+
+#define LOG_AT(level, ...)      do {\
+   if (LOG_ENABLED (level))\
+      log_write (__FILE__, __LINE__, __func__, __VA_ARGS__);\
+} while (0)
 
-#define LOG_ERR(...)      do {\
-   fprintf (stderr, "%s:%i:%s:", __FILE__, __LINE__, __func__);\
-   fprintf (stderr, __VA_ARGS__);\
-   fprintf (stderr, "\n");\
+// A diagnostic about the input rather than the library, which carries
+// its own location in the source.
+#define LOG_INPUT(level, ...)   do {\
+   if (LOG_ENABLED (level))\
+      log_write (NULL, 0, NULL, __VA_ARGS__);\
 } while (0)
 
+#define LOG_ERR(...)          LOG_AT (BABYLON_LOG_ERR, __VA_ARGS__)
+#define LOG_WARN(...)         LOG_AT (BABYLON_LOG_WARN, __VA_ARGS__)
+#define LOG_INFO(...)         LOG_AT (BABYLON_LOG_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)        LOG_AT (BABYLON_LOG_DEBUG, __VA_ARGS__)
 
-/* ************************************************************** */
+static int log_level = BABYLON_LOG_WARN;
 
-enum node_type_t {
-   node_NODE,
-   node_VALUE
-};
+#ifdef __GNUC__
+static void log_write (const char *file, int line, const char *func,
+                       const char *fmt, ...)
+   __attribute__ ((format (printf, 4, 5)));
+#endif
+
+// The message is formatted in one buffer and written in one call, so
+// that messages from different threads are not interleaved.
+static void log_write (const char *file, int line, const char *func,
+                       const char *fmt, ...)
+{
+   char buf[1024];
+   int saved = errno;
+   va_list ap;
+
+   int n = file ? snprintf (buf, sizeof buf, "%s:%i:%s:", file, line, func)
+                : 0;
+   if (n < 0 || (size_t)n >= sizeof buf)
+      n = 0;
+
+   // %m in the message is the error of the call that failed.
+   errno = saved;
+   va_start (ap, fmt);
+   vsnprintf (&buf[n], sizeof buf - n, fmt, ap);
+   va_end (ap);
+
+   size_t len = strlen (buf);
+   if (len + 1 >= sizeof buf)
+      len = sizeof buf - 2;
+   buf[len++] = '\n';
+
+   fwrite (buf, 1, len, stderr);
+}
 
-typedef struct node_t node_t;
+void babylon_text_log_level (int level)
+{
+   log_level = level;
+}
 
-struct node_t {
-   // Token location
-   char *filename;
-   size_t line;
-   size_t charpos;
+/* ************************************************************** */
 
-   // The actual token.
-   // Each node is either a pointer to another tree or a value. If it's a
-   // NODE type then 'text' contains the tag value, otherwise 'text'
-   // contains the text of the token and the remaining fields are ignored.
-   enum node_type_t type;
-   char *text;
-   ds_hmap_t *hmap;
-   void **nodes;
-};
+// Everything the library allocates, from trees to error messages, comes
+// from the allocator set with babylon_set_allocator(). The string
+// helpers below stand in for libds, which allocates with malloc().
 
-static void node_dump (node_t *node, FILE *outf)
+static void *std_alloc (void *ctx, size_t size)
 {
-   if (!outf)
-      outf = stdout;
+   (void)ctx;
+   return malloc (size);
+}
 
-   fprintf (outf, "%30s: %p\n", "START NODE", node);
-   if (!node) {
-      fprintf (outf, "%30s: %p\n", "END  NODE", node);
-      return;
-   }
+static void *std_realloc (void *ctx, void *ptr, size_t size)
+{
+   (void)ctx;
+   return realloc (ptr, size);
+}
 
-   fprintf (outf, "%30s: %s\n",      "filename", node->filename);
-   fprintf (outf, "%30s: %zu\n",     "line",     node->line);
-   fprintf (outf, "%30s: %zu\n",     "charpos",  node->charpos);
-   fprintf (outf, "%30s: %i\n",      "type",     node->type);
-   fprintf (outf, "%30s: %s\n",      "text",     node->text);
-
-   if (node->type == node_NODE) {
-      size_t nkeys = 0;
-      char **keys = NULL;
-      size_t *keylens = NULL;
-
-      nkeys = ds_hmap_keys (node->hmap, (void ***)&keys, &keylens);
-      for (size_t i=0; i<nkeys; i++) {
-         char *value = NULL;
-         if (!(ds_hmap_get_str_str (node->hmap, keys[i], &value))) {
-            LOG_ERR ("Failed to get key for [%s]\n", keys[i]);
-         } else {
-            fprintf (outf, "%30s => %s\n", keys[i], value);
-         }
-      }
-      free (keys);
-      free (keylens);
-   }
+static void std_free (void *ctx, void *ptr)
+{
+   (void)ctx;
+   free (ptr);
+}
 
-   fprintf (outf, "----\n");
-   for (size_t i=0; node->nodes && node->nodes[i]; i++) {
-      node_dump (node->nodes[i], outf);
-   }
-   fprintf (outf, "%30s: %p\n", "END  NODE", node);
+static babylon_allocator_t mem = { std_alloc, std_realloc, std_free, NULL };
+
+void babylon_set_allocator (const babylon_allocator_t *allocator)
+{
+   static const babylon_allocator_t std = {
+      std_alloc, std_realloc, std_free, NULL
+   };
+
+   mem = allocator ? *allocator : std;
 }
 
-static void node_del (node_t *node)
+// Nothing is asked for with a size of zero, so that NULL always means
+// the allocator failed.
+static void *mem_malloc (size_t size)
 {
-   if (!node)
-      return;
+   return mem.alloc (mem.ctx, size ? size : 1);
+}
 
-   free (node->filename);
-   free (node->text);
+static void *mem_calloc (size_t nmemb, size_t size)
+{
+   if (size && nmemb > SIZE_MAX / size)
+      return NULL;
 
-   for (size_t i=0; node->nodes && node->nodes[i]; i++) {
-      node_del (node->nodes[i]);
-   }
-   ds_array_del (node->nodes);
+   void *ret = mem_malloc (nmemb * size);
+   if (ret)
+      memset (ret, 0, nmemb * size);
+   return ret;
+}
 
-   if (node->hmap) {
-      char **keys = NULL;
-      size_t *keylens = NULL;
+static void *mem_realloc (void *ptr, size_t size)
+{
+   return mem.realloc (mem.ctx, ptr, size ? size : 1);
+}
 
-      size_t nkeys = ds_hmap_keys (node->hmap, (void ***)&keys, &keylens);
-      for (size_t i=0; i<nkeys; i++) {
-         char *value = NULL;
-         ds_hmap_get_str_str (node->hmap, keys[i], &value);
-         free (value);
-      }
+static void mem_free (void *ptr)
+{
+   if (ptr)
+      mem.free (mem.ctx, ptr);
+}
 
-      free (keys);
-      free (keylens);
-      ds_hmap_del (node->hmap);
-   }
+void babylon_free (void *ptr)
+{
+   mem_free (ptr);
+}
 
-   free (node);
+static char *mem_strdup (const char *s)
+{
+   size_t len = strlen (s) + 1;
+   char *ret = mem_malloc (len);
+   if (ret)
+      memcpy (ret, s, len);
+   return ret;
 }
 
-static node_t *node_new (const char *filename, enum node_type_t type,
-                         const char *text, size_t line, size_t charpos)
+// Replaces '*dst' with the formatted string and returns its length. On
+// failure '*dst' is NULL.
+static size_t mem_printf (char **dst, const char *fmt, ...)
 {
-   bool error = true;
-   node_t *ret = NULL;
+   va_list ap;
 
-   if (!(ret = malloc (sizeof *ret))) {
-      LOG_ERR ("OOM\n");
-      goto errorexit;
-   }
+   mem_free (*dst);
+   *dst = NULL;
 
-   memset (ret, 0, sizeof *ret);
-   ret->filename = ds_str_dup (filename);
-   ret->text = ds_str_dup (text);
-   ret->type = type;
-   ret->line = line;
-   ret->charpos = charpos;
+   va_start (ap, fmt);
+   int len = vsnprintf (NULL, 0, fmt, ap);
+   va_end (ap);
+   if (len < 0 || !(*dst = mem_malloc ((size_t)len + 1)))
+      return 0;
 
-   if (type == node_NODE) {
-      if (!(ret->nodes = ds_array_new ())) {
-         LOG_ERR ("Cannot create new array of children for node\n");
-         goto errorexit;
-      }
-      if (!(ret->hmap = ds_hmap_new (4))) {
-         LOG_ERR ("Cannot create hashmap for node\n");
-         goto errorexit;
-      }
-   }
+   va_start (ap, fmt);
+   vsnprintf (*dst, (size_t)len + 1, fmt, ap);
+   va_end (ap);
 
-   if (!ret->filename || !ret->text) {
-      LOG_ERR ("OOM\n");
-      goto errorexit;
-   }
+   return (size_t)len;
+}
 
-   error = false;
+// Appends the strings, up to a NULL, to '*dst'. Returns '*dst', which
+// is left as it was on failure.
+static char *mem_append (char **dst, const char *s, ...)
+{
+   va_list ap;
+   size_t len = *dst ? strlen (*dst) : 0,
+          total = len;
 
-errorexit:
+   va_start (ap, s);
+   for (const char *p=s; p; p=va_arg (ap, const char *))
+      total += strlen (p);
+   va_end (ap);
 
-   if (error) {
-      node_del (ret);
-      ret = NULL;
+   char *tmp = mem_realloc (*dst, total + 1);
+   if (!tmp)
+      return NULL;
+   *dst = tmp;
+
+   va_start (ap, s);
+   for (const char *p=s; p; p=va_arg (ap, const char *)) {
+      size_t plen = strlen (p);
+      memcpy (&tmp[len], p, plen);
+      len += plen;
    }
+   va_end (ap);
+   tmp[len] = 0;
 
-   return ret;
+   return tmp;
 }
 
 /* ************************************************************** */
 
-// TODO: These functions make this module thread-unsafe. Refactor into a
-// different module that maintains thread-safety
-static void **g_instream = NULL;
-void g_instream_cleanup (void)
+// Seconds on a clock that only moves forward, for timing the phases.
+static double clock_now (void)
 {
-   if (g_instream) {
-      ds_array_del (g_instream);
-      g_instream = NULL;
-   }
+#ifdef PLATFORM_POSIX
+   struct timespec ts;
+   if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+      return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+   return (double)clock () / CLOCKS_PER_SEC;
 }
 
-static int get_next_char (FILE *inf, size_t *line, size_t *charpos)
+/* ************************************************************** */
+
+// Output is produced in many small pieces. In memory they are appended
+// to a babylon_buffer_t. A file gets them through an outfile_t, which
+// copies them into a block of OUTFILE_SIZE bytes; a piece that does not
+// fit in what is left of the block is not copied but written together
+// with the block in a single writev() on the file's descriptor.
+// Elsewhere the block and the piece are passed to fwrite().
+
+static bool buffer_sink (void *ctx, const char *data, size_t len)
 {
-   if (!g_instream) {
-      if (!(g_instream = ds_array_new ())) {
-         LOG_ERR ("Fatal error creating array\n");
-         return 0;
-      }
-      atexit (g_instream_cleanup);
+   babylon_buffer_t *buf = ctx;
+
+   if (buf->len + len + 1 > buf->size) {
+      size_t newsize = buf->size ? buf->size : 4096;
+      while (newsize < buf->len + len + 1)
+         newsize *= 2;
+      char *tmp = mem_realloc (buf->data, newsize);
+      if (!tmp)
+         return false;
+      buf->data = tmp;
+      buf->size = newsize;
    }
 
-   if (ds_array_length (g_instream) > 0) {
-      return (int) (intptr_t) ds_array_remove_tail (&g_instream);
-   }
+   memcpy (&buf->data[buf->len], data, len);
+   buf->len += len;
+   buf->data[buf->len] = 0;
+   return true;
+}
 
-   int ret = fgetc (inf);
+#define OUTFILE_SIZE       (64 * 1024)
 
-   (*charpos) += 1;
+struct outfile_t {
+   FILE *outf;
+   char *s;
+   size_t len;
+};
 
-   if (ret == '\n') {
-      (*line) += 1;
-      (*charpos) = 0;
+#ifdef PLATFORM_POSIX
+static bool outfile_writev (int fd, struct iovec *iov, int niov)
+{
+   while (niov) {
+      ssize_t n = writev (fd, iov, niov);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0)
+         return false;
+      // Resume after a short write where it stopped.
+      while (niov && (size_t)n >= iov->iov_len) {
+         n -= (ssize_t)iov->iov_len;
+         iov++;
+         niov--;
+      }
+      if (niov) {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= (size_t)n;
+      }
    }
+   return true;
+}
+#endif
 
+// Writes the block followed by 'data' and empties the block.
+static bool outfile_flush (struct outfile_t *o, const char *data, size_t len)
+{
+#ifdef PLATFORM_POSIX
+   struct iovec iov[2] = {
+      { o->s, o->len }, { (void *)data, len }
+   };
+   bool ret = outfile_writev (fileno (o->outf), iov, 2);
+#else
+   bool ret = fwrite (o->s, 1, o->len, o->outf) == o->len
+            && (!len || fwrite (data, 1, len, o->outf) == len);
+#endif
+
+   o->len = 0;
+   if (!ret)
+      LOG_ERR ("Failed to write output:%m\n");
    return ret;
 }
 
-static void unget_char (int c, FILE *inf)
+static bool outfile_sink (void *ctx, const char *data, size_t len)
 {
-   inf = inf;
+   struct outfile_t *o = ctx;
 
-   if (!g_instream) {
-      if (!(g_instream = ds_array_new ())) {
-         LOG_ERR ("Fatal error creating array\n");
-         return;
-      }
-      atexit (g_instream_cleanup);
+   if (len >= OUTFILE_SIZE - o->len)
+      return outfile_flush (o, data, len);
+
+   memcpy (&o->s[o->len], data, len);
+   o->len += len;
+   return true;
+}
+
+// What the caller has already written to 'outf' is flushed first, so
+// that it comes before the output.
+static bool outfile_open (struct outfile_t *o, FILE *outf)
+{
+   o->outf = outf;
+   o->len = 0;
+
+   if (!(o->s = mem_malloc (OUTFILE_SIZE))) {
+      LOG_ERR ("OOM\n");
+      return false;
    }
 
-   if (!(ds_array_ins_tail (&g_instream, (void *)(intptr_t)c))) {
-      LOG_ERR ("Fatal error creating array\n");
-      return;
+   if (fflush (outf) != 0) {
+      LOG_ERR ("Failed to write output:%m\n");
+      mem_free (o->s);
+      return false;
    }
+
+   return true;
 }
 
-static char *get_next_word (FILE *inf, const char *extra_delims,
-                            int *delim_dst,
-                            size_t *line, size_t *charpos)
+static bool outfile_close (struct outfile_t *o)
 {
-   bool error = true;
-   char *ret = NULL;
+   bool ret = !o->len || outfile_flush (o, NULL, 0);
+   mem_free (o->s);
+   return ret;
+}
 
-   int c = 0;
-   bool inq = false;
 
-   *delim_dst = EOF;
+/* ************************************************************** */
 
-   while ((c = get_next_char (inf, line, charpos)) != EOF) {
-      char tmp[2];
+// All the memory for a parsed tree comes from an arena belonging to the
+// document. Allocations are bumped out of large blocks and are never
+// freed individually; deleting the arena releases the whole tree in one
+// go. Resources that cannot live in the arena (mapped input files,
+// hashmaps) register a cleanup function that runs when the arena is
+// deleted.
+
+#define ARENA_BLOCK_SIZE      (64 * 1024)
+#define ARENA_ALIGN           (16)
+#define ARENA_ROUND(x)        (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_block_t {
+   struct arena_block_t *next;
+   size_t size;
+   size_t used;
+};
 
-      if (c=='\\') {
-         if ((c = get_next_char (inf, line, charpos)) == EOF)
-            break;
-      }
+struct arena_cleanup_t {
+   struct arena_cleanup_t *next;
+   void (*fptr) (void *);
+   void *ptr;
+};
 
-      if (c=='"') {
-         inq = !inq;
-         continue;
-      }
+struct arena_t {
+   struct arena_block_t *blocks;
+   struct arena_cleanup_t *cleanups;
 
-      if (!inq) {
-         if (isspace (c) || strchr (extra_delims, (char)c)) {
-            *delim_dst = (char)c;
-            break;
-         }
-      }
+   size_t nblocks;
+   size_t nbytes;
+};
 
-      tmp[0] = c;
-      tmp[1] = 0;
-      if (!(ds_str_append (&ret, tmp, NULL))) {
-         goto errorexit;
-      }
-   }
+#define ARENA_HDR       ARENA_ROUND (sizeof (struct arena_block_t))
 
-   if (!ret)
-      goto errorexit;
+static struct arena_t *arena_new (void)
+{
+   struct arena_t *ret = mem_malloc (sizeof *ret);
+   if (!ret) {
+      LOG_ERR ("OOM\n");
+      return NULL;
+   }
 
-   error = false;
+   memset (ret, 0, sizeof *ret);
+   return ret;
+}
 
-errorexit:
+static void arena_del (struct arena_t *arena)
+{
+   if (!arena)
+      return;
 
+   struct arena_cleanup_t *c = arena->cleanups;
+   while (c) {
+      c->fptr (c->ptr);
+      c = c->next;
+   }
 
-   if (error) {
-      free (ret);
-      ret = NULL;
+   struct arena_block_t *b = arena->blocks;
+   while (b) {
+      struct arena_block_t *next = b->next;
+      mem_free (b);
+      b = next;
    }
 
-   return ret;
+   mem_free (arena);
 }
 
-static char *get_next_line (FILE *inf, size_t *line, size_t *charpos)
+static void *arena_alloc (struct arena_t *arena, size_t nbytes)
 {
-   bool error = true;
-   char *ret = NULL;
+   struct arena_block_t *b = arena->blocks;
 
-   char tmp[2] = { 0, 0 };
-   int c = 0;
+   nbytes = ARENA_ROUND (nbytes ? nbytes : 1);
 
-   if (!inf || !line || !charpos)
-      goto errorexit;
+   if (!b || b->used + nbytes > b->size) {
+      // Oversized requests get a block of their own, placed behind the
+      // current block so that the current block is still filled.
+      size_t size = nbytes > ARENA_BLOCK_SIZE / 4 ? nbytes : ARENA_BLOCK_SIZE;
 
-   while ((c = get_next_char (inf, line, charpos))!=EOF) {
-      tmp[0] = c;
-      if (!(ds_str_append (&ret, tmp, NULL))) {
+      struct arena_block_t *nb = mem_malloc (ARENA_HDR + size);
+      if (!nb) {
          LOG_ERR ("OOM\n");
-         goto errorexit;
+         return NULL;
       }
-      if (c == '\n')
-         break;
-   }
 
-   error = false;
+      nb->size = size;
+      nb->used = 0;
+      arena->nblocks++;
+      arena->nbytes += ARENA_HDR + size;
 
-errorexit:
-   if (error) {
-      free (ret);
-      ret = NULL;
+      if (b && size != ARENA_BLOCK_SIZE) {
+         nb->next = b->next;
+         b->next = nb;
+      } else {
+         nb->next = b;
+         arena->blocks = nb;
+      }
+      b = nb;
    }
 
+   void *ret = (unsigned char *)b + ARENA_HDR + b->used;
+   b->used += nbytes;
    return ret;
 }
 
-static bool read_nv (FILE *inf, char **name, char **value,
-                     size_t *line, size_t *charpos)
+// Releases everything allocated from the arena except one block, which is
+// kept for the allocations that follow. Cleanups are not run.
+static void arena_reset (struct arena_t *arena)
 {
-   long stream_pos = ftell (inf);
-   size_t stream_line = *line;
-   size_t stream_charpos = *charpos;
-
-   int delim = 0;
-   char *l_name = NULL,
-        *l_value = NULL;
-
-   if ((l_name = get_next_word (inf, "#[]=", &delim, line, charpos))) {
-      if ((l_value = get_next_word (inf, "#[]", &delim, line, charpos))) {
-         *name = l_name;
-         *value = l_value;
-         return true;
+   struct arena_block_t *keep = NULL,
+                        *b = arena->blocks;
+
+   while (b) {
+      struct arena_block_t *next = b->next;
+      if (!keep && b->size == ARENA_BLOCK_SIZE) {
+         keep = b;
+         keep->used = 0;
+         keep->next = NULL;
+      } else {
+         mem_free (b);
       }
+      b = next;
    }
 
-   free (l_name);
-   free (l_value);
-
-   fseek (inf, SEEK_SET, stream_pos);
-   *line = stream_line;
-   *charpos = stream_charpos;
-   return false;
+   arena->blocks = keep;
+   arena->nblocks = keep ? 1 : 0;
+   arena->nbytes = keep ? ARENA_HDR + keep->size : 0;
 }
 
-/* ***************************************************************** */
+static char *arena_strndup (struct arena_t *arena, const char *s, size_t len)
+{
+   char *ret = arena_alloc (arena, len + 1);
+   if (!ret)
+      return NULL;
 
-static node_t *node_readfile (const char *filename);
-static node_t *node_read_next (node_t *parent,
-                               FILE *inf, const char *filename,
-                               size_t *line, size_t *charpos);
+   memcpy (ret, s, len);
+   ret[len] = 0;
+   return ret;
+}
 
-static node_t *read_tree (FILE *inf, const char *filename,
-                          size_t *line, size_t *charpos)
+static bool arena_defer (struct arena_t *arena, void (*fptr) (void *),
+                         void *ptr)
 {
-   bool error = true;
-   node_t *ret = NULL;
+   struct arena_cleanup_t *c = arena_alloc (arena, sizeof *c);
+   if (!c)
+      return false;
 
-   char *text = NULL;
-   int delim = 0;
+   c->fptr = fptr;
+   c->ptr = ptr;
+   c->next = arena->cleanups;
+   arena->cleanups = c;
+   return true;
+}
 
-   char *name = NULL,
-        *value = NULL;
+/* ************************************************************** */
 
-   // Discard the first character
-   int c = get_next_char (inf, line, charpos);
-   c = c;
+// A token is a span of bytes. Spans normally point straight into the
+// source buffer; only tokens that need rewriting (quotes, escapes) are
+// copied into a separate buffer.
+struct span_t {
+   const char *s;
+   size_t len;
+};
 
-   if (!(text = get_next_word (inf, "#[]", &delim, line, charpos))) {
-      LOG_ERR ("Failed to read tagname\n");
-      goto errorexit;
-   }
+static char *span_dup (const struct span_t *span)
+{
+   char *ret = mem_malloc (span->len + 1);
+   if (!ret)
+      return NULL;
 
-   if (!(ret = node_new (filename, node_NODE, text, *line, *charpos))) {
-      LOG_ERR ("Failed to create return node [%s]\n", text);
-      goto errorexit;
-   }
+   memcpy (ret, span->s, span->len);
+   ret[span->len] = 0;
+   return ret;
+}
 
-   while ((read_nv (inf, &name, &value, line, charpos))) {
-      if (!(ds_hmap_set_str_str (ret->hmap, name, value))) {
-         free (name);
-         free (value);
-         goto errorexit;
-      }
-      free (name);
-   }
+static char *span_adup (struct arena_t *arena, const struct span_t *span)
+{
+   return arena_strndup (arena, span->s, span->len);
+}
 
-   if (!(node_read_next (ret, inf, filename, line, charpos))) {
-      LOG_ERR ("Failed to append tree to node\n");
-      goto errorexit;
-   }
+static bool span_eq (const struct span_t *span, const char *str)
+{
+   return strlen (str) == span->len && memcmp (span->s, str, span->len) == 0;
+}
 
-   error = false;
+/* ************************************************************** */
 
-errorexit:
+// The input file is mapped (or, where mapping is unavailable, read in a
+// single call) into memory and lexed directly with a cursor. There is no
+// per-character stdio call and no pushback buffer: ungetting a character
+// is simply a rewind of the cursor.
+struct instream_t {
+   const char *data;
+   size_t len;
+   size_t pos;
+   bool mapped;
+
+   // Offsets of the start of each line, built on first use. Locations
+   // are stored as byte offsets and only turned into line/column when
+   // they need to be displayed.
+   uint32_t *lines;
+   size_t nlines;
+
+   // The data belongs to the caller and is not released.
+   bool borrowed;
+};
 
-   free (text);
+static void instream_close (struct instream_t *in)
+{
+   if (!in)
+      return;
 
-   if (error) {
-      node_del (ret);
-      ret = NULL;
+#ifdef PLATFORM_POSIX
+   if (in->mapped) {
+      munmap ((void *)in->data, in->len);
+   } else if (!in->borrowed) {
+      mem_free ((void *)in->data);
    }
+#else
+   if (!in->borrowed)
+      mem_free ((void *)in->data);
+#endif
 
-   return ret;
+   mem_free (in->lines);
+   mem_free (in);
 }
 
-static node_t *read_text (FILE *inf, const char *filename,
-                          size_t *line, size_t *charpos)
+static void instream_cleanup (void *in)
 {
-   node_t *ret = NULL;
-   char *text = NULL;
-
-   size_t o_line = *line,
-          o_charpos = *charpos;
+   instream_close (in);
+}
 
-   int delim = 0;
+static bool instream_index_lines (struct instream_t *in)
+{
+   size_t size = 64;
+   const char *p = in->data,
+              *end = in->data + in->len;
 
-   if (!(text = get_next_word (inf, "#[]", &delim, line, charpos))) {
+   if (!(in->lines = mem_malloc (size * sizeof *in->lines))) {
       LOG_ERR ("OOM\n");
-      goto errorexit;
+      return false;
    }
 
-   if (!(ret = node_new (filename, node_VALUE, text, o_line, o_charpos))) {
-      LOG_ERR ("Failure creating new node\n");
-      goto errorexit;
+   in->lines[in->nlines++] = 0;
+   while (p < end && (p = memchr (p, '\n', end - p))) {
+      p++;
+      if (in->nlines >= size) {
+         uint32_t *tmp = mem_realloc (in->lines, size * 2 * sizeof *tmp);
+         if (!tmp) {
+            LOG_ERR ("OOM\n");
+            return false;
+         }
+         in->lines = tmp;
+         size *= 2;
+      }
+      in->lines[in->nlines++] = (uint32_t)(p - in->data);
    }
 
-errorexit:
-   free (text);
-   return ret;
+   return true;
 }
 
-static node_t *read_directive (FILE *inf, const char *filename,
+// Turns a byte offset into a 0-based line and the column within it.
+static void instream_location (struct instream_t *in, uint32_t offset,
                                size_t *line, size_t *charpos)
 {
-   char *directive = NULL;
-   char *fname = NULL;
-   int delim = 0;
-   node_t *ret = NULL;
-
-   filename = filename;
-   // Discard the first character
-   get_next_char (inf, line, charpos);
-
-   if (!(directive = get_next_word (inf, "[]", &delim, line, charpos))) {
-      LOG_ERR ("Failed to get directive after #\n");
-      goto errorexit;
-   }
+   *line = 0;
+   *charpos = offset;
 
-   LOG_ERR ("Running directive [%s]\n", directive);
-   if ((strcmp (directive, "include"))==0) {
-      if (!(fname = get_next_word (inf, "[]", &delim, line, charpos))) {
-         LOG_ERR ("Failed to include directive\n");
-         goto errorexit;
-      }
+   if (!in->lines && !(instream_index_lines (in)))
+      return;
 
-      LOG_ERR ("Loading [%s]\n", fname);
-      ret = node_readfile (fname);
+   size_t lo = 0,
+          hi = in->nlines;
+   while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (in->lines[mid] <= offset)
+         lo = mid;
+      else
+         hi = mid;
    }
 
-errorexit:
-   free (directive);
-   free (fname);
-   return ret;
+   *line = lo;
+   *charpos = offset - in->lines[lo];
 }
 
-static node_t *node_read_next (node_t *parent,
-                               FILE *inf, const char *filename,
-                               size_t *line, size_t *charpos)
+static struct instream_t *instream_open (const char *filename)
 {
    bool error = true;
-   node_t *ret = NULL,
-          *cur = NULL;
+   struct instream_t *ret = NULL;
+   char *buf = NULL;
+   FILE *inf = NULL;
 
-   int c = 0;
+   if (!(ret = mem_malloc (sizeof *ret))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
 
-   if (!parent) {
-      if (!(ret = node_new (filename, node_NODE, "root", *line, *charpos))) {
-         LOG_ERR ("OOM\n");
-         goto errorexit;
+   memset (ret, 0, sizeof *ret);
+
+#ifdef PLATFORM_POSIX
+   int fd = -1;
+   struct stat sb;
+
+   if ((fd = open (filename, O_RDONLY)) < 0) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", filename);
+      goto errorexit;
+   }
+
+   if ((fstat (fd, &sb)) == 0 && S_ISREG (sb.st_mode) && sb.st_size > 0) {
+      void *map = mmap (NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE,
+                        fd, 0);
+      if (map != MAP_FAILED) {
+         ret->data = map;
+         ret->len = (size_t)sb.st_size;
+         ret->mapped = true;
       }
    }
 
-   while ((c = get_next_char (inf, line, charpos)) != EOF) {
+   close (fd);
 
-      node_t *tmp = parent ? parent : ret;
+   if (ret->mapped) {
+      error = false;
+      goto errorexit;
+   }
+#endif
 
-      if ((isspace (c)))
+   // Fallback: read the entire file in one call.
+   if (!(inf = fopen (filename, "rb"))) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", filename);
+      goto errorexit;
+   }
+
+   if ((fseek (inf, 0, SEEK_END)) != 0) {
+      LOG_ERR ("Failed to determine size of [%s]:%m\n", filename);
+      goto errorexit;
+   }
+
+   long flen = ftell (inf);
+   if (flen < 0 || (fseek (inf, 0, SEEK_SET)) != 0) {
+      LOG_ERR ("Failed to determine size of [%s]:%m\n", filename);
+      goto errorexit;
+   }
+
+   if (!(buf = mem_malloc ((size_t)flen + 1))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   if ((fread (buf, 1, (size_t)flen, inf)) != (size_t)flen) {
+      LOG_ERR ("Failed to read [%s]:%m\n", filename);
+      goto errorexit;
+   }
+
+   buf[flen] = 0;
+   ret->data = buf;
+   ret->len = (size_t)flen;
+   buf = NULL;
+
+   error = false;
+
+errorexit:
+
+   if (inf)
+      fclose (inf);
+
+   mem_free (buf);
+
+   if (error) {
+      instream_close (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+/* ************************************************************** */
+
+// Every file that contributes nodes to a document is entered once in the
+// document's file table. Nodes refer to their file by index and to their
+// position by byte offset.
+
+struct srcfile_t {
+   char *path;
+   struct instream_t *in;
+
+   // The files this one includes, forming the document's dependency
+   // graph.
+   uint32_t *deps;
+   uint32_t ndeps;
+   uint32_t deps_size;
+};
+
+struct filetab_t {
+   struct srcfile_t *files;
+   uint32_t nfiles;
+   uint32_t size;
+};
+
+// Enters the file into the table and hands ownership of the stream to
+// the arena. Returns the index of the file or -1 on error.
+// The stream is not owned by the table; whoever registers it keeps it
+// alive for as long as the arena.
+static int32_t filetab_add (struct filetab_t *ft, struct arena_t *arena,
+                            const char *path, struct instream_t *in)
+{
+   if (in->len > UINT32_MAX) {
+      LOG_ERR ("File [%s] is too large\n", path);
+      return -1;
+   }
+
+   if (ft->nfiles >= ft->size) {
+      uint32_t newsize = ft->size ? ft->size * 2 : 8;
+      struct srcfile_t *tmp = arena_alloc (arena, newsize * sizeof *tmp);
+      if (!tmp)
+         return -1;
+
+      if (ft->nfiles)
+         memcpy (tmp, ft->files, ft->nfiles * sizeof *tmp);
+      ft->files = tmp;
+      ft->size = newsize;
+   }
+
+   struct srcfile_t *f = &ft->files[ft->nfiles];
+   memset (f, 0, sizeof *f);
+   if (!(f->path = arena_strndup (arena, path, strlen (path))))
+      return -1;
+   f->in = in;
+
+   return (int32_t)ft->nfiles++;
+}
+
+// Records that file 'from' includes file 'to'.
+static bool filetab_depend (struct filetab_t *ft, struct arena_t *arena,
+                            uint32_t from, uint32_t to)
+{
+   struct srcfile_t *f = &ft->files[from];
+
+   for (uint32_t i=0; i<f->ndeps; i++) {
+      if (f->deps[i] == to)
+         return true;
+   }
+
+   if (f->ndeps >= f->deps_size) {
+      uint32_t newsize = f->deps_size ? f->deps_size * 2 : 4;
+      uint32_t *tmp = arena_alloc (arena, newsize * sizeof *tmp);
+      if (!tmp)
+         return false;
+
+      if (f->ndeps)
+         memcpy (tmp, f->deps, f->ndeps * sizeof *tmp);
+      f->deps = tmp;
+      f->deps_size = newsize;
+   }
+
+   f->deps[f->ndeps++] = to;
+   return true;
+}
+
+/* ************************************************************** */
+
+// A work-stealing task pool. Every worker owns a deque of tasks: it
+// pushes and pops its own tasks at the tail and, when that runs dry,
+// steals from the head of another worker's deque. Tasks may submit
+// further tasks. pool_run() makes the calling thread worker 0 and
+// returns once every submitted task, including those submitted while
+// running, has finished.
+//
+// Without pthreads all the tasks simply run on the calling thread.
+
+#ifdef PLATFORM_POSIX
+#define POOL_LOCK(x)       pthread_mutex_lock (x)
+#define POOL_UNLOCK(x)     pthread_mutex_unlock (x)
+#else
+#define POOL_LOCK(x)
+#define POOL_UNLOCK(x)
+#endif
+
+struct pool_t;
+
+struct pool_task_t {
+   void (*fptr) (struct pool_t *pool, size_t worker, void *arg);
+   void *arg;
+};
+
+struct pool_deque_t {
+#ifdef PLATFORM_POSIX
+   pthread_mutex_t lock;
+#endif
+   struct pool_task_t *tasks;
+   size_t head;
+   size_t tail;
+   size_t size;
+};
+
+struct pool_t {
+   size_t nworkers;
+   struct pool_deque_t *deques;
+
+#ifdef PLATFORM_POSIX
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+#endif
+   // Tasks submitted but not yet finished, and of those the ones that
+   // are still waiting in a deque. Both are protected by 'lock'.
+   size_t pending;
+   size_t queued;
+};
+
+static void pool_del (struct pool_t *pool)
+{
+   if (!pool)
+      return;
+
+   for (size_t i=0; i<pool->nworkers; i++) {
+#ifdef PLATFORM_POSIX
+      pthread_mutex_destroy (&pool->deques[i].lock);
+#endif
+      mem_free (pool->deques[i].tasks);
+   }
+#ifdef PLATFORM_POSIX
+   pthread_mutex_destroy (&pool->lock);
+   pthread_cond_destroy (&pool->cond);
+#endif
+   mem_free (pool->deques);
+   mem_free (pool);
+}
+
+// A worker count of zero means one worker per online processor.
+static struct pool_t *pool_new (size_t nworkers)
+{
+   struct pool_t *ret = NULL;
+
+#ifdef PLATFORM_POSIX
+   if (!nworkers) {
+      long nprocs = sysconf (_SC_NPROCESSORS_ONLN);
+      nworkers = nprocs > 0 ? (size_t)nprocs : 1;
+   }
+#else
+   nworkers = 1;
+#endif
+
+   if (!(ret = mem_calloc (1, sizeof *ret))
+         || !(ret->deques = mem_calloc (nworkers, sizeof *ret->deques))) {
+      LOG_ERR ("OOM\n");
+      mem_free (ret);
+      return NULL;
+   }
+
+   ret->nworkers = nworkers;
+#ifdef PLATFORM_POSIX
+   pthread_mutex_init (&ret->lock, NULL);
+   pthread_cond_init (&ret->cond, NULL);
+   for (size_t i=0; i<nworkers; i++)
+      pthread_mutex_init (&ret->deques[i].lock, NULL);
+#endif
+
+   return ret;
+}
+
+static bool pool_submit (struct pool_t *pool, size_t worker,
+                         void (*fptr) (struct pool_t *, size_t, void *),
+                         void *arg)
+{
+   struct pool_deque_t *dq = &pool->deques[worker];
+   bool ret = false;
+
+   // The task is counted before it becomes visible, so that 'pending'
+   // cannot drop to zero while it is still to be run.
+   POOL_LOCK (&pool->lock);
+   pool->pending++;
+   pool->queued++;
+   POOL_UNLOCK (&pool->lock);
+
+   POOL_LOCK (&dq->lock);
+   if (dq->head && dq->tail == dq->size) {
+      memmove (dq->tasks, &dq->tasks[dq->head],
+               (dq->tail - dq->head) * sizeof *dq->tasks);
+      dq->tail -= dq->head;
+      dq->head = 0;
+   }
+   if (dq->tail == dq->size) {
+      size_t newsize = dq->size ? dq->size * 2 : 16;
+      struct pool_task_t *tmp = mem_realloc (dq->tasks, newsize * sizeof *tmp);
+      if (!tmp) {
+         LOG_ERR ("OOM\n");
+         goto errorexit;
+      }
+      dq->tasks = tmp;
+      dq->size = newsize;
+   }
+   dq->tasks[dq->tail].fptr = fptr;
+   dq->tasks[dq->tail].arg = arg;
+   dq->tail++;
+   ret = true;
+
+errorexit:
+   POOL_UNLOCK (&dq->lock);
+
+   POOL_LOCK (&pool->lock);
+   if (!ret) {
+      pool->pending--;
+      pool->queued--;
+   }
+#ifdef PLATFORM_POSIX
+   pthread_cond_signal (&pool->cond);
+#endif
+   POOL_UNLOCK (&pool->lock);
+
+   return ret;
+}
+
+static bool pool_take (struct pool_t *pool, size_t worker,
+                       struct pool_task_t *dst)
+{
+   bool found = false;
+
+   for (size_t i=0; i<pool->nworkers && !found; i++) {
+      struct pool_deque_t *dq = &pool->deques[(worker + i) % pool->nworkers];
+      POOL_LOCK (&dq->lock);
+      if (dq->head < dq->tail) {
+         // Our own newest task is the most likely to be cache-hot; a
+         // stolen task is the oldest one, usually the biggest.
+         *dst = i ? dq->tasks[dq->head++] : dq->tasks[--dq->tail];
+         found = true;
+      }
+      POOL_UNLOCK (&dq->lock);
+   }
+
+   if (found) {
+      POOL_LOCK (&pool->lock);
+      pool->queued--;
+      POOL_UNLOCK (&pool->lock);
+   }
+
+   return found;
+}
+
+static void pool_work (struct pool_t *pool, size_t worker)
+{
+   struct pool_task_t task;
+
+   for (;;) {
+      if ((pool_take (pool, worker, &task))) {
+         task.fptr (pool, worker, task.arg);
+         POOL_LOCK (&pool->lock);
+         if (!--pool->pending) {
+#ifdef PLATFORM_POSIX
+            pthread_cond_broadcast (&pool->cond);
+#endif
+         }
+         POOL_UNLOCK (&pool->lock);
+         continue;
+      }
+
+      bool done = false;
+      POOL_LOCK (&pool->lock);
+#ifdef PLATFORM_POSIX
+      while (pool->pending && !pool->queued)
+         pthread_cond_wait (&pool->cond, &pool->lock);
+#endif
+      done = !pool->pending;
+      POOL_UNLOCK (&pool->lock);
+      if (done)
+         break;
+   }
+}
+
+#ifdef PLATFORM_POSIX
+struct pool_thread_t {
+   struct pool_t *pool;
+   size_t worker;
+};
+
+static void *pool_thread (void *arg)
+{
+   struct pool_thread_t *pt = arg;
+   pool_work (pt->pool, pt->worker);
+   return NULL;
+}
+#endif
+
+static void pool_run (struct pool_t *pool)
+{
+#ifdef PLATFORM_POSIX
+   pthread_t *threads = mem_calloc (pool->nworkers, sizeof *threads);
+   struct pool_thread_t *args = mem_calloc (pool->nworkers, sizeof *args);
+   size_t nthreads = 0;
+
+   // Worker 0 is this thread; should any thread fail to start, the
+   // remaining workers still drain every deque by stealing.
+   for (size_t i=1; threads && args && i<pool->nworkers; i++) {
+      args[i].pool = pool;
+      args[i].worker = i;
+      if ((pthread_create (&threads[nthreads], NULL, pool_thread, &args[i])))
+         break;
+      nthreads++;
+   }
+
+   pool_work (pool, 0);
+
+   for (size_t i=0; i<nthreads; i++)
+      pthread_join (threads[i], NULL);
+
+   mem_free (threads);
+   mem_free (args);
+#else
+   pool_work (pool, 0);
+#endif
+}
+
+/* ************************************************************** */
+
+// Names (tags and attribute names) are interned per document into small
+// integer ids. The table is open-addressed with linear probing; a slot
+// holds the id plus one, zero marking an empty slot.
+
+#define SYM_NONE     (UINT32_MAX)
+
+struct symtab_t {
+   struct span_t *names;
+   uint32_t nnames;
+   uint32_t names_size;
+
+   uint32_t *slots;
+   uint32_t nslots;
+};
+
+static uint32_t sym_hash (const char *s, size_t len)
+{
+   uint32_t h = 2166136261u;
+   for (size_t i=0; i<len; i++) {
+      h ^= (unsigned char)s[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static void symtab_free (struct symtab_t *st)
+{
+   mem_free (st->names);
+   mem_free (st->slots);
+   memset (st, 0, sizeof *st);
+}
+
+static uint32_t symtab_find (const struct symtab_t *st, const char *s,
+                             size_t len)
+{
+   if (!st->nslots)
+      return SYM_NONE;
+
+   uint32_t mask = st->nslots - 1;
+   uint32_t i = sym_hash (s, len) & mask;
+
+   while (st->slots[i]) {
+      const struct span_t *name = &st->names[st->slots[i] - 1];
+      if (name->len == len && memcmp (name->s, s, len) == 0)
+         return st->slots[i] - 1;
+      i = (i + 1) & mask;
+   }
+
+   return SYM_NONE;
+}
+
+static bool symtab_grow (struct symtab_t *st)
+{
+   uint32_t nslots = st->nslots ? st->nslots * 2 : 64;
+   uint32_t *slots = mem_calloc (nslots, sizeof *slots);
+   if (!slots)
+      return false;
+
+   for (uint32_t id=0; id<st->nnames; id++) {
+      const struct span_t *name = &st->names[id];
+      uint32_t i = sym_hash (name->s, name->len) & (nslots - 1);
+      while (slots[i])
+         i = (i + 1) & (nslots - 1);
+      slots[i] = id + 1;
+   }
+
+   mem_free (st->slots);
+   st->slots = slots;
+   st->nslots = nslots;
+   return true;
+}
+
+// The name must stay valid for the lifetime of the table. Returns the id
+// of the name, or SYM_NONE on allocation failure.
+static uint32_t symtab_intern (struct symtab_t *st, const struct span_t *name)
+{
+   uint32_t id = symtab_find (st, name->s, name->len);
+   if (id != SYM_NONE)
+      return id;
+
+   // Keep the load factor below one half.
+   if ((st->nnames + 1) * 2 > st->nslots && !(symtab_grow (st)))
+      return SYM_NONE;
+
+   if (st->nnames >= st->names_size) {
+      uint32_t newsize = st->names_size ? st->names_size * 2 : 32;
+      struct span_t *tmp = mem_realloc (st->names, newsize * sizeof *tmp);
+      if (!tmp)
+         return SYM_NONE;
+      st->names = tmp;
+      st->names_size = newsize;
+   }
+
+   id = st->nnames++;
+   st->names[id] = *name;
+
+   uint32_t mask = st->nslots - 1;
+   uint32_t i = sym_hash (name->s, name->len) & mask;
+   while (st->slots[i])
+      i = (i + 1) & mask;
+   st->slots[i] = id + 1;
+
+   return id;
+}
+
+/* ************************************************************** */
+
+// The parser builds the document directly as a structure-of-arrays.
+// Nodes are numbered in document order and every property lives in its
+// own array, so traversals are scans over contiguous memory instead of
+// pointer chasing. The children of node 'n' are
+//    kids[kids_first[n] ... kids_first[n] + nkids[n] - 1]
+// and its attributes the same range of attr_name[] and attr_value[].
+//
+// While parsing, the children of every node that is still open are kept
+// on 'stack'; when a node is closed its children are moved from the top
+// of the stack into 'kids', so that they end up contiguous.
+
+#define FLAT_NONE    (UINT32_MAX)
+
+enum node_type_t {
+   node_NODE,
+   node_VALUE,
+   // Only while reading in parallel: stands in for an included file
+   // until its tree is spliced in. 'tag' holds the index of the include.
+   node_INCLUDE
+};
+
+// Most tags carry only a handful of attributes, which are found with a
+// linear scan of the node's range. Once a node has more than
+// ATTR_LINEAR_MAX of them, its attributes are also entered into a
+// document-wide hash keyed on (node, name).
+#define ATTR_LINEAR_MAX    (8)
+
+struct attr_slot_t {
+   uint32_t node;
+   uint32_t name;
+   uint32_t attr;
+};
+
+struct flat_t {
+   uint32_t nnodes;
+   uint32_t nodes_size;
+   uint8_t *type;
+   uint32_t *tag;
+   struct span_t *text;
+   uint32_t *file;
+   uint32_t *offset;
+   uint32_t *kids_first;
+   uint32_t *nkids;
+   uint32_t *attrs_first;
+   uint32_t *nattrs;
+
+   uint32_t nkids_total;
+   uint32_t kids_size;
+   uint32_t *kids;
+
+   uint32_t nattrs_total;
+   uint32_t attrs_size;
+   uint32_t *attr_name;
+   struct span_t *attr_value;
+   struct attr_slot_t *aslots;
+   uint32_t naslots;
+   uint32_t naslots_used;
+
+   uint32_t nstack;
+   uint32_t stack_size;
+   uint32_t *stack;
+
+   struct symtab_t syms;
+
+   // Set when the integer columns point into a mapped binary cache
+   // instead of being owned by the tree.
+   bool borrowed;
+};
+
+static void flat_free (struct flat_t *fl)
+{
+   if (!fl->borrowed) {
+      mem_free (fl->type);
+      mem_free (fl->tag);
+      mem_free (fl->offset);
+      mem_free (fl->kids_first);
+      mem_free (fl->nkids);
+      mem_free (fl->attrs_first);
+      mem_free (fl->nattrs);
+      mem_free (fl->kids);
+      mem_free (fl->attr_name);
+   }
+   mem_free (fl->text);
+   mem_free (fl->file);
+   mem_free (fl->attr_value);
+   mem_free (fl->aslots);
+   mem_free (fl->stack);
+   symtab_free (&fl->syms);
+   memset (fl, 0, sizeof *fl);
+}
+
+static bool flat_grow (void **array, size_t elsize, uint32_t newsize)
+{
+   void *tmp = mem_realloc (*array, elsize * newsize);
+   if (!tmp) {
+      LOG_ERR ("OOM\n");
+      return false;
+   }
+   *array = tmp;
+   return true;
+}
+
+#define FLAT_GROW(array,newsize)    \
+   flat_grow ((void **)&(array), sizeof *(array), (newsize))
+
+static bool flat_push (uint32_t **array, uint32_t *len, uint32_t *size,
+                       uint32_t value)
+{
+   if (*len >= *size) {
+      uint32_t newsize = *size ? *size * 2 : 64;
+      if (!(FLAT_GROW (*array, newsize)))
+         return false;
+      *size = newsize;
+   }
+   (*array)[(*len)++] = value;
+   return true;
+}
+
+// Returns the index of the new node or FLAT_NONE on error. The text must
+// remain valid for the lifetime of the document.
+static uint32_t flat_add_node (struct flat_t *fl, enum node_type_t type,
+                               uint32_t tag, const struct span_t *text,
+                               uint32_t file, size_t offset)
+{
+   if (fl->nnodes >= fl->nodes_size) {
+      uint32_t newsize = fl->nodes_size ? fl->nodes_size * 2 : 256;
+      if (!(FLAT_GROW (fl->type, newsize))
+            || !(FLAT_GROW (fl->tag, newsize))
+            || !(FLAT_GROW (fl->text, newsize))
+            || !(FLAT_GROW (fl->file, newsize))
+            || !(FLAT_GROW (fl->offset, newsize))
+            || !(FLAT_GROW (fl->kids_first, newsize))
+            || !(FLAT_GROW (fl->nkids, newsize))
+            || !(FLAT_GROW (fl->attrs_first, newsize))
+            || !(FLAT_GROW (fl->nattrs, newsize)))
+         return FLAT_NONE;
+      fl->nodes_size = newsize;
+   }
+
+   uint32_t n = fl->nnodes;
+
+   fl->type[n] = type;
+   fl->tag[n] = tag;
+   fl->text[n] = *text;
+   fl->file[n] = file;
+   fl->offset[n] = (uint32_t)offset;
+   fl->kids_first[n] = 0;
+   fl->nkids[n] = 0;
+   fl->attrs_first[n] = fl->nattrs_total;
+   fl->nattrs[n] = 0;
+
+   fl->nnodes++;
+   return n;
+}
+
+static uint32_t attr_hash (uint32_t node, uint32_t name)
+{
+   uint32_t h = node * 2654435761u;
+   return (h ^ (h >> 15)) + name * 2246822519u;
+}
+
+static void attr_index_put (struct attr_slot_t *slots, uint32_t nslots,
+                            uint32_t node, uint32_t name, uint32_t attr)
+{
+   uint32_t mask = nslots - 1;
+   uint32_t i = attr_hash (node, name) & mask;
+   while (slots[i].attr != FLAT_NONE)
+      i = (i + 1) & mask;
+   slots[i].node = node;
+   slots[i].name = name;
+   slots[i].attr = attr;
+}
+
+static bool attr_index_add (struct flat_t *fl, uint32_t node, uint32_t name,
+                            uint32_t attr)
+{
+   // Keep the load factor below one half.
+   if ((fl->naslots_used + 1) * 2 > fl->naslots) {
+      uint32_t nslots = fl->naslots ? fl->naslots * 2 : 64;
+      struct attr_slot_t *slots = mem_malloc (nslots * sizeof *slots);
+      if (!slots) {
+         LOG_ERR ("OOM\n");
+         return false;
+      }
+      for (uint32_t i=0; i<nslots; i++)
+         slots[i].attr = FLAT_NONE;
+      for (uint32_t i=0; i<fl->naslots; i++) {
+         struct attr_slot_t *o = &fl->aslots[i];
+         if (o->attr != FLAT_NONE)
+            attr_index_put (slots, nslots, o->node, o->name, o->attr);
+      }
+      mem_free (fl->aslots);
+      fl->aslots = slots;
+      fl->naslots = nslots;
+   }
+
+   attr_index_put (fl->aslots, fl->naslots, node, name, attr);
+   fl->naslots_used++;
+   return true;
+}
+
+// Returns the index into attr_name[]/attr_value[] of the named attribute
+// of node 'n', or FLAT_NONE if the node does not have it.
+static uint32_t flat_attr_find (const struct flat_t *fl, uint32_t n,
+                                uint32_t name)
+{
+   uint32_t first = fl->attrs_first[n];
+
+   if (fl->nattrs[n] <= ATTR_LINEAR_MAX) {
+      for (uint32_t i=0; i<fl->nattrs[n]; i++) {
+         if (fl->attr_name[first + i] == name)
+            return first + i;
+      }
+      return FLAT_NONE;
+   }
+
+   uint32_t mask = fl->naslots - 1;
+   uint32_t i = attr_hash (n, name) & mask;
+   while (fl->aslots[i].attr != FLAT_NONE) {
+      if (fl->aslots[i].node == n && fl->aslots[i].name == name)
+         return fl->aslots[i].attr;
+      i = (i + 1) & mask;
+   }
+   return FLAT_NONE;
+}
+
+// Attributes can only be added to the most recently created node. A name
+// that is already present has its value replaced.
+static bool flat_set_attr (struct flat_t *fl, uint32_t n, uint32_t id,
+                           const struct span_t *value)
+{
+   uint32_t a = flat_attr_find (fl, n, id);
+   if (a != FLAT_NONE) {
+      fl->attr_value[a] = *value;
+      return true;
+   }
+
+   if (fl->nattrs_total >= fl->attrs_size) {
+      uint32_t newsize = fl->attrs_size ? fl->attrs_size * 2 : 64;
+      if (!(FLAT_GROW (fl->attr_name, newsize))
+            || !(FLAT_GROW (fl->attr_value, newsize)))
+         return false;
+      fl->attrs_size = newsize;
+   }
+
+   a = fl->nattrs_total;
+   fl->attr_name[a] = id;
+   fl->attr_value[a] = *value;
+
+   // Crossing the threshold moves the node's earlier attributes into the
+   // index as well.
+   uint32_t first = fl->attrs_first[n];
+   if (fl->nattrs[n] == ATTR_LINEAR_MAX) {
+      for (uint32_t i=0; i<ATTR_LINEAR_MAX; i++) {
+         if (!(attr_index_add (fl, n, fl->attr_name[first + i], first + i)))
+            return false;
+      }
+   }
+   if (fl->nattrs[n] >= ATTR_LINEAR_MAX) {
+      if (!(attr_index_add (fl, n, id, a)))
+         return false;
+   }
+
+   fl->nattrs_total++;
+   fl->nattrs[n]++;
+   return true;
+}
+
+static bool flat_push_kid (struct flat_t *fl, uint32_t kid)
+{
+   return flat_push (&fl->stack, &fl->nstack, &fl->stack_size, kid);
+}
+
+// Moves the children collected since 'base' into the node's kids range.
+static bool flat_close_node (struct flat_t *fl, uint32_t n, uint32_t base)
+{
+   uint32_t count = fl->nstack - base;
+
+   if (fl->nkids_total + count > fl->kids_size) {
+      uint32_t newsize = fl->kids_size ? fl->kids_size : 256;
+      while (newsize < fl->nkids_total + count)
+         newsize *= 2;
+      if (!(FLAT_GROW (fl->kids, newsize)))
+         return false;
+      fl->kids_size = newsize;
+   }
+
+   fl->kids_first[n] = fl->nkids_total;
+   fl->nkids[n] = count;
+   if (count)
+      memcpy (&fl->kids[fl->nkids_total], &fl->stack[base],
+              count * sizeof *fl->kids);
+   fl->nkids_total += count;
+   fl->nstack = base;
+   return true;
+}
+
+// A line of the dump: the name right-aligned in DUMP_WIDTH columns, then
+// 'sep' and the value.
+#define DUMP_WIDTH      (30)
+
+static bool dump_line (babylon_sink_fn *sink, void *ctx,
+                       const char *name, size_t namelen, const char *sep,
+                       const char *value, size_t valuelen)
+{
+   static const char pad[DUMP_WIDTH + 1] = "                              ";
+   size_t npad = namelen < DUMP_WIDTH ? DUMP_WIDTH - namelen : 0;
+
+   return (!npad || sink (ctx, pad, npad))
+       && sink (ctx, name, namelen)
+       && sink (ctx, sep, strlen (sep))
+       && (!valuelen || sink (ctx, value, valuelen))
+       && sink (ctx, "\n", 1);
+}
+
+static bool dump_number (babylon_sink_fn *sink, void *ctx,
+                         const char *name, bool hash, size_t value)
+{
+   char buf[24];
+   size_t i = sizeof buf;
+
+   do {
+      buf[--i] = (char)('0' + value % 10);
+      value /= 10;
+   } while (value);
+   if (hash)
+      buf[--i] = '#';
+
+   return dump_line (sink, ctx, name, strlen (name), ": ", &buf[i],
+                     sizeof buf - i);
+}
+
+static bool flat_dump_node (const struct flat_t *fl, struct filetab_t *ft,
+                            uint32_t n, babylon_sink_fn *sink, void *ctx)
+{
+   struct srcfile_t *f = &ft->files[fl->file[n]];
+   size_t line = 0,
+          charpos = 0;
+   instream_location (f->in, fl->offset[n], &line, &charpos);
+
+   if (!(dump_number (sink, ctx, "START NODE", true, n))
+         || !(dump_line (sink, ctx, "filename", 8, ": ", f->path,
+                         strlen (f->path)))
+         || !(dump_number (sink, ctx, "line", false, line))
+         || !(dump_number (sink, ctx, "charpos", false, charpos))
+         || !(dump_number (sink, ctx, "type", false, fl->type[n]))
+         || !(dump_line (sink, ctx, "text", 4, ": ", fl->text[n].s,
+                         fl->text[n].len)))
+      return false;
+
+   for (uint32_t i=0; i<fl->nattrs[n]; i++) {
+      uint32_t a = fl->attrs_first[n] + i;
+      const struct span_t *name = &fl->syms.names[fl->attr_name[a]];
+      if (!(dump_line (sink, ctx, name->s, name->len, " => ",
+                       fl->attr_value[a].s, fl->attr_value[a].len)))
+         return false;
+   }
+
+   return sink (ctx, "----\n", 5);
+}
+
+// Walks the tree from 'root' with an explicit stack of (node, next
+// child) pairs.
+static bool flat_dump (const struct flat_t *fl, struct filetab_t *ft,
+                       uint32_t root, babylon_sink_fn *sink, void *ctx)
+{
+   bool error = true;
+   uint32_t *stack = NULL;
+   size_t sp = 0,
+          stack_size = 0;
+
+   if (root == FLAT_NONE)
+      return true;
+
+   uint32_t node = root,
+            kid = 0;
+   if (!(flat_dump_node (fl, ft, node, sink, ctx)))
+      goto errorexit;
+
+   for (;;) {
+      if (kid < fl->nkids[node]) {
+         if (sp + 2 > stack_size) {
+            size_t newsize = stack_size ? stack_size * 2 : 64;
+            uint32_t *tmp = mem_realloc (stack, newsize * sizeof *tmp);
+            if (!tmp) {
+               LOG_ERR ("OOM\n");
+               goto errorexit;
+            }
+            stack = tmp;
+            stack_size = newsize;
+         }
+         stack[sp++] = node;
+         stack[sp++] = kid + 1;
+         node = fl->kids[fl->kids_first[node] + kid];
+         kid = 0;
+         if (!(flat_dump_node (fl, ft, node, sink, ctx)))
+            goto errorexit;
+         continue;
+      }
+
+      if (!(dump_number (sink, ctx, "END  NODE", true, node)))
+         goto errorexit;
+      if (!sp)
+         break;
+      kid = stack[--sp];
+      node = stack[--sp];
+   }
+
+   error = false;
+
+errorexit:
+
+   mem_free (stack);
+   return !error;
+}
+
+/* ************************************************************** */
+
+// Included files are cached under their canonical path, so that a file
+// included from many places is read and parsed once and its tree is
+// shared by every include site. Each entry records the modification time
+// and size of the file; a file that changes between two includes is
+// read again. An entry that is still being read when it is included
+// again marks an include cycle.
+
+struct filestamp_t {
+   int64_t mtime;
+   int64_t size;
+};
+
+struct incentry_t {
+   struct filestamp_t stamp;
+   uint32_t root;
+   uint32_t file;
+   bool busy;
+   struct unit_t *unit;
+};
+
+struct inccache_t {
+   struct symtab_t paths;
+   struct incentry_t *entries;
+   uint32_t entries_size;
+};
+
+// Returns the canonical path of the file as an allocated string, or NULL
+// if the file does not exist.
+static char *file_canon (const char *path, struct filestamp_t *stamp)
+{
+   memset (stamp, 0, sizeof *stamp);
+
+#ifdef PLATFORM_POSIX
+   struct stat sb;
+   char *canon = realpath (path, NULL);
+   char *ret = NULL;
+
+   // realpath() allocates with malloc(), not with the library's allocator.
+   if (canon && (stat (canon, &sb)) == 0 && (ret = mem_strdup (canon))) {
+      stamp->mtime = (int64_t)sb.st_mtime;
+      stamp->size = (int64_t)sb.st_size;
+   }
+
+   free (canon);
+   return ret;
+#else
+   FILE *inf = fopen (path, "rb");
+   if (!inf)
+      return NULL;
+   fclose (inf);
+   return mem_strdup (path);
+#endif
+}
+
+static void inccache_free (struct inccache_t *ic)
+{
+   symtab_free (&ic->paths);
+   mem_free (ic->entries);
+   memset (ic, 0, sizeof *ic);
+}
+
+// Returns the id of the entry for the path, or SYM_NONE on allocation
+// failure. '*created' is set when the entry is new or was reset because
+// the file changed; the caller then has to read the file.
+static uint32_t inccache_get (struct inccache_t *ic, struct arena_t *arena,
+                              const char *canon,
+                              const struct filestamp_t *stamp,
+                              bool *created)
+{
+   struct span_t path = { canon, strlen (canon) };
+   uint32_t id = symtab_find (&ic->paths, path.s, path.len);
+
+   *created = false;
+
+   if (id == SYM_NONE) {
+      if (!(path.s = span_adup (arena, &path))
+            || (id = symtab_intern (&ic->paths, &path)) == SYM_NONE) {
+         LOG_ERR ("OOM\n");
+         return SYM_NONE;
+      }
+
+      if (id >= ic->entries_size) {
+         uint32_t newsize = ic->entries_size ? ic->entries_size * 2 : 16;
+         struct incentry_t *tmp = mem_realloc (ic->entries,
+                                           newsize * sizeof *tmp);
+         if (!tmp) {
+            LOG_ERR ("OOM\n");
+            return SYM_NONE;
+         }
+         ic->entries = tmp;
+         ic->entries_size = newsize;
+      }
+      *created = true;
+   }
+
+   struct incentry_t *e = &ic->entries[id];
+   if (!*created && !e->busy
+         && (e->stamp.mtime != stamp->mtime || e->stamp.size != stamp->size))
+      *created = true;
+
+   if (*created) {
+      memset (e, 0, sizeof *e);
+      e->stamp = *stamp;
+      e->root = FLAT_NONE;
+      e->file = FLAT_NONE;
+   }
+
+   return id;
+}
+
+/* ************************************************************** */
+
+// The binary parse cache. A .babc file holds the parsed tree of a single
+// source file, so that a file that has not changed can be loaded without
+// running the lexer. It is written in native byte order and consists of
+// a header followed by these sections, each padded to 8 bytes:
+//
+//    type      uint8  [nnodes]
+//    tag, text offset, text length, source offset, kids_first, nkids,
+//    attrs_first, nattrs
+//              uint32 [nnodes] each
+//    kids      uint32 [nkids]
+//    attribute name, value offset, value length
+//              uint32 [nattrs] each
+//    name offset, name length
+//              uint32 [nnames] each
+//    lines     uint32 [nlines]      start offset of each source line
+//    pool      char   [pool_size]   strings, each followed by a NUL
+//
+// The integer columns of the tree are used straight from the mapping;
+// only the text spans are rebuilt. Anything that does not check out
+// causes the cache to be ignored, and the file to be parsed instead.
+
+#define BABC_MAGIC      ("BABC")
+#define BABC_VERSION    (1)
+#define BABC_ENDIAN     (0x01020304u)
+#define BABC_ALIGN(x)   (((x) + 7) & ~(uint64_t)7)
+
+struct babc_header_t {
+   char magic[4];
+   uint32_t version;
+   uint32_t endian;
+   uint32_t root;
+   int64_t src_mtime;
+   int64_t src_size;
+   uint64_t src_hash;
+   uint32_t nnodes;
+   uint32_t nkids;
+   uint32_t nattrs;
+   uint32_t nnames;
+   uint32_t nincs;
+   uint32_t nlines;
+   uint64_t pool_size;
+};
+
+static uint64_t content_hash (const char *s, size_t len)
+{
+   uint64_t h = 14695981039346656037u;
+   for (size_t i=0; i<len; i++) {
+      h ^= (unsigned char)s[i];
+      h *= 1099511628211u;
+   }
+   return h;
+}
+
+// The cache file of a source is written next to it, or, given a cache
+// directory, into that directory under the hash of the source.
+static char *babc_path (const char *cachedir, const char *canon,
+                        uint64_t hash)
+{
+   char *ret = NULL;
+
+   if (cachedir)
+      mem_printf (&ret, "%s/%016llx.babc", cachedir,
+                     (unsigned long long)hash);
+   else
+      mem_printf (&ret, "%s.babc", canon);
+
+   if (!ret)
+      LOG_ERR ("OOM\n");
+
+   return ret;
+}
+
+// The string pool is built up while writing.
+struct babc_pool_t {
+   char *data;
+   size_t len;
+   size_t size;
+};
+
+static bool babc_pool_add (struct babc_pool_t *pool,
+                           const struct span_t *span, uint32_t *off)
+{
+   if (pool->len + span->len + 1 > pool->size) {
+      size_t newsize = pool->size ? pool->size : 4096;
+      while (newsize < pool->len + span->len + 1)
+         newsize *= 2;
+      char *tmp = mem_realloc (pool->data, newsize);
+      if (!tmp)
+         return false;
+      pool->data = tmp;
+      pool->size = newsize;
+   }
+
+   if (pool->len + span->len >= UINT32_MAX)
+      return false;
+
+   *off = (uint32_t)pool->len;
+   memcpy (&pool->data[pool->len], span->s, span->len);
+   pool->len += span->len;
+   pool->data[pool->len++] = 0;
+   return true;
+}
+
+static bool babc_put (FILE *outf, const void *data, size_t nbytes)
+{
+   static const char zeros[8] = { 0 };
+
+   if (nbytes && (fwrite (data, 1, nbytes, outf)) != nbytes)
+      return false;
+
+   size_t pad = BABC_ALIGN (nbytes) - nbytes;
+   return !pad || (fwrite (zeros, 1, pad, outf)) == pad;
+}
+
+// Writes the tree to a temporary file which is then renamed into place, so
+// that a reader never sees a partial cache file.
+static bool babc_write (const char *path, const struct flat_t *fl,
+                        uint32_t root, uint32_t nincs,
+                        struct instream_t *src,
+                        const struct filestamp_t *stamp, uint64_t hash)
+{
+   bool error = true;
+   char *tmpname = NULL;
+   FILE *outf = NULL;
+   struct babc_pool_t pool = { NULL, 0, 0 };
+   uint32_t *offs = NULL,
+            *lens = NULL;
+   uint32_t nspans = fl->nnodes > fl->nattrs_total ? fl->nnodes
+                                                   : fl->nattrs_total;
+   if (nspans < fl->syms.nnames)
+      nspans = fl->syms.nnames;
+
+   if (!src->lines && !(instream_index_lines (src)))
+      goto errorexit;
+
+   if (!(offs = mem_malloc ((nspans + 1) * sizeof *offs))
+         || !(lens = mem_malloc ((nspans + 1) * sizeof *lens))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+#ifdef PLATFORM_POSIX
+   mem_printf (&tmpname, "%s.%ld.%p", path, (long)getpid (),
+                  (const void *)fl);
+#else
+   mem_printf (&tmpname, "%s.%p", path, (const void *)fl);
+#endif
+   if (!tmpname || !(outf = fopen (tmpname, "wb"))) {
+      LOG_ERR ("Failed to create [%s]:%m\n", tmpname ? tmpname : path);
+      goto errorexit;
+   }
+
+   struct babc_header_t hdr;
+   memset (&hdr, 0, sizeof hdr);
+   memcpy (hdr.magic, BABC_MAGIC, sizeof hdr.magic);
+   hdr.version = BABC_VERSION;
+   hdr.endian = BABC_ENDIAN;
+   hdr.root = root;
+   hdr.src_mtime = stamp->mtime;
+   hdr.src_size = stamp->size;
+   hdr.src_hash = hash;
+   hdr.nnodes = fl->nnodes;
+   hdr.nkids = fl->nkids_total;
+   hdr.nattrs = fl->nattrs_total;
+   hdr.nnames = fl->syms.nnames;
+   hdr.nincs = nincs;
+   hdr.nlines = (uint32_t)src->nlines;
+
+   // The pool is only complete once every string has been added, so the
+   // header goes out last.
+   bool ok = babc_put (outf, &hdr, sizeof hdr)
+          && babc_put (outf, fl->type, fl->nnodes)
+          && babc_put (outf, fl->tag, fl->nnodes * sizeof *fl->tag);
+
+   for (uint32_t i=0; ok && i<fl->nnodes; i++) {
+      ok = babc_pool_add (&pool, &fl->text[i], &offs[i]);
+      lens[i] = (uint32_t)fl->text[i].len;
+   }
+   ok = ok && babc_put (outf, offs, fl->nnodes * sizeof *offs)
+           && babc_put (outf, lens, fl->nnodes * sizeof *lens)
+           && babc_put (outf, fl->offset, fl->nnodes * sizeof *fl->offset)
+           && babc_put (outf, fl->kids_first,
+                        fl->nnodes * sizeof *fl->kids_first)
+           && babc_put (outf, fl->nkids, fl->nnodes * sizeof *fl->nkids)
+           && babc_put (outf, fl->attrs_first,
+                        fl->nnodes * sizeof *fl->attrs_first)
+           && babc_put (outf, fl->nattrs, fl->nnodes * sizeof *fl->nattrs)
+           && babc_put (outf, fl->kids, fl->nkids_total * sizeof *fl->kids)
+           && babc_put (outf, fl->attr_name,
+                        fl->nattrs_total * sizeof *fl->attr_name);
+
+   for (uint32_t i=0; ok && i<fl->nattrs_total; i++) {
+      ok = babc_pool_add (&pool, &fl->attr_value[i], &offs[i]);
+      lens[i] = (uint32_t)fl->attr_value[i].len;
+   }
+   ok = ok && babc_put (outf, offs, fl->nattrs_total * sizeof *offs)
+           && babc_put (outf, lens, fl->nattrs_total * sizeof *lens);
+
+   for (uint32_t i=0; ok && i<fl->syms.nnames; i++) {
+      ok = babc_pool_add (&pool, &fl->syms.names[i], &offs[i]);
+      lens[i] = (uint32_t)fl->syms.names[i].len;
+   }
+   ok = ok && babc_put (outf, offs, fl->syms.nnames * sizeof *offs)
+           && babc_put (outf, lens, fl->syms.nnames * sizeof *lens)
+           && babc_put (outf, src->lines, src->nlines * sizeof *src->lines)
+           && babc_put (outf, pool.data, pool.len);
+
+   hdr.pool_size = pool.len;
+   ok = ok && (fseek (outf, 0, SEEK_SET)) == 0
+           && (fwrite (&hdr, sizeof hdr, 1, outf)) == 1;
+
+   if ((fclose (outf)) != 0)
+      ok = false;
+   outf = NULL;
+
+   if (!ok) {
+      LOG_ERR ("Failed to write [%s]\n", tmpname);
+      remove (tmpname);
+      goto errorexit;
+   }
+
+   if ((rename (tmpname, path)) != 0) {
+      LOG_ERR ("Failed to rename [%s] to [%s]:%m\n", tmpname, path);
+      remove (tmpname);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (outf) {
+      fclose (outf);
+      remove (tmpname);
+   }
+   mem_free (tmpname);
+   mem_free (pool.data);
+   mem_free (offs);
+   mem_free (lens);
+   return !error;
+}
+
+// Returns a pointer to the next section of 'count' elements of 'elsize'
+// bytes, or NULL if the file is too short. The count comes from the file,
+// so it is checked against what is left before it is multiplied.
+static const void *babc_section (const struct instream_t *map, uint64_t *pos,
+                                 uint64_t count, size_t elsize)
+{
+   const void *ret = map->data + *pos;
+
+   if (*pos > map->len || count > (map->len - *pos) / elsize)
+      return NULL;
+
+   uint64_t nbytes = BABC_ALIGN (count * elsize);
+   if (*pos + nbytes > map->len)
+      return NULL;
+
+   *pos += nbytes;
+   return ret;
+}
+
+// A string and the NUL after it must lie within the pool.
+static bool babc_check_span (uint64_t pool_len, uint32_t off, uint32_t len)
+{
+   return (uint64_t)off + len < pool_len;
+}
+
+// Loads the cached tree of a source file. The stamp of the source must
+// match the one it was cached with; when looking the file up by content,
+// so must the hash. On success the tree borrows its columns from 'map',
+// which has to outlive it, and 'lines' is the source's line table.
+static bool babc_load (const char *path, const struct filestamp_t *stamp,
+                       const uint64_t *hash, struct flat_t *fl,
+                       uint32_t *root, uint32_t *nincs,
+                       struct instream_t **map, struct instream_t **lines)
+{
+   bool error = true;
+   struct instream_t *m = NULL,
+                     *l = NULL;
+   const struct babc_header_t *hdr = NULL;
+   uint64_t pos = BABC_ALIGN (sizeof *hdr);
+
+   memset (fl, 0, sizeof *fl);
+
+   if (!(m = instream_open (path)) || m->len < sizeof *hdr)
+      goto errorexit;
+
+   hdr = (const struct babc_header_t *)m->data;
+   if (memcmp (hdr->magic, BABC_MAGIC, sizeof hdr->magic)
+         || hdr->version != BABC_VERSION || hdr->endian != BABC_ENDIAN
+         || hdr->src_size != stamp->size
+         || (hash ? hdr->src_hash != *hash : hdr->src_mtime != stamp->mtime)
+         || hdr->root >= hdr->nnodes)
+      goto errorexit;
+
+   uint32_t n = hdr->nnodes;
+   const uint32_t *text_off, *text_len, *value_off, *value_len,
+                  *name_off, *name_len, *line_starts;
+   const char *pool;
+   uint64_t pool_len;
+
+   fl->borrowed = true;
+   if (!(fl->type = (uint8_t *)babc_section (m, &pos, n, 1))
+         || !(fl->tag = (uint32_t *)babc_section (m, &pos, n, 4))
+         || !(text_off = babc_section (m, &pos, n, 4))
+         || !(text_len = babc_section (m, &pos, n, 4))
+         || !(fl->offset = (uint32_t *)babc_section (m, &pos, n, 4))
+         || !(fl->kids_first = (uint32_t *)babc_section (m, &pos, n, 4))
+         || !(fl->nkids = (uint32_t *)babc_section (m, &pos, n, 4))
+         || !(fl->attrs_first = (uint32_t *)babc_section (m, &pos, n, 4))
+         || !(fl->nattrs = (uint32_t *)babc_section (m, &pos, n, 4))
+         || !(fl->kids = (uint32_t *)babc_section (m, &pos, hdr->nkids, 4))
+         || !(fl->attr_name = (uint32_t *)babc_section (m, &pos,
+                                                        hdr->nattrs, 4))
+         || !(value_off = babc_section (m, &pos, hdr->nattrs, 4))
+         || !(value_len = babc_section (m, &pos, hdr->nattrs, 4))
+         || !(name_off = babc_section (m, &pos, hdr->nnames, 4))
+         || !(name_len = babc_section (m, &pos, hdr->nnames, 4))
+         || !(line_starts = babc_section (m, &pos, hdr->nlines, 4))
+         || !(pool = babc_section (m, &pos, hdr->pool_size, 1))) {
+      LOG_WARN ("Truncated cache file [%s]\n", path);
+      goto errorexit;
+   }
+   // The pool is the last section; spans are checked against the bytes
+   // that are actually mapped for it.
+   pool_len = (uint64_t)(m->data + m->len - pool);
+   if (pool_len > hdr->pool_size)
+      pool_len = hdr->pool_size;
+
+   fl->nnodes = fl->nodes_size = n;
+   fl->nkids_total = fl->kids_size = hdr->nkids;
+   fl->nattrs_total = fl->attrs_size = hdr->nattrs;
+
+   if (!(fl->text = mem_malloc ((n + 1) * sizeof *fl->text))
+         || !(fl->attr_value = mem_malloc ((hdr->nattrs + 1)
+                                       * sizeof *fl->attr_value))
+         || !(fl->syms.names = mem_malloc ((hdr->nnames + 1)
+                                       * sizeof *fl->syms.names))
+         || !(l = mem_calloc (1, sizeof *l))
+         || !(l->lines = mem_malloc ((hdr->nlines + 1) * sizeof *l->lines))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   // Every index is checked, and children must come after their parent,
+   // so that a damaged file cannot send a walk of the tree astray.
+   uint32_t nplaceholders = 0;
+   for (uint32_t i=0; i<n; i++) {
+      if (fl->type[i] > node_INCLUDE
+            || (fl->type[i] == node_NODE && fl->tag[i] >= hdr->nnames)
+            || (fl->type[i] == node_INCLUDE && fl->tag[i] >= hdr->nincs)
+            || (uint64_t)fl->kids_first[i] + fl->nkids[i] > hdr->nkids
+            || (uint64_t)fl->attrs_first[i] + fl->nattrs[i] > hdr->nattrs
+            || fl->offset[i] > stamp->size
+            || !(babc_check_span (pool_len, text_off[i],
+                                  text_len[i])))
+         goto corrupt;
+      for (uint32_t k=0; k<fl->nkids[i]; k++) {
+         if (fl->kids[fl->kids_first[i] + k] <= i
+               || fl->kids[fl->kids_first[i] + k] >= n)
+            goto corrupt;
+      }
+      fl->text[i].s = &pool[text_off[i]];
+      fl->text[i].len = text_len[i];
+      if (fl->type[i] == node_INCLUDE)
+         nplaceholders++;
+   }
+
+   // Each include has its placeholder, so a larger count is damage and
+   // would only size the include array beyond reason.
+   if (hdr->nincs > nplaceholders)
+      goto corrupt;
+
+   for (uint32_t i=0; i<hdr->nattrs; i++) {
+      if (fl->attr_name[i] >= hdr->nnames
+            || !(babc_check_span (pool_len, value_off[i],
+                                  value_len[i])))
+         goto corrupt;
+      fl->attr_value[i].s = &pool[value_off[i]];
+      fl->attr_value[i].len = value_len[i];
+   }
+
+   for (uint32_t i=0; i<hdr->nnames; i++) {
+      if (!(babc_check_span (pool_len, name_off[i], name_len[i])))
+         goto corrupt;
+      fl->syms.names[i].s = &pool[name_off[i]];
+      fl->syms.names[i].len = name_len[i];
+   }
+   fl->syms.nnames = fl->syms.names_size = hdr->nnames;
+
+   for (uint32_t i=0; i<n; i++) {
+      if (fl->nattrs[i] <= ATTR_LINEAR_MAX)
+         continue;
+      for (uint32_t a=0; a<fl->nattrs[i]; a++) {
+         uint32_t attr = fl->attrs_first[i] + a;
+         if (!(attr_index_add (fl, i, fl->attr_name[attr], attr)))
+            goto errorexit;
+      }
+   }
+
+   // Lines start at zero and go up strictly, and none starts past the
+   // end of the source.
+   if (!hdr->nlines || line_starts[0] != 0)
+      goto corrupt;
+   for (uint32_t i=1; i<hdr->nlines; i++) {
+      if (line_starts[i] <= line_starts[i - 1]
+            || line_starts[i] > (uint64_t)stamp->size)
+         goto corrupt;
+   }
+   memcpy (l->lines, line_starts, hdr->nlines * sizeof *l->lines);
+   l->nlines = hdr->nlines;
+   l->len = (size_t)stamp->size;
+
+   *root = hdr->root;
+   *nincs = hdr->nincs;
+   *map = m;
+   *lines = l;
+   m = l = NULL;
+   error = false;
+   goto errorexit;
+
+corrupt:
+   LOG_WARN ("Corrupt cache file [%s]\n", path);
+
+errorexit:
+   if (error)
+      flat_free (fl);
+   instream_close (m);
+   instream_close (l);
+   return !error;
+}
+
+/* ************************************************************** */
+
+// The lexer finds the end of a word by scanning for the next byte that
+// can end it or needs handling: whitespace (as isspace() in the C
+// locale), NUL, the delimiters of the caller, a backslash or a quote.
+// The sets of such bytes are fixed, so each is a constant table; the
+// scan itself is vectorized where the processor allows, chosen once at
+// run time:
+//    AVX2     classifies 32 bytes at a time by looking up both nibbles
+//             of each byte in 16-entry tables (one bit per high nibble
+//             that occurs in a set, so there are no false matches)
+//    SSE4.2   compares 16 bytes at a time with every byte of the set
+//             with PCMPESTRI
+//    scalar   a table lookup per byte; also used for the tails
+// All three stop at the same byte.
+//
+// Source files are also checked to be valid UTF-8 as they are lexed,
+// skipping runs of ASCII a vector at a time. Invalid text is reported
+// but read as it is, so the tokens do not depend on the check.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// The same values as BABYLON_SCAN_AUTO and the other BABYLON_SCAN_*.
+enum scan_level_t {
+   scan_UNKNOWN,
+   scan_SCALAR,
+   scan_SSE42,
+   scan_AVX2,
+};
+
+// A byte with SCAN_STOP ends a scan; one that also has SCAN_DELIM ends a
+// word outside of quotes.
+#define SCAN_STOP       (0x01)
+#define SCAN_DELIM      (0x02)
+
+struct scanset_t {
+   uint8_t table[256];
+   // Indexed by the low nibble: a bit for each of the high nibbles 0, 2,
+   // 3 and 5 (see scan_hi_nibbles) that makes a byte of the set.
+   uint8_t nibbles[16];
+   // The set for PCMPESTRI.
+   char stops[16];
+   int nstops;
+};
+
+#define SCAN_SPACE(c)      ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+#define SCAN_BASE(c)       (SCAN_SPACE (c) || (c) == 0 || (c) == '\\' \
+                                           || (c) == '"')
+#define SCAN_NAME(c)       (SCAN_BASE (c) || (c) == '#' || (c) == '[' \
+                                          || (c) == ']' || (c) == '=')
+#define SCAN_WORD(c)       (SCAN_BASE (c) || (c) == '#' || (c) == '[' \
+                                          || (c) == ']')
+#define SCAN_DIRECTIVE(c)  (SCAN_BASE (c) || (c) == '[' || (c) == ']')
+#define SCAN_QUOTED(c)     ((c) == '\\' || (c) == '"')
+
+#define SCAN_E(in,c)    ((in (c)) ? ((c) == '\\' || (c) == '"' \
+                                       ? SCAN_STOP : SCAN_STOP | SCAN_DELIM) \
+                                  : 0)
+#define SCAN_R(in,h)    SCAN_E (in, h + 0x0), SCAN_E (in, h + 0x1), \
+                        SCAN_E (in, h + 0x2), SCAN_E (in, h + 0x3), \
+                        SCAN_E (in, h + 0x4), SCAN_E (in, h + 0x5), \
+                        SCAN_E (in, h + 0x6), SCAN_E (in, h + 0x7), \
+                        SCAN_E (in, h + 0x8), SCAN_E (in, h + 0x9), \
+                        SCAN_E (in, h + 0xa), SCAN_E (in, h + 0xb), \
+                        SCAN_E (in, h + 0xc), SCAN_E (in, h + 0xd), \
+                        SCAN_E (in, h + 0xe), SCAN_E (in, h + 0xf)
+#define SCAN_TABLE(in)  { SCAN_R (in, 0x00), SCAN_R (in, 0x10), \
+                          SCAN_R (in, 0x20), SCAN_R (in, 0x30), \
+                          SCAN_R (in, 0x40), SCAN_R (in, 0x50), \
+                          SCAN_R (in, 0x60), SCAN_R (in, 0x70), \
+                          SCAN_R (in, 0x80), SCAN_R (in, 0x90), \
+                          SCAN_R (in, 0xa0), SCAN_R (in, 0xb0), \
+                          SCAN_R (in, 0xc0), SCAN_R (in, 0xd0), \
+                          SCAN_R (in, 0xe0), SCAN_R (in, 0xf0) }
+
+#define SCAN_N(in,l)    (((in (0x00 + l)) ? 0x1 : 0) \
+                         | ((in (0x20 + l)) ? 0x2 : 0) \
+                         | ((in (0x30 + l)) ? 0x4 : 0) \
+                         | ((in (0x50 + l)) ? 0x8 : 0))
+#define SCAN_NIBBLES(in)   { SCAN_N (in, 0x0), SCAN_N (in, 0x1), \
+                             SCAN_N (in, 0x2), SCAN_N (in, 0x3), \
+                             SCAN_N (in, 0x4), SCAN_N (in, 0x5), \
+                             SCAN_N (in, 0x6), SCAN_N (in, 0x7), \
+                             SCAN_N (in, 0x8), SCAN_N (in, 0x9), \
+                             SCAN_N (in, 0xa), SCAN_N (in, 0xb), \
+                             SCAN_N (in, 0xc), SCAN_N (in, 0xd), \
+                             SCAN_N (in, 0xe), SCAN_N (in, 0xf) }
+
+#define SCAN_BASE_STOPS    ' ', '\t', '\n', '\v', '\f', '\r', 0, '\\', '"'
+
+// The delimiters of an attribute name, of a word and of a directive, and
+// the bytes that matter inside quotes.
+static const struct scanset_t scan_name = {
+   SCAN_TABLE (SCAN_NAME), SCAN_NIBBLES (SCAN_NAME),
+   { SCAN_BASE_STOPS, '#', '[', ']', '=' }, 13
+};
+
+static const struct scanset_t scan_word = {
+   SCAN_TABLE (SCAN_WORD), SCAN_NIBBLES (SCAN_WORD),
+   { SCAN_BASE_STOPS, '#', '[', ']' }, 12
+};
+
+static const struct scanset_t scan_directive = {
+   SCAN_TABLE (SCAN_DIRECTIVE), SCAN_NIBBLES (SCAN_DIRECTIVE),
+   { SCAN_BASE_STOPS, '[', ']' }, 11
+};
+
+static const struct scanset_t scan_quoted = {
+   SCAN_TABLE (SCAN_QUOTED), SCAN_NIBBLES (SCAN_QUOTED),
+   { '\\', '"' }, 2
+};
+
+static size_t scan_scalar (const char *s, size_t len,
+                           const struct scanset_t *set)
+{
+   for (size_t i=0; i<len; i++) {
+      if (set->table[(unsigned char)s[i]])
+         return i;
+   }
+   return len;
+}
+
+// Returns the length of the leading ASCII in 's'.
+static size_t scan_ascii_scalar (const char *s, size_t len)
+{
+   for (size_t i=0; i<len; i++) {
+      if ((unsigned char)s[i] & 0x80)
+         return i;
+   }
+   return len;
+}
+
+#ifdef SCAN_X86
+
+__attribute__ ((target ("sse4.2")))
+static size_t scan_sse42 (const char *s, size_t len,
+                          const struct scanset_t *set)
+{
+   __m128i stops = _mm_loadu_si128 ((const __m128i *)set->stops);
+   size_t i = 0;
+
+   for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)&s[i]);
+      int at = _mm_cmpestri (stops, set->nstops, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY
+                                             | _SIDD_LEAST_SIGNIFICANT);
+      if (at < 16)
+         return i + (size_t)at;
+   }
+
+   return i + scan_scalar (&s[i], len - i, set);
+}
+
+__attribute__ ((target ("sse4.2")))
+static size_t scan_ascii_sse42 (const char *s, size_t len)
+{
+   size_t i = 0;
+
+   for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)&s[i]);
+      if (_mm_movemask_epi8 (v))
+         break;
+   }
+
+   return i + scan_ascii_scalar (&s[i], len - i);
+}
+
+// The bit of each high nibble for scanset_t.nibbles.
+static const uint8_t scan_hi_nibbles[16] = {
+   0x1, 0, 0x2, 0x4, 0, 0x8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+__attribute__ ((target ("avx2")))
+static size_t scan_avx2 (const char *s, size_t len,
+                         const struct scanset_t *set)
+{
+   const __m256i lo = _mm256_broadcastsi128_si256 (
+                        _mm_loadu_si128 ((const __m128i *)set->nibbles)),
+                 hi = _mm256_broadcastsi128_si256 (
+                        _mm_loadu_si128 ((const __m128i *)scan_hi_nibbles)),
+                 low4 = _mm256_set1_epi8 (0x0f),
+                 zero = _mm256_setzero_si256 ();
+   size_t i = 0;
+
+   for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)&s[i]);
+      __m256i vlo = _mm256_and_si256 (v, low4),
+              vhi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low4);
+      __m256i hits = _mm256_and_si256 (_mm256_shuffle_epi8 (lo, vlo),
+                                       _mm256_shuffle_epi8 (hi, vhi));
+      uint32_t none = (uint32_t)_mm256_movemask_epi8 (
+                                    _mm256_cmpeq_epi8 (hits, zero));
+      if (none != UINT32_MAX)
+         return i + (size_t)__builtin_ctz (~none);
+   }
+
+   return i + scan_scalar (&s[i], len - i, set);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t scan_ascii_avx2 (const char *s, size_t len)
+{
+   size_t i = 0;
+
+   for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)&s[i]);
+      if (_mm256_movemask_epi8 (v))
+         break;
+   }
+
+   return i + scan_ascii_scalar (&s[i], len - i);
+}
+
+#endif
+
+// The best level the processor supports.
+static int scan_supported (void)
+{
+   int ret = scan_SCALAR;
+#ifdef SCAN_X86
+   __builtin_cpu_init ();
+   if (__builtin_cpu_supports ("avx2"))
+      ret = scan_AVX2;
+   else if (__builtin_cpu_supports ("sse4.2"))
+      ret = scan_SSE42;
+#endif
+   return ret;
+}
+
+// The level in use, found on first use unless babylon_text_scan_kernel()
+// set it; every thread finds the same one.
+static int scan_current = scan_UNKNOWN;
+
+static int scan_level (void)
+{
+   int ret = __atomic_load_n (&scan_current, __ATOMIC_RELAXED);
+
+   if (ret != scan_UNKNOWN)
+      return ret;
+
+   ret = scan_supported ();
+   __atomic_store_n (&scan_current, ret, __ATOMIC_RELAXED);
+   return ret;
+}
+
+// Returns the offset of the first byte of 's' in 'set', or 'len'.
+static size_t scan_find (const char *s, size_t len,
+                         const struct scanset_t *set)
+{
+   switch (scan_level ()) {
+#ifdef SCAN_X86
+      case scan_AVX2:   return scan_avx2 (s, len, set);
+      case scan_SSE42:  return scan_sse42 (s, len, set);
+#endif
+      default:          return scan_scalar (s, len, set);
+   }
+}
+
+static size_t scan_ascii (const char *s, size_t len)
+{
+   switch (scan_level ()) {
+#ifdef SCAN_X86
+      case scan_AVX2:   return scan_ascii_avx2 (s, len);
+      case scan_SSE42:  return scan_ascii_sse42 (s, len);
+#endif
+      default:          return scan_ascii_scalar (s, len);
+   }
+}
+
+int babylon_text_scan_kernel (int kernel)
+{
+   int supported = scan_supported ();
+
+   if (kernel <= scan_UNKNOWN || kernel > supported)
+      kernel = supported;
+
+   __atomic_store_n (&scan_current, kernel, __ATOMIC_RELAXED);
+   return kernel;
+}
+
+// Returns the length of the UTF-8 sequence at 's', or zero if it is not
+// a valid one (overlong, a surrogate, above U+10FFFF or cut short).
+static size_t utf8_sequence (const unsigned char *s, size_t len)
+{
+   size_t n = 0;
+   unsigned char lo = 0x80,
+                 hi = 0xbf;
+
+   if (s[0] < 0x80)
+      return 1;
+   else if (s[0] >= 0xc2 && s[0] <= 0xdf)
+      n = 2;
+   else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+      n = 3;
+      if (s[0] == 0xe0)
+         lo = 0xa0;
+      if (s[0] == 0xed)
+         hi = 0x9f;
+   } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+      n = 4;
+      if (s[0] == 0xf0)
+         lo = 0x90;
+      if (s[0] == 0xf4)
+         hi = 0x8f;
+   } else
+      return 0;
+
+   if (len < n || s[1] < lo || s[1] > hi)
+      return 0;
+
+   for (size_t i=2; i<n; i++) {
+      if ((s[i] & 0xc0) != 0x80)
+         return 0;
+   }
+
+   return n;
+}
+
+// Returns the offset of the first byte of 's' that is not valid UTF-8,
+// or 'len'.
+static size_t utf8_check (const char *s, size_t len)
+{
+   size_t i = 0;
+
+   while ((i += scan_ascii (&s[i], len - i)) < len) {
+      size_t n = utf8_sequence ((const unsigned char *)&s[i], len - i);
+      if (!n)
+         return i;
+      i += n;
+   }
+
+   return len;
+}
+
+// Warns about the first byte of a source file that is not UTF-8. The
+// check is skipped when warnings are not written.
+static void instream_check_utf8 (struct instream_t *in, const char *path)
+{
+   if (!(LOG_ENABLED (BABYLON_LOG_WARN)))
+      return;
+
+   size_t at = utf8_check (in->data, in->len),
+          line = 0,
+          charpos = 0;
+
+   if (at >= in->len)
+      return;
+
+   instream_location (in, (uint32_t)at, &line, &charpos);
+   LOG_INPUT (BABYLON_LOG_WARN, "%s:%zu:%zu: warning: invalid UTF-8",
+              path, line + 1, charpos + 1);
+}
+
+/* ************************************************************** */
+
+static int get_next_char (struct instream_t *in)
+{
+   if (in->pos >= in->len)
+      return EOF;
+
+   return (unsigned char)in->data[in->pos++];
+}
+
+static void unget_char (struct instream_t *in)
+{
+   if (in->pos)
+      in->pos--;
+}
+
+static bool word_append (char **buf, size_t *buflen, size_t *bufsize,
+                         const char *s, size_t len)
+{
+   if (*buflen + len + 1 > *bufsize) {
+      size_t newsize = *bufsize * 2;
+      while (newsize < *buflen + len + 1)
+         newsize *= 2;
+      char *tmp = mem_realloc (*buf, newsize);
+      if (!tmp) {
+         LOG_ERR ("OOM\n");
+         return false;
+      }
+      *buf = tmp;
+      *bufsize = newsize;
+   }
+
+   memcpy (&(*buf)[*buflen], s, len);
+   *buflen += len;
+   return true;
+}
+
+// Reads the next word into 'word', ending it at whitespace or a byte of
+// 'delims' outside of quotes. The span points into the input buffer
+// unless the word contains quotes or escapes, in which case it is
+// rewritten into '*rewrite' which the caller must free. Returns false if
+// no word could be read.
+static bool get_next_word (struct instream_t *in,
+                           const struct scanset_t *delims,
+                           int *delim_dst, struct span_t *word,
+                           char **rewrite)
+{
+   bool error = true;
+
+   size_t start = in->pos,
+          end = in->pos;
+
+   char *buf = NULL;
+   size_t buflen = 0,
+          bufsize = 0;
+
+   int c = 0;
+   bool inq = false;
+
+   *delim_dst = EOF;
+   *rewrite = NULL;
+
+   for (;;) {
+      // Everything up to the next byte that needs handling is part of
+      // the word as it is.
+      size_t run = scan_find (&in->data[in->pos], in->len - in->pos,
+                              inq ? &scan_quoted : delims);
+      if (buf && !(word_append (&buf, &buflen, &bufsize,
+                                &in->data[in->pos], run)))
+         goto errorexit;
+      in->pos += run;
+      if (!buf)
+         end = in->pos;
+
+      if ((c = get_next_char (in)) == EOF)
+         break;
+
+      if (c=='\\' || c=='"') {
+         // Switch to rewriting; everything so far was contiguous.
+         if (!buf) {
+            bufsize = (end - start) + 16;
+            if (!(buf = mem_malloc (bufsize))) {
+               LOG_ERR ("OOM\n");
+               goto errorexit;
+            }
+            memcpy (buf, &in->data[start], end - start);
+            buflen = end - start;
+         }
+      }
+
+      if (c=='\\') {
+         if ((c = get_next_char (in)) == EOF)
+            break;
+      }
+
+      if (c=='"') {
+         inq = !inq;
+         continue;
+      }
+
+      if (!inq && (delims->table[c] & SCAN_DELIM)) {
+         *delim_dst = (char)c;
+         break;
+      }
+
+      if (!buf) {
+         end = in->pos;
+         continue;
+      }
+
+      char ch = (char)c;
+      if (!(word_append (&buf, &buflen, &bufsize, &ch, 1)))
+         goto errorexit;
+   }
+
+   if (buf) {
+      buf[buflen] = 0;
+      word->s = buf;
+      word->len = buflen;
+   } else {
+      word->s = &in->data[start];
+      word->len = end - start;
+   }
+
+   if (!word->len)
+      goto errorexit;
+
+   *rewrite = buf;
+   error = false;
+
+errorexit:
+
+   if (error) {
+      mem_free (buf);
+   }
+
+   return !error;
+}
+
+// Reads the next line, including the terminating newline, as a span into
+// the input buffer. Returns false at the end of input.
+static bool get_next_line (struct instream_t *in, struct span_t *dst)
+{
+   int c = 0;
+
+   if (!in || !dst)
+      return false;
+
+   dst->s = &in->data[in->pos];
+   dst->len = 0;
+
+   while ((c = get_next_char (in))!=EOF) {
+      dst->len++;
+      if (c == '\n')
+         break;
+   }
+
+   return dst->len > 0;
+}
+
+// Reads a name=value pair. Each half is returned as a span into the input
+// or, if it had to be rewritten, into a copy in 'strings'.
+static bool read_nv (struct arena_t *strings, struct instream_t *in,
+                     struct span_t *name, struct span_t *value)
+{
+   bool ret = false;
+
+   size_t stream_pos = in->pos;
+
+   int delim = 0;
+   char *r_name = NULL,
+        *r_value = NULL;
+
+   if ((get_next_word (in, &scan_name, &delim, name, &r_name))) {
+      if ((get_next_word (in, &scan_word, &delim, value, &r_value))) {
+         ret = true;
+         if (r_name && !(name->s = span_adup (strings, name)))
+            ret = false;
+         if (r_value && !(value->s = span_adup (strings, value)))
+            ret = false;
+         if (!ret)
+            LOG_ERR ("OOM\n");
+      }
+   }
+
+   mem_free (r_name);
+   mem_free (r_value);
+
+   if (!ret)
+      in->pos = stream_pos;
+
+   return ret;
+}
+
+/* ***************************************************************** */
+
+struct linktab_t;
+
+// Everything that outlives the parse and is not in the source buffers
+// (rewritten text, the file table) is in 'arena'.
+struct babylon_text_t {
+   struct arena_t *arena;
+   struct filetab_t files;
+   struct flat_t flat;
+   struct inccache_t incs;
+   char *filename;
+   uint32_t root;
+
+   // Whether the binary parse cache is used, and the directory it is in;
+   // NULL to keep the cache files next to the sources.
+   bool babc;
+   char *cachedir;
+
+   // Whether the transform reports variables inherited from enclosing
+   // nodes, and how many it found in the last transform.
+   bool warn_inherited;
+   size_t ninherited;
+
+   // The most the expansion cache may hold, and the cache; NULL until a
+   // transform uses it.
+   size_t memo_limit;
+   struct memo_t *memo;
+
+   // The nodes of every tag in document order: those of tag 't' are
+   // tag_nodes[tag_first[t] ... tag_first[t + 1] - 1].
+   uint32_t *tag_first;
+   uint32_t *tag_nodes;
+
+   // The link targets of the document and the links to them; NULL if
+   // there are none.
+   struct linktab_t *links;
+
+   // The figures that are counted while reading and expanding; the rest
+   // of babylon_text_stats() is worked out when it is called.
+   babylon_stats_t stats;
+
+   int errcode;
+   char *errmsg;
+};
+
+struct unit_t;
+struct loader_t;
+
+// All state of a parse in progress is in the parser context and the
+// document being built, so separate documents can be read concurrently.
+// A context exists for each file being read; 'includer' links it to the
+// context of the file that included it, forming the include stack.
+//
+// 'directive' is the offset of the '#' of the directive being run, so an
+// include is reported at the line it starts on.
+//
+// In a parallel read 'unit' is set: the file is parsed into a tree of
+// its own and includes are queued on 'pool' instead of being read
+// in place.
+struct parser_t {
+   babylon_text_t *b;
+   struct flat_t *flat;
+   struct arena_t *arena;
+   struct instream_t *in;
+   uint32_t file;
+   struct parser_t *includer;
+   size_t directive;
+
+   struct unit_t *unit;
+   struct pool_t *pool;
+   size_t worker;
+};
+
+void babylon_text_error (babylon_text_t *b, int errcode);
+
+static uint32_t node_include (babylon_text_t *b, struct parser_t *includer,
+                              const char *filename);
+static uint32_t node_read_next (struct parser_t *p, uint32_t parent);
+static bool unit_include (struct parser_t *p, const struct span_t *fname,
+                          uint32_t *node);
+
+// Creates a node for the text, copying it into the document's arena if
+// it was rewritten during lexing. The text of a tag is its name.
+static uint32_t node_new (struct parser_t *p, enum node_type_t type,
+                          struct span_t *text, bool rewritten,
+                          size_t offset)
+{
+   uint32_t tag = FLAT_NONE;
+
+   if (rewritten) {
+      if (!(text->s = span_adup (p->arena, text))) {
+         LOG_ERR ("OOM\n");
+         return FLAT_NONE;
+      }
+   }
+
+   if (type == node_NODE) {
+      if ((tag = symtab_intern (&p->flat->syms, text)) == SYM_NONE) {
+         LOG_ERR ("OOM\n");
+         return FLAT_NONE;
+      }
+   }
+
+   return flat_add_node (p->flat, type, tag, text, p->file, offset);
+}
+
+static uint32_t read_tree (struct parser_t *p)
+{
+   bool error = true;
+   uint32_t ret = FLAT_NONE;
+
+   struct span_t text;
+   char *textbuf = NULL;
+   int delim = 0;
+
+   struct span_t name,
+                 value;
+
+   // Discard the first character
+   int c = get_next_char (p->in);
+   c = c;
+
+   if (!(get_next_word (p->in, &scan_word, &delim, &text, &textbuf))) {
+      LOG_ERR ("Failed to read tagname\n");
+      goto errorexit;
+   }
+
+   if ((ret = node_new (p, node_NODE, &text, textbuf != NULL,
+                        p->in->pos)) == FLAT_NONE) {
+      LOG_ERR ("Failed to create return node [%.*s]\n", (int)text.len,
+                                                          text.s);
+      goto errorexit;
+   }
+
+   while ((read_nv (p->arena, p->in, &name, &value))) {
+      uint32_t id = symtab_intern (&p->flat->syms, &name);
+      if (id == SYM_NONE || !(flat_set_attr (p->flat, ret, id, &value))) {
+         LOG_ERR ("OOM\n");
+         goto errorexit;
+      }
+   }
+
+   if ((node_read_next (p, ret)) == FLAT_NONE) {
+      LOG_ERR ("Failed to append tree to node\n");
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+
+   mem_free (textbuf);
+
+   return error ? FLAT_NONE : ret;
+}
+
+static uint32_t read_text (struct parser_t *p)
+{
+   uint32_t ret = FLAT_NONE;
+   struct span_t text;
+   char *textbuf = NULL;
+
+   size_t offset = p->in->pos;
+
+   int delim = 0;
+
+   if (!(get_next_word (p->in, &scan_word, &delim, &text, &textbuf))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   if ((ret = node_new (p, node_VALUE, &text, textbuf != NULL,
+                        offset)) == FLAT_NONE) {
+      LOG_ERR ("Failure creating new node\n");
+      goto errorexit;
+   }
+
+errorexit:
+   mem_free (textbuf);
+   return ret;
+}
+
+// Runs the directive, setting '*node' to the node it produced. A
+// directive may produce none, as does an include that cannot be read;
+// false is returned only when the directive itself cannot be read.
+static bool read_directive (struct parser_t *p, uint32_t *node)
+{
+   bool error = true;
+   struct span_t directive, s_fname;
+   char *r_directive = NULL,
+        *r_fname = NULL;
+   char *fname = NULL;
+   int delim = 0;
+
+   *node = FLAT_NONE;
+   p->directive = p->in->pos;
+
+   // Discard the first character
+   get_next_char (p->in);
+
+   if (!(get_next_word (p->in, &scan_directive, &delim, &directive,
+                        &r_directive))) {
+      LOG_ERR ("Failed to get directive after #\n");
+      goto errorexit;
+   }
+
+   LOG_INFO ("Running directive [%.*s]\n", (int)directive.len,
+                                             directive.s);
+   if ((span_eq (&directive, "include"))) {
+      if (!(get_next_word (p->in, &scan_directive, &delim, &s_fname,
+                           &r_fname))) {
+         LOG_ERR ("Failed to include directive\n");
+         goto errorexit;
+      }
+
+      if (p->unit) {
+         error = !(unit_include (p, &s_fname, node));
+         goto errorexit;
+      }
+
+      if (!(fname = span_dup (&s_fname))) {
+         LOG_ERR ("OOM\n");
+         goto errorexit;
+      }
+
+      LOG_INFO ("Loading [%s]\n", fname);
+      *node = node_include (p->b, p, fname);
+   }
+
+   error = false;
+
+errorexit:
+   mem_free (r_directive);
+   mem_free (r_fname);
+   mem_free (fname);
+   return !error;
+}
+
+// Reads the children of 'parent', or of a new root node if 'parent' is
+// FLAT_NONE. Returns the node the children were added to.
+static uint32_t node_read_next (struct parser_t *p, uint32_t parent)
+{
+   struct flat_t *fl = p->flat;
+   uint32_t ret = parent,
+            cur = FLAT_NONE;
+
+   uint32_t base = fl->nstack;
+
+   int c = 0;
+
+   if (parent == FLAT_NONE) {
+      struct span_t root = { "root", 4 };
+      if ((ret = node_new (p, node_NODE, &root, false,
+                           p->in->pos)) == FLAT_NONE) {
+         LOG_ERR ("OOM\n");
+         return FLAT_NONE;
+      }
+   }
+
+   while ((c = get_next_char (p->in)) != EOF) {
+
+      if ((isspace (c)))
+         continue;
+
+      if (c == ']')
+         break;
+
+      unget_char (p->in);
+
+      cur = FLAT_NONE;
+
+      if (c == '#') {
+         if (!(read_directive (p, &cur)))
+            goto errorexit;
+         if (cur == FLAT_NONE)
+            continue;
+      }
+
+      if (c == '[')
+         cur = read_tree (p);
+
+      if (cur == FLAT_NONE)
+         if ((cur = read_text (p)) == FLAT_NONE)
+            goto errorexit;
+
+      if (!(flat_push_kid (fl, cur))) {
+         LOG_ERR ("Failed to append to array\n");
+         goto errorexit;
+      }
+   }
+
+   if (!(flat_close_node (fl, ret, base)))
+      goto errorexit;
+
+   return ret;
+
+errorexit:
+   fl->nstack = base;
+   return FLAT_NONE;
+}
+
+static uint32_t node_readfile (babylon_text_t *b, struct parser_t *includer,
+                               const char *filename)
+{
+   struct parser_t p = { b, &b->flat, b->arena, NULL, 0, includer, 0,
+                         NULL, NULL, 0 };
+   int32_t file = -1;
+
+   if (!(p.in = instream_open (filename))) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", filename);
+      return FLAT_NONE;
+   }
+   instream_check_utf8 (p.in, filename);
+   b->stats.bytes_lexed += p.in->len;
+
+   // The text spans in the tree point into this buffer, so it lives as
+   // long as the document.
+   if (!(arena_defer (b->arena, instream_cleanup, p.in))) {
+      LOG_ERR ("OOM\n");
+      instream_close (p.in);
+      return FLAT_NONE;
+   }
+
+   if ((file = filetab_add (&b->files, b->arena, filename, p.in)) < 0) {
+      LOG_ERR ("Failed to register file [%s]\n", filename);
+      return FLAT_NONE;
+   }
+   p.file = (uint32_t)file;
+
+   return node_read_next (&p, FLAT_NONE);
+}
+
+// Records an include cycle as the document's error. The chain names
+// every include site on the cycle, outermost first, with lines counted
+// from one.
+static void include_cycle (babylon_text_t *b, const char *chain)
+{
+   char *msg = NULL;
+
+   LOG_ERR ("Include cycle: %s\n", chain);
+   babylon_text_error (b, BABYLON_EINCLUDE);
+
+   mem_printf (&msg, "Include cycle: %s", chain);
+   if (msg) {
+      mem_free (b->errmsg);
+      b->errmsg = msg;
+   }
+}
+
+static void include_chain (babylon_text_t *b, struct parser_t *p,
+                           char **dst)
+{
+   char *tmp = NULL;
+   size_t line = 0,
+          charpos = 0;
+
+   if (!p)
+      return;
+
+   include_chain (b, p->includer, dst);
+
+   instream_location (p->in, (uint32_t)p->directive, &line, &charpos);
+   mem_printf (&tmp, "%s:%zu -> ", b->files.files[p->file].path,
+                                      line + 1);
+   if (tmp)
+      mem_append (dst, tmp, NULL);
+   mem_free (tmp);
+}
+
+// Reads the file through the document's include cache.
+static uint32_t node_include (babylon_text_t *b, struct parser_t *includer,
+                              const char *filename)
+{
+   struct filestamp_t stamp;
+   char *canon = NULL;
+   uint32_t ret = FLAT_NONE,
+            id = SYM_NONE;
+   bool created = false;
+
+   if (!(canon = file_canon (filename, &stamp))) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", filename);
+      return FLAT_NONE;
+   }
+
+   if ((id = inccache_get (&b->incs, b->arena, canon, &stamp,
+                           &created)) == SYM_NONE)
+      goto errorexit;
+
+   if (!created) {
+      if (b->incs.entries[id].busy) {
+         char *chain = mem_strdup ("");
+         include_chain (b, includer, &chain);
+         mem_append (&chain, filename, NULL);
+         include_cycle (b, chain ? chain : filename);
+         mem_free (chain);
+         goto errorexit;
+      }
+      ret = b->incs.entries[id].root;
+   } else {
+      // The entry array may move while the file is read.
+      uint32_t file = b->files.nfiles;
+      b->incs.entries[id].busy = true;
+      ret = node_readfile (b, includer, filename);
+      b->incs.entries[id].busy = false;
+      b->incs.entries[id].root = ret;
+      if (b->files.nfiles > file)
+         b->incs.entries[id].file = file;
+   }
+
+   if (includer && b->incs.entries[id].file != FLAT_NONE
+         && !(filetab_depend (&b->files, b->arena, includer->file,
+                              b->incs.entries[id].file))) {
+      LOG_ERR ("OOM\n");
+      ret = FLAT_NONE;
+   }
+
+errorexit:
+   mem_free (canon);
+   return ret;
+}
+
+/* ************************************************************** */
+
+// Parallel reading. Every file is parsed into a unit with a tree, symbol
+// table and arena of its own, on whichever worker picks it up. An
+// #include leaves a node_INCLUDE placeholder in the includer's tree and
+// queues the included file as a new unit, unless the loader's include
+// cache already has a unit for it. Once all units are parsed they are
+// spliced together in document order, which numbers the nodes, files and
+// names exactly as a serial read would. Include cycles are found while
+// splicing.
+//
+// Units are reference counted and hold the source buffer and arena that
+// a document's text points into, so a document keeps a reference to
+// every unit it was spliced from. Re-reading a document seeds the loader
+// with those units; a file that has not changed since is not parsed
+// again, only its includes are looked up anew. Units shared between
+// documents in this way are not locked: such documents must be read and
+// deleted from one thread at a time.
+
+struct unit_t {
+   struct loader_t *ld;
+   char *path;
+   char *canon;
+   struct filestamp_t stamp;
+   size_t refs;
+
+   struct instream_t *in;
+   struct arena_t *arena;
+   struct flat_t flat;
+   uint32_t root;
+
+   // Set when the tree was loaded from the binary cache; 'in' then only
+   // holds the line table of the source.
+   struct instream_t *babc;
+
+   // The includes, in the order of their node_INCLUDE placeholders.
+   struct unit_t **incs;
+   size_t nincs;
+   size_t incs_size;
+
+   // Set when an include could not be found; since no placeholder was
+   // left for it, the file is parsed again when re-reading.
+   bool reparse;
+
+   // Per read: whether the unit has been queued on the loader's pool.
+   bool queued;
+
+   // Per read: the unit's place in the document being spliced, and the
+   // map from the unit's name ids to the document's.
+   uint32_t *symmap;
+   bool splicing;
+   bool spliced;
+   uint32_t file;
+   uint32_t droot;
+};
+
+struct loader_t {
+   struct pool_t *pool;
+#ifdef PLATFORM_POSIX
+   pthread_mutex_t lock;
+#endif
+   // Whether the binary cache is used, and where it is kept.
+   bool babc;
+   const char *cachedir;
+
+   // Protected by 'lock'. The loader holds a reference to every unit
+   // that it knows of.
+   struct arena_t *arena;
+   struct inccache_t cache;
+   struct unit_t **units;
+   size_t nunits;
+   size_t units_size;
+
+   // The bytes parsed by all workers, updated atomically.
+   size_t nlexed;
+};
+
+static void unit_del (struct unit_t *u)
+{
+   if (!u)
+      return;
+
+   mem_free (u->incs);
+   mem_free (u->symmap);
+   flat_free (&u->flat);
+   arena_del (u->arena);
+   instream_close (u->in);
+   instream_close (u->babc);
+   mem_free (u->canon);
+   mem_free (u->path);
+   mem_free (u);
+}
+
+static void unit_release (struct unit_t *u)
+{
+   if (u && !--u->refs)
+      unit_del (u);
+}
+
+static void unit_cleanup (void *u)
+{
+   unit_release (u);
+}
+
+// Adds a unit to the loader; the caller holds the lock.
+static bool loader_adopt (struct loader_t *ld, struct unit_t *u)
+{
+   if (ld->nunits >= ld->units_size) {
+      size_t newsize = ld->units_size ? ld->units_size * 2 : 16;
+      struct unit_t **tmp = mem_realloc (ld->units, newsize * sizeof *tmp);
+      if (!tmp) {
+         LOG_ERR ("OOM\n");
+         return false;
+      }
+      ld->units = tmp;
+      ld->units_size = newsize;
+   }
+
+   u->ld = ld;
+   u->queued = false;
+   u->refs++;
+   ld->units[ld->nunits++] = u;
+   return true;
+}
+
+// Creates a unit owned by the loader; the caller holds the lock.
+static struct unit_t *unit_new (struct loader_t *ld, const char *path,
+                                const char *canon,
+                                const struct filestamp_t *stamp)
+{
+   struct unit_t *ret = NULL;
+
+   if (!(ret = mem_calloc (1, sizeof *ret)) || !(ret->path = mem_strdup (path))
+            || !(ret->canon = mem_strdup (canon))
+            || !(ret->arena = arena_new ())) {
+      LOG_ERR ("OOM\n");
+      unit_del (ret);
+      return NULL;
+   }
+   ret->stamp = *stamp;
+   ret->root = FLAT_NONE;
+
+   if (!(loader_adopt (ld, ret))) {
+      unit_del (ret);
+      return NULL;
+   }
+
+   return ret;
+}
+
+static struct unit_t *loader_get (struct loader_t *ld, size_t worker,
+                                  const char *path);
+
+// Looks up the includes of a unit that was parsed for an earlier read.
+static void unit_relink (struct unit_t *u, size_t worker)
+{
+   struct flat_t *fl = &u->flat;
+
+   for (uint32_t n=0; n<fl->nnodes; n++) {
+      if (fl->type[n] == node_INCLUDE)
+         u->incs[fl->tag[n]] = loader_get (u->ld, worker, fl->text[n].s);
+   }
+}
+
+static bool unit_grow_incs (struct unit_t *u, size_t nincs)
+{
+   if (nincs > u->incs_size) {
+      struct unit_t **tmp = mem_realloc (u->incs, nincs * sizeof *tmp);
+      if (!tmp) {
+         LOG_ERR ("OOM\n");
+         return false;
+      }
+      u->incs = tmp;
+      u->incs_size = nincs;
+   }
+   return true;
+}
+
+// Loads the unit's tree from the binary cache, if there is a valid one.
+// When the cache is looked up by content the source is needed for its
+// hash; it is then left open in '*src' for the parser.
+static bool unit_load_babc (struct unit_t *u, struct instream_t **src,
+                            char **cpath, uint64_t *hash)
+{
+   struct loader_t *ld = u->ld;
+   uint32_t nincs = 0;
+
+   if (ld->cachedir) {
+      if (!(*src = instream_open (u->path)))
+         return false;
+      *hash = content_hash ((*src)->data, (*src)->len);
+   }
+
+   if (!(*cpath = babc_path (ld->cachedir, u->canon, *hash)))
+      return false;
+
+   if (!(babc_load (*cpath, &u->stamp, ld->cachedir ? hash : NULL,
+                    &u->flat, &u->root, &nincs, &u->babc, &u->in)))
+      return false;
+
+   // Without room for its includes the cached tree is dropped and the
+   // file parsed instead, from '*src' if it is open.
+   if (!(unit_grow_incs (u, nincs))) {
+      flat_free (&u->flat);
+      instream_close (u->babc);
+      instream_close (u->in);
+      u->babc = u->in = NULL;
+      u->root = FLAT_NONE;
+      return false;
+   }
+   u->nincs = nincs;
+
+   instream_close (*src);
+   *src = NULL;
+   return true;
+}
+
+static void unit_task (struct pool_t *pool, size_t worker, void *arg)
+{
+   struct unit_t *u = arg;
+   struct parser_t p = { NULL, &u->flat, u->arena, NULL, 0, NULL, 0,
+                         u, pool, worker };
+   struct instream_t *src = NULL;
+   char *cpath = NULL;
+   uint64_t hash = 0;
+
+   mem_free (u->symmap);
+   u->symmap = NULL;
+   u->splicing = false;
+   u->spliced = false;
+   u->file = FLAT_NONE;
+   u->droot = FLAT_NONE;
+
+   if (u->in) {
+      unit_relink (u, worker);
+      return;
+   }
+
+   if (u->ld->babc && (unit_load_babc (u, &src, &cpath, &hash))) {
+      unit_relink (u, worker);
+      goto errorexit;
+   }
+
+   // A unit that fails to open or parse is left without a root, and is
+   // dropped when the units are spliced together.
+   if (!src && !(src = instream_open (u->path))) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", u->path);
+      goto errorexit;
+   }
+   p.in = u->in = src;
+   instream_check_utf8 (src, u->path);
+   __atomic_add_fetch (&u->ld->nlexed, src->len, __ATOMIC_RELAXED);
+
+   u->root = node_read_next (&p, FLAT_NONE);
+
+   // A unit with an include that could not be found is not cached, as
+   // it has to be parsed again once the file turns up.
+   if (cpath && u->root != FLAT_NONE && !u->reparse)
+      babc_write (cpath, &u->flat, u->root, (uint32_t)u->nincs, u->in,
+                  &u->stamp, hash);
+
+errorexit:
+   mem_free (cpath);
+}
+
+// Returns the unit for the file, creating it if the include cache has
+// none, and queues it if it has not been queued during this read yet.
+static struct unit_t *loader_get (struct loader_t *ld, size_t worker,
+                                  const char *path)
+{
+   struct filestamp_t stamp;
+   char *canon = NULL;
+   struct unit_t *ret = NULL;
+   bool created = false,
+        queue = false;
+
+   if (!(canon = file_canon (path, &stamp))) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", path);
+      return NULL;
+   }
+
+   POOL_LOCK (&ld->lock);
+   uint32_t id = inccache_get (&ld->cache, ld->arena, canon, &stamp,
+                               &created);
+   if (id != SYM_NONE) {
+      if (created)
+         ld->cache.entries[id].unit = unit_new (ld, path, canon, &stamp);
+      ret = ld->cache.entries[id].unit;
+   }
+   if (ret && !ret->queued)
+      queue = ret->queued = true;
+   POOL_UNLOCK (&ld->lock);
+
+   mem_free (canon);
+
+   if (queue && !(pool_submit (ld->pool, worker, unit_task, ret))) {
+      LOG_ERR ("Failed to queue [%s]\n", path);
+      return NULL;
+   }
+
+   return ret;
+}
+
+// Makes the units of an earlier read of the document available to the
+// loader.
+static bool loader_seed (struct loader_t *ld, babylon_text_t *prev)
+{
+   struct inccache_t *ic = &prev->incs;
+
+   for (uint32_t i=0; i<ic->paths.nnames; i++) {
+      struct unit_t *u = ic->entries[i].unit;
+      bool created = false;
+
+      if (!u || u->reparse)
+         continue;
+
+      uint32_t id = inccache_get (&ld->cache, ld->arena, u->canon,
+                                  &u->stamp, &created);
+      if (id == SYM_NONE || !(loader_adopt (ld, u)))
+         return false;
+      ld->cache.entries[id].unit = u;
+   }
+
+   return true;
+}
+
+// Called by the includer's task only, so the unit needs no locking. An
+// include that cannot be found is dropped, leaving '*node' unset.
+static bool unit_include (struct parser_t *p, const struct span_t *fname,
+                          uint32_t *node)
+{
+   struct unit_t *u = p->unit;
+   struct unit_t *inc = NULL;
+   uint32_t ret = FLAT_NONE;
+
+   if (u->nincs >= u->incs_size
+         && !(unit_grow_incs (u, u->incs_size ? u->incs_size * 2 : 8)))
+      return false;
+
+   struct span_t text = { span_adup (p->arena, fname), fname->len };
+   if (!text.s) {
+      LOG_ERR ("OOM\n");
+      return false;
+   }
+
+   LOG_INFO ("Loading [%s]\n", text.s);
+   if (!(inc = loader_get (u->ld, p->worker, text.s))) {
+      u->reparse = true;
+      return true;
+   }
+
+   if ((ret = flat_add_node (p->flat, node_INCLUDE, (uint32_t)u->nincs,
+                             &text, p->file, p->directive)) == FLAT_NONE) {
+      LOG_ERR ("OOM\n");
+      return false;
+   }
+   u->incs[u->nincs++] = inc;
+   *node = ret;
+
+   return true;
+}
+
+// The chain of include sites leading to the unit being spliced.
+struct splice_frame_t {
+   struct unit_t *u;
+   uint32_t site;
+   const struct splice_frame_t *outer;
+};
+
+static void splice_chain (babylon_text_t *b, const struct splice_frame_t *f,
+                          char **dst)
+{
+   char *tmp = NULL;
+   size_t line = 0,
+          charpos = 0;
+
+   if (!f)
+      return;
+
+   splice_chain (b, f->outer, dst);
+
+   instream_location (b->files.files[f->u->file].in,
+                      f->u->flat.offset[f->site], &line, &charpos);
+   mem_printf (&tmp, "%s:%zu -> ", b->files.files[f->u->file].path,
+                                      line + 1);
+   if (tmp)
+      mem_append (dst, tmp, NULL);
+   mem_free (tmp);
+}
+
+static uint32_t unit_splice (babylon_text_t *b, struct unit_t *u,
+                             const struct splice_frame_t *outer);
+
+// Names are interned into the document the first time they are met, so
+// the ids come out in the same order as when reading serially.
+static uint32_t unit_sym (babylon_text_t *b, struct unit_t *u, uint32_t id)
+{
+   if (u->symmap[id] == SYM_NONE)
+      u->symmap[id] = symtab_intern (&b->flat.syms, &u->flat.syms.names[id]);
+   return u->symmap[id];
+}
+
+static uint32_t unit_splice_node (babylon_text_t *b, struct unit_t *u,
+                                  uint32_t n,
+                                  const struct splice_frame_t *outer)
+{
+   struct flat_t *src = &u->flat,
+                 *dst = &b->flat;
+
+   uint32_t tag = FLAT_NONE;
+   if (src->type[n] == node_NODE
+         && (tag = unit_sym (b, u, src->tag[n])) == SYM_NONE)
+      return FLAT_NONE;
+
+   uint32_t ret = flat_add_node (dst, src->type[n], tag, &src->text[n],
+                                 u->file, src->offset[n]);
+   if (ret == FLAT_NONE)
+      return FLAT_NONE;
+
+   for (uint32_t i=0; i<src->nattrs[n]; i++) {
+      uint32_t a = src->attrs_first[n] + i;
+      uint32_t id = unit_sym (b, u, src->attr_name[a]);
+      if (id == SYM_NONE
+            || !(flat_set_attr (dst, ret, id, &src->attr_value[a])))
+         return FLAT_NONE;
+   }
+
+   uint32_t base = dst->nstack;
+   for (uint32_t i=0; i<src->nkids[n]; i++) {
+      uint32_t kid = src->kids[src->kids_first[n] + i];
+
+      // An include that could not be read is dropped, as in a serial
+      // read.
+      if (src->type[kid] == node_INCLUDE) {
+         struct splice_frame_t frame = { u, kid, outer };
+         struct unit_t *inc = u->incs[src->tag[kid]];
+         if (!inc || (kid = unit_splice (b, inc, &frame)) == FLAT_NONE)
+            continue;
+      } else if ((kid = unit_splice_node (b, u, kid, outer)) == FLAT_NONE) {
+         dst->nstack = base;
+         return FLAT_NONE;
+      }
+
+      if (!(flat_push_kid (dst, kid))) {
+         dst->nstack = base;
+         return FLAT_NONE;
+      }
+   }
+
+   if (!(flat_close_node (dst, ret, base))) {
+      dst->nstack = base;
+      return FLAT_NONE;
+   }
+
+   return ret;
+}
+
+// Adds the unit's file to the document, which from now on holds a
+// reference to the unit.
+static bool unit_register (babylon_text_t *b, struct unit_t *u)
+{
+   int32_t file = -1;
+   bool created = false;
+
+   if (!(arena_defer (b->arena, unit_cleanup, u))) {
+      LOG_ERR ("OOM\n");
+      return false;
+   }
+   u->refs++;
+
+   if ((file = filetab_add (&b->files, b->arena, u->path, u->in)) < 0) {
+      LOG_ERR ("Failed to register file [%s]\n", u->path);
+      return false;
+   }
+   u->file = (uint32_t)file;
+
+   uint32_t id = inccache_get (&b->incs, b->arena, u->canon, &u->stamp,
+                               &created);
+   if (id == SYM_NONE)
+      return false;
+   b->incs.entries[id].unit = u;
+   b->incs.entries[id].file = u->file;
+
+   return true;
+}
+
+// Copies the unit's tree into the document, splicing in the trees of its
+// includes. A unit that is included again shares the tree spliced the
+// first time.
+static uint32_t unit_splice (babylon_text_t *b, struct unit_t *u,
+                             const struct splice_frame_t *outer)
+{
+   if (u->splicing) {
+      char *chain = mem_strdup ("");
+      splice_chain (b, outer, &chain);
+      mem_append (&chain, outer->u->flat.text[outer->site].s, NULL);
+      include_cycle (b, chain ? chain : u->path);
+      mem_free (chain);
+      return FLAT_NONE;
+   }
+
+   if (!u->spliced) {
+      u->spliced = true;
+
+      if (!u->in || !(unit_register (b, u)))
+         return FLAT_NONE;
+
+      if (u->root != FLAT_NONE) {
+         size_t nbytes = (u->flat.syms.nnames + 1) * sizeof *u->symmap;
+         if (!(u->symmap = mem_malloc (nbytes))) {
+            LOG_ERR ("OOM\n");
+            return FLAT_NONE;
+         }
+         // All bits set is SYM_NONE.
+         memset (u->symmap, 0xff, nbytes);
+
+         u->splicing = true;
+         u->droot = unit_splice_node (b, u, u->root, outer);
+         u->splicing = false;
+      }
+   }
+
+   if (outer && u->file != FLAT_NONE
+         && !(filetab_depend (&b->files, b->arena, outer->u->file,
+                              u->file))) {
+      LOG_ERR ("OOM\n");
+      return FLAT_NONE;
+   }
+
+   return u->droot;
+}
+
+// Reads the document with a pool of 'nthreads' workers. Units of an
+// earlier read in 'prev' are reused where their files are unchanged.
+static uint32_t node_readfile_parallel (babylon_text_t *b,
+                                        const char *filename,
+                                        size_t nthreads,
+                                        babylon_text_t *prev)
+{
+   uint32_t ret = FLAT_NONE;
+   struct loader_t ld;
+   struct unit_t *u = NULL;
+
+   memset (&ld, 0, sizeof ld);
+#ifdef PLATFORM_POSIX
+   pthread_mutex_init (&ld.lock, NULL);
+#endif
+
+   ld.babc = b->babc;
+   ld.cachedir = b->cachedir;
+
+   if (!(ld.pool = pool_new (nthreads)) || !(ld.arena = arena_new ()))
+      goto errorexit;
+
+   if (prev && !(loader_seed (&ld, prev)))
+      goto errorexit;
+
+   if (!(u = loader_get (&ld, 0, filename)))
+      goto errorexit;
+
+   pool_run (ld.pool);
+   b->stats.bytes_lexed = ld.nlexed;
+
+   ret = unit_splice (b, u, NULL);
+
+errorexit:
+   for (size_t i=0; i<ld.nunits; i++)
+      unit_release (ld.units[i]);
+   mem_free (ld.units);
+   inccache_free (&ld.cache);
+   arena_del (ld.arena);
+   pool_del (ld.pool);
+#ifdef PLATFORM_POSIX
+   pthread_mutex_destroy (&ld.lock);
+#endif
+   return ret;
+}
+
+/* ************************************************************** */
+
+// The event parser reads with the same lexer calls as the tree parser,
+// in the same order, so it sees exactly the same tags, attributes and
+// words; each is reported to a callback instead of becoming a node.
+// Nothing is kept after it has been reported except the tags and files
+// that are still open, which are on an explicit stack. Memory use is
+// therefore bounded by the nesting depth, whatever the size of the
+// document. Rewritten attribute strings live in an arena that is reset
+// after every tag.
+//
+// Included files are streamed each time they are included. Malformed
+// input, where the tree parser would fail to create a node, ends the
+// parse with BABYLON_EFREAD.
+
+struct sax_frame_t {
+   struct instream_t *in;
+
+   // The tag name or, for a file, the name it was included by. 'buf'
+   // holds it if it is not in the input buffer.
+   struct span_t name;
+   char *buf;
+
+   // Set for a file, with its canonical path.
+   char *canon;
+};
+
+struct sax_t {
+   const babylon_sax_t *cb;
+   void *ctx;
+   int err;
+
+   struct sax_frame_t *stack;
+   size_t sp;
+   size_t stack_size;
+
+   babylon_attr_t *attrs;
+   size_t nattrs;
+   size_t attrs_size;
+   struct arena_t *strings;
+};
+
+static bool sax_cancel (struct sax_t *s, bool ok)
+{
+   if (!ok)
+      s->err = BABYLON_ECANCEL;
+   return ok;
+}
+
+static struct sax_frame_t *sax_push (struct sax_t *s)
+{
+   if (s->sp >= s->stack_size) {
+      size_t newsize = s->stack_size ? s->stack_size * 2 : 32;
+      struct sax_frame_t *tmp = mem_realloc (s->stack, newsize * sizeof *tmp);
+      if (!tmp) {
+         LOG_ERR ("OOM\n");
+         s->err = BABYLON_EFREAD;
+         return NULL;
+      }
+      s->stack = tmp;
+      s->stack_size = newsize;
+   }
+
+   struct sax_frame_t *f = &s->stack[s->sp++];
+   memset (f, 0, sizeof *f);
+   return f;
+}
+
+// Reports the end of the innermost tag or file and drops it.
+static bool sax_pop (struct sax_t *s)
+{
+   struct sax_frame_t *f = &s->stack[--s->sp];
+   bool ok = true;
+
+   if (!f->canon && s->cb->end_tag)
+      ok = s->cb->end_tag (s->ctx, f->name.s, f->name.len);
+
+   if (f->canon && s->sp && s->cb->include_end)
+      ok = s->cb->include_end (s->ctx, f->buf);
+
+   if (f->canon)
+      instream_close (f->in);
+   mem_free (f->buf);
+   mem_free (f->canon);
+
+   return sax_cancel (s, ok);
+}
+
+// Mirrors read_tree(). Returns 1 once the tag has been reported and
+// opened, 0 if no tag could be read here and -1 on error.
+static int sax_tag (struct sax_t *s, struct instream_t *in)
+{
+   struct span_t text,
+                 name,
+                 value;
+   char *textbuf = NULL;
+   int delim = 0;
+
+   get_next_char (in);
+
+   if (!(get_next_word (in, &scan_word, &delim, &text, &textbuf)))
+      return 0;
+
+   s->nattrs = 0;
+   arena_reset (s->strings);
+
+   // A repeated name replaces the earlier value, as in the tree.
+   while ((read_nv (s->strings, in, &name, &value))) {
+      size_t i;
+      for (i=0; i<s->nattrs; i++) {
+         if (s->attrs[i].namelen == name.len
+               && !memcmp (s->attrs[i].name, name.s, name.len))
+            break;
+      }
+
+      if (i == s->nattrs) {
+         if (s->nattrs >= s->attrs_size) {
+            size_t newsize = s->attrs_size ? s->attrs_size * 2 : 16;
+            babylon_attr_t *tmp = mem_realloc (s->attrs,
+                                           newsize * sizeof *tmp);
+            if (!tmp) {
+               LOG_ERR ("OOM\n");
+               mem_free (textbuf);
+               s->err = BABYLON_EFREAD;
+               return -1;
+            }
+            s->attrs = tmp;
+            s->attrs_size = newsize;
+         }
+         s->attrs[i].name = name.s;
+         s->attrs[i].namelen = name.len;
+         s->nattrs++;
+      }
+      s->attrs[i].value = value.s;
+      s->attrs[i].valuelen = value.len;
+   }
+
+   struct sax_frame_t *f = sax_push (s);
+   if (!f) {
+      mem_free (textbuf);
+      return -1;
+   }
+   f->in = in;
+   f->name = text;
+   f->buf = textbuf;
+
+   if (s->cb->start_tag && !(sax_cancel (s, s->cb->start_tag (s->ctx,
+                                                     text.s, text.len,
+                                                     s->attrs, s->nattrs))))
+      return -1;
+
+   return 1;
+}
+
+// Opens a file for reading. Returns 1 once it is open, 0 if it cannot be
+// read and -1 on error, which includes an include cycle.
+static int sax_file (struct sax_t *s, const char *filename)
+{
+   struct filestamp_t stamp;
+   struct sax_frame_t *f = NULL;
+   char *canon = NULL;
+
+   if (!(canon = file_canon (filename, &stamp))) {
+      LOG_ERR ("Failed to open file [%s]:%m\n", filename);
+      return 0;
+   }
+
+   for (size_t i=0; i<s->sp; i++) {
+      if (s->stack[i].canon && !strcmp (s->stack[i].canon, canon)) {
+         char *chain = NULL;
+         for (size_t j=i; j<s->sp; j++) {
+            if (s->stack[j].canon)
+               mem_append (&chain, s->stack[j].buf, " -> ", NULL);
+         }
+         LOG_ERR ("Include cycle: %s%s\n", chain ? chain : "", filename);
+         mem_free (chain);
+         mem_free (canon);
+         s->err = BABYLON_EINCLUDE;
+         return -1;
+      }
+   }
+
+   if (!(f = sax_push (s))) {
+      mem_free (canon);
+      return -1;
+   }
+
+   f->canon = canon;
+   if (!(f->buf = mem_strdup (filename))
+         || !(f->in = instream_open (filename))) {
+      LOG_ERR ("Failed to open file [%s]\n", filename);
+      mem_free (f->buf);
+      mem_free (f->canon);
+      s->sp--;
+      return 0;
+   }
+   instream_check_utf8 (f->in, filename);
+   f->name.s = f->buf;
+   f->name.len = strlen (f->buf);
+
+   return 1;
+}
+
+// Mirrors read_directive(). Returns 1 once an included file has been
+// opened, 0 if there was no directive to act on and -1 on error.
+static int sax_directive (struct sax_t *s, struct instream_t *in)
+{
+   struct span_t directive,
+                 s_fname;
+   char *r_directive = NULL,
+        *r_fname = NULL,
+        *fname = NULL;
+   int delim = 0,
+       ret = 0;
+
+   get_next_char (in);
+
+   if (!(get_next_word (in, &scan_directive, &delim, &directive, &r_directive)))
+      goto errorexit;
+
+   if (!(span_eq (&directive, "include"))
+         || !(get_next_word (in, &scan_directive, &delim, &s_fname, &r_fname)))
+      goto errorexit;
+
+   if (!(fname = span_dup (&s_fname))) {
+      LOG_ERR ("OOM\n");
+      s->err = BABYLON_EFREAD;
+      ret = -1;
+      goto errorexit;
+   }
+
+   if ((ret = sax_file (s, fname)) == 1 && s->cb->include_begin
+         && !(sax_cancel (s, s->cb->include_begin (s->ctx, fname))))
+      ret = -1;
+
+errorexit:
+   mem_free (r_directive);
+   mem_free (r_fname);
+   mem_free (fname);
+   return ret;
+}
+
+// Mirrors read_text().
+static bool sax_text (struct sax_t *s, struct instream_t *in)
+{
+   struct span_t text;
+   char *textbuf = NULL;
+   int delim = 0;
+   bool ok = true;
+
+   if (!(get_next_word (in, &scan_word, &delim, &text, &textbuf))) {
+      LOG_ERR ("Failed to read text\n");
+      s->err = BABYLON_EFREAD;
+      return false;
+   }
+
+   if (s->cb->text)
+      ok = sax_cancel (s, s->cb->text (s->ctx, text.s, text.len));
+
+   mem_free (textbuf);
+   return ok;
+}
+
+// Mirrors node_read_next(), with the recursion replaced by the stack. A
+// file ends at its end or at a ']' outside of any tag; the end of a file
+// also closes every tag still open in it.
+static bool sax_run (struct sax_t *s)
+{
+   while (s->sp) {
+      struct sax_frame_t *f = &s->stack[s->sp - 1];
+      struct instream_t *in = f->in;
+      int c = get_next_char (in);
+      int cur = 0;
+
+      if (c == EOF || (c == ']' && f->canon)) {
+         if (c == ']')
+            in->pos = in->len;
+         if (!(sax_pop (s)))
+            return false;
+         continue;
+      }
+
+      if ((isspace (c)))
+         continue;
+
+      if (c == ']') {
+         if (!(sax_pop (s)))
+            return false;
+         continue;
+      }
+
+      unget_char (in);
+
+      if (c == '[')
+         cur = sax_tag (s, in);
+
+      if (c == '#')
+         cur = sax_directive (s, in);
+
+      if (cur < 0)
+         return false;
+
+      if (!cur && !(sax_text (s, in)))
+         return false;
+   }
+
+   return true;
+}
+
+int babylon_text_sax (const char *filename, const babylon_sax_t *sax,
+                      void *ctx)
+{
+   struct sax_t s = { sax, ctx, 0, NULL, 0, 0, NULL, 0, 0, NULL };
+
+   if (!filename || !sax) {
+      LOG_ERR ("NULL object passed to function\n");
+      return BABYLON_EPARAM;
+   }
+
+   if (!(s.strings = arena_new ())) {
+      s.err = BABYLON_EFREAD;
+      goto errorexit;
+   }
+
+   if (sax_file (&s, filename) != 1) {
+      if (!s.err)
+         s.err = BABYLON_EFREAD;
+      goto errorexit;
+   }
+
+   sax_run (&s);
+
+errorexit:
+
+   // Files and tags left open after an error are dropped unreported.
+   while (s.sp) {
+      struct sax_frame_t *f = &s.stack[--s.sp];
+      if (f->canon)
+         instream_close (f->in);
+      mem_free (f->buf);
+      mem_free (f->canon);
+   }
+
+   mem_free (s.stack);
+   mem_free (s.attrs);
+   arena_del (s.strings);
+
+   return s.err;
+}
+
+/* ************************************************************** */
+
+// Once a document is read, the nodes of every tag name are listed in
+// document order, so that a for-each visits exactly the nodes it is over
+// instead of walking the tree. The lists are filled by walking the tree
+// from its root: a file that is included more than once shares a single
+// subtree, and its nodes are listed once for every inclusion.
+
+struct tagwalk_t {
+   uint32_t node;
+   uint32_t kid;
+};
+
+static bool tag_index (babylon_text_t *b)
+{
+   bool error = true;
+   const struct flat_t *fl = &b->flat;
+   uint32_t ntags = fl->syms.nnames;
+
+   struct tagwalk_t *stack = NULL;
+   size_t sp = 0,
+          stack_size = 0;
+   uint32_t *visits = NULL,
+            nvisits = 0,
+            visits_size = 0;
+
+   // Counted into tag_first[t + 2] so that, after the prefix sum, the
+   // fill below leaves tag_first[t] at the start of tag t.
+   if (!(b->tag_first = mem_calloc (ntags + 2, sizeof *b->tag_first))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   if (!(stack = mem_malloc ((stack_size = 64) * sizeof *stack))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+   stack[sp++] = (struct tagwalk_t){ b->root, 0 };
+
+   while (sp) {
+      struct tagwalk_t *top = &stack[sp - 1];
+      if (top->kid >= fl->nkids[top->node]) {
+         sp--;
+         continue;
+      }
+
+      uint32_t k = fl->kids[fl->kids_first[top->node] + top->kid++];
+      if (fl->type[k] != node_NODE)
+         continue;
+
+      // The root of an included file is not a tag of the document.
+      if (fl->file[k] == fl->file[top->node]) {
+         if (!(flat_push (&visits, &nvisits, &visits_size, k)))
+            goto errorexit;
+         b->tag_first[fl->tag[k] + 2]++;
+      }
+
+      if (sp >= stack_size) {
+         size_t newsize = stack_size * 2;
+         struct tagwalk_t *tmp = mem_realloc (stack, newsize * sizeof *tmp);
+         if (!tmp) {
+            LOG_ERR ("OOM\n");
+            goto errorexit;
+         }
+         stack = tmp;
+         stack_size = newsize;
+      }
+      stack[sp++] = (struct tagwalk_t){ k, 0 };
+   }
+
+   if (!(b->tag_nodes = mem_malloc ((nvisits + 1) * sizeof *b->tag_nodes))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   for (uint32_t t=0; t<ntags; t++)
+      b->tag_first[t + 2] += b->tag_first[t + 1];
+
+   for (uint32_t i=0; i<nvisits; i++)
+      b->tag_nodes[b->tag_first[fl->tag[visits[i]] + 1]++] = visits[i];
+
+   error = false;
+
+errorexit:
+
+   mem_free (stack);
+   mem_free (visits);
+
+   return !error;
+}
+
+// Sets 'nodes' to the nodes of tag 'tag' in document order and returns
+// how many there are.
+static uint32_t tag_nodes (const babylon_text_t *b, uint32_t tag,
+                           const uint32_t **nodes)
+{
+   if (!b->tag_first || tag >= b->flat.syms.nnames) {
+      *nodes = NULL;
+      return 0;
+   }
+
+   *nodes = &b->tag_nodes[b->tag_first[tag]];
+   return b->tag_first[tag + 1] - b->tag_first[tag];
+}
+
+/* ************************************************************** */
+
+// Cross references: [link target=name ...] refers to the
+// [section name=name ...] of the same name. Once a document is read, a
+// single pass over its nodes enters every name into a hash table of its
+// own and counts the links to each target, so resolving a link is one
+// lookup however many links there are. Only a target that something
+// links to gets an ID in the output.
+//
+// In the body of a for-each, the target of a link may be $(tag.name):
+// the attribute 'name' of the item the for-each is at. Such a link is
+// counted once for every item of 'tag' if a for-each over 'tag' encloses
+// it. Anywhere else it cannot be resolved.
+
+#define LINK_TARGET_TAG    ("section")
+#define LINK_TARGET_ATTR   ("name")
+#define LINK_TAG           ("link")
+#define LINK_REF_ATTR      ("target")
+#define LINK_ID_FORMAT     ("ref-%u")
+#define FOREACH_ATTR       ("for-each")
+
+#define LINK_IN_FOREACH    (0x01)
+#define LINK_OUTSIDE       (0x02)
+
+struct linktab_t {
+   // The ids of the tag and attribute names in the document.
+   uint32_t section_tag;
+   uint32_t link_tag;
+   uint32_t target_attr;
+
+   // Every name used by a target or a link. The id of a name is also the
+   // number in the ID written for its target.
+   struct symtab_t names;
+
+   // For every name, its target node (FLAT_NONE if there is none) and
+   // the number of links to it.
+   uint32_t *target;
+   uint32_t *refs;
+   uint32_t size;
+
+   // For every node of the document, the id of the name that it defines
+   // or links to, SYM_NONE for all other nodes and for links to a
+   // $(tag.name).
+   uint32_t *node_name;
+   uint32_t ntemplates;
+
+   // For every node that is a link to $(tag.name), whether it is reached
+   // inside a for-each over 'tag' (LINK_IN_FOREACH), outside of one
+   // (LINK_OUTSIDE) or both, as a file may be included in several
+   // places. NULL if there are no such links.
+   uint8_t *template_use;
+
+   size_t nunresolved;
+   size_t nduplicates;
+};
+
+static void linktab_del (struct linktab_t *lt)
+{
+   if (!lt)
+      return;
+
+   symtab_free (&lt->names);
+   mem_free (lt->target);
+   mem_free (lt->refs);
+   mem_free (lt->node_name);
+   mem_free (lt->template_use);
+   mem_free (lt);
+}
+
+static uint32_t link_sym (const struct flat_t *fl, const char *name)
+{
+   return symtab_find (&fl->syms, name, strlen (name));
+}
+
+// True if the value of the target attribute 'a' is $(tag.name), with the
+// ids of the tag and of the name (SYM_NONE if no node has it) set.
+static bool link_template (const babylon_text_t *b, uint32_t a,
+                           uint32_t *tag, uint32_t *attr)
+{
+   const struct flat_t *fl = &b->flat;
+   const struct span_t *v = &fl->attr_value[a];
+   const char *dot = NULL;
+
+   if (v->len < 5 || v->s[0] != '$' || v->s[1] != '('
+         || v->s[v->len - 1] != ')'
+         || !(dot = memchr (&v->s[2], '.', v->len - 3)))
+      return false;
+
+   *tag = symtab_find (&fl->syms, &v->s[2], (size_t)(dot - &v->s[2]));
+   *attr = symtab_find (&fl->syms, dot + 1,
+                        (size_t)(&v->s[v->len - 1] - (dot + 1)));
+   return *tag != SYM_NONE;
+}
+
+// Returns the id of the target that a link to $(tag.attr) refers to for
+// the item 'item', or SYM_NONE if there is no such target.
+static uint32_t link_item (const babylon_text_t *b,
+                           const struct linktab_t *lt, uint32_t item,
+                           uint32_t attr)
+{
+   const struct flat_t *fl = &b->flat;
+   uint32_t a = flat_attr_find (fl, item, attr);
+   if (a == FLAT_NONE)
+      return SYM_NONE;
+
+   const struct span_t *name = &fl->attr_value[a];
+   uint32_t id = symtab_find (&lt->names, name->s, name->len);
+   if (id == SYM_NONE || lt->target[id] == FLAT_NONE)
+      return SYM_NONE;
+
+   return id;
+}
+
+// Returns the target attribute of node 'n' if it is a link to
+// $(tag.attr), FLAT_NONE otherwise.
+static uint32_t link_template_attr (const babylon_text_t *b,
+                                    const struct linktab_t *lt, uint32_t n,
+                                    uint32_t *tag, uint32_t *attr)
+{
+   const struct flat_t *fl = &b->flat;
+
+   if (fl->type[n] != node_NODE || fl->tag[n] != lt->link_tag
+         || lt->node_name[n] != SYM_NONE)
+      return FLAT_NONE;
+
+   uint32_t a = flat_attr_find (fl, n, lt->target_attr);
+   if (a == FLAT_NONE || !(link_template (b, a, tag, attr)))
+      return FLAT_NONE;
+
+   return a;
+}
+
+struct link_visit_t {
+   uint32_t node;
+   uint32_t kid;
+   // The tag that the node is a for-each over, or SYM_NONE.
+   uint32_t foreach;
+};
+
+// Walks the document as the transform does, keeping count of the
+// for-each nodes over every tag that enclose the current node, and
+// records where every link to $(tag.name) is reached. A node's own
+// for-each does not enclose its macro, only its body.
+static bool link_walk (babylon_text_t *b, struct linktab_t *lt)
+{
+   bool error = true;
+   const struct flat_t *fl = &b->flat;
+   uint32_t foreach = link_sym (fl, FOREACH_ATTR),
+            *active = NULL;
+   struct link_visit_t *stack = NULL;
+   size_t sp = 0,
+          stack_size = 0;
+
+   if (!(active = mem_calloc (fl->syms.nnames + 1, sizeof *active))
+         || !(lt->template_use = mem_calloc (fl->nnodes + 1,
+                                             sizeof *lt->template_use))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   uint32_t n = b->root;
+
+   for (;;) {
+      if (n != FLAT_NONE) {
+         if (sp >= stack_size) {
+            size_t newsize = stack_size ? stack_size * 2 : 64;
+            struct link_visit_t *tmp = mem_realloc (stack,
+                                                    newsize * sizeof *tmp);
+            if (!tmp) {
+               LOG_ERR ("OOM\n");
+               goto errorexit;
+            }
+            stack = tmp;
+            stack_size = newsize;
+         }
+
+         uint32_t tag = SYM_NONE,
+                  attr = SYM_NONE;
+         if (link_template_attr (b, lt, n, &tag, &attr) != FLAT_NONE)
+            lt->template_use[n] |= active[tag] ? LINK_IN_FOREACH
+                                               : LINK_OUTSIDE;
+
+         struct link_visit_t *v = &stack[sp++];
+         uint32_t a = foreach == SYM_NONE ? FLAT_NONE
+                                          : flat_attr_find (fl, n, foreach);
+         v->node = n;
+         v->kid = 0;
+         v->foreach = a == FLAT_NONE ? SYM_NONE
+                    : symtab_find (&fl->syms, fl->attr_value[a].s,
+                                   fl->attr_value[a].len);
+         if (v->foreach != SYM_NONE)
+            active[v->foreach]++;
+      }
+
+      if (!sp)
+         break;
+
+      struct link_visit_t *v = &stack[sp - 1];
+      n = FLAT_NONE;
+
+      while (n == FLAT_NONE && v->kid < fl->nkids[v->node]) {
+         uint32_t k = fl->kids[fl->kids_first[v->node] + v->kid++];
+         if (fl->type[k] == node_NODE)
+            n = k;
+      }
+      if (n != FLAT_NONE)
+         continue;
+
+      if (v->foreach != SYM_NONE)
+         active[v->foreach]--;
+      sp--;
+   }
+
+   error = false;
+
+errorexit:
+
+   mem_free (active);
+   mem_free (stack);
+
+   return !error;
+}
+
+// Builds b->links, leaving it NULL if the document has no targets or
+// links. Returns false on allocation failure.
+static bool link_index (babylon_text_t *b)
+{
+   bool error = true;
+   const struct flat_t *fl = &b->flat;
+   struct linktab_t *lt = NULL;
+
+   uint32_t section = link_sym (fl, LINK_TARGET_TAG),
+            name = link_sym (fl, LINK_TARGET_ATTR),
+            link = link_sym (fl, LINK_TAG),
+            target = link_sym (fl, LINK_REF_ATTR);
+
+   if ((section == SYM_NONE || name == SYM_NONE)
+         && (link == SYM_NONE || target == SYM_NONE))
+      return true;
+
+   if (!(lt = mem_calloc (1, sizeof *lt))
+         || !(lt->node_name = mem_malloc ((fl->nnodes + 1)
+                                      * sizeof *lt->node_name))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   lt->section_tag = section;
+   lt->link_tag = link;
+   lt->target_attr = target;
+
+   for (uint32_t n=0; n<fl->nnodes; n++) {
+      lt->node_name[n] = SYM_NONE;
+
+      bool is_target = fl->tag[n] == section;
+      if (fl->type[n] != node_NODE || (!is_target && fl->tag[n] != link))
+         continue;
+
+      uint32_t a = flat_attr_find (fl, n, is_target ? name : target),
+               tag = SYM_NONE,
+               attr = SYM_NONE;
+      if (a == FLAT_NONE)
+         continue;
+
+      if (!is_target && link_template (b, a, &tag, &attr)) {
+         lt->ntemplates++;
+         continue;
+      }
+
+      uint32_t id = symtab_intern (&lt->names, &fl->attr_value[a]);
+      if (id == SYM_NONE) {
+         LOG_ERR ("OOM\n");
+         goto errorexit;
+      }
+
+      if (id >= lt->size) {
+         uint32_t newsize = lt->size ? lt->size * 2 : 64;
+         if (!(FLAT_GROW (lt->target, newsize))
+               || !(FLAT_GROW (lt->refs, newsize)))
+            goto errorexit;
+         for (uint32_t i=lt->size; i<newsize; i++) {
+            lt->target[i] = FLAT_NONE;
+            lt->refs[i] = 0;
+         }
+         lt->size = newsize;
+      }
+
+      lt->node_name[n] = id;
+      if (!is_target)
+         lt->refs[id]++;
+      else if (lt->target[id] == FLAT_NONE)
+         lt->target[id] = n;
+      else
+         lt->nduplicates++;
+   }
+
+   for (uint32_t id=0; id<lt->names.nnames; id++) {
+      if (lt->target[id] == FLAT_NONE)
+         lt->nunresolved += lt->refs[id];
+   }
+
+   // Links to $(tag.name) can only be resolved once every target is
+   // known. One that is not in a for-each over 'tag' fails wherever it
+   // is reached.
+   if (lt->ntemplates && !(link_walk (b, lt)))
+      goto errorexit;
+
+   for (uint32_t n=0; lt->ntemplates && n<fl->nnodes; n++) {
+      uint32_t tag = SYM_NONE,
+               attr = SYM_NONE;
+      if (link_template_attr (b, lt, n, &tag, &attr) == FLAT_NONE)
+         continue;
+
+      if (lt->template_use[n] & LINK_OUTSIDE)
+         lt->nunresolved++;
+      if (!(lt->template_use[n] & LINK_IN_FOREACH))
+         continue;
+
+      const uint32_t *items = NULL;
+      uint32_t nitems = tag_nodes (b, tag, &items);
+      for (uint32_t i=0; i<nitems; i++) {
+         uint32_t id = link_item (b, lt, items[i], attr);
+         if (id == SYM_NONE)
+            lt->nunresolved++;
+         else
+            lt->refs[id]++;
+      }
+   }
+
+   b->links = lt;
+   lt = NULL;
+   error = false;
+
+errorexit:
+
+   linktab_del (lt);
+
+   return !error;
+}
+
+// Writes the ID of the target that node 'n' is (for $(_id_)) or links
+// to (for $(_ref_)) into 'buf'. Returns false if there is none: the node
+// is not a target that something links to, or not a resolved link.
+static bool link_id (const babylon_text_t *b, uint32_t n, bool ref,
+                     char *buf, size_t size)
+{
+   const struct linktab_t *lt = b->links;
+
+   if (!lt || lt->node_name[n] == SYM_NONE)
+      return false;
+
+   uint32_t id = lt->node_name[n];
+   if (ref) {
+      if (b->flat.tag[n] != lt->link_tag || lt->target[id] == FLAT_NONE)
+         return false;
+   } else {
+      if (lt->target[id] != n || !lt->refs[id])
+         return false;
+   }
+
+   snprintf (buf, size, LINK_ID_FORMAT, id);
+   return true;
+}
+
+// Returns the 1-based line of node 'n', and its file in 'path'.
+static size_t link_line (babylon_text_t *b, uint32_t n, const char **path)
+{
+   struct srcfile_t *f = &b->files.files[b->flat.file[n]];
+   size_t line = 0,
+          charpos = 0;
+
+   instream_location (f->in, b->flat.offset[n], &line, &charpos);
+   *path = f->path;
+   return line + 1;
+}
+
+// Reports the items for which the link 'n' to $(tag.attr) has no
+// target.
+static void link_check_items (babylon_text_t *b, const struct linktab_t *lt,
+                              uint32_t n, uint32_t a, uint32_t tag,
+                              uint32_t attr, FILE *outf)
+{
+   const struct flat_t *fl = &b->flat;
+   const uint32_t *items = NULL;
+   uint32_t nitems = tag_nodes (b, tag, &items);
+
+   for (uint32_t i=0; i<nitems; i++) {
+      if (link_item (b, lt, items[i], attr) != SYM_NONE)
+         continue;
+
+      uint32_t v = flat_attr_find (fl, items[i], attr);
+      const struct span_t *name = v == FLAT_NONE ? &fl->attr_value[a]
+                                                 : &fl->attr_value[v];
+      const char *path = NULL,
+                 *item_path = NULL;
+      size_t line = link_line (b, n, &path),
+             item_line = link_line (b, items[i], &item_path);
+
+      fprintf (outf, "%s:%zu: warning: link to unknown target [%.*s] "
+                     "for [%.*s] at %s:%zu\n",
+                     path, line, (int)name->len, name->s,
+                     (int)fl->text[items[i]].len, fl->text[items[i]].s,
+                     item_path, item_line);
+   }
+}
+
+size_t babylon_text_check_links (babylon_text_t *b, FILE *outf)
+{
+   if (!outf)
+      outf = stderr;
+
+   if (!b) {
+      LOG_ERR ("NULL object passed to function\n");
+      return 0;
+   }
+
+   const struct linktab_t *lt = b->links;
+   const struct flat_t *fl = &b->flat;
+
+   if (!lt || !(lt->nunresolved + lt->nduplicates))
+      return 0;
+
+   for (uint32_t n=0; n<fl->nnodes; n++) {
+      uint32_t id = lt->node_name[n],
+               tag = SYM_NONE,
+               attr = SYM_NONE,
+               a = FLAT_NONE;
+
+      if (id == SYM_NONE) {
+         if ((a = link_template_attr (b, lt, n, &tag, &attr)) == FLAT_NONE)
+            continue;
+         if (lt->template_use[n] & LINK_OUTSIDE) {
+            const struct span_t *target = &fl->attr_value[a];
+            const char *path = NULL;
+            size_t line = link_line (b, n, &path);
+            fprintf (outf, "%s:%zu: warning: link to [%.*s] is not in a "
+                           "for-each over [%.*s]\n",
+                           path, line, (int)target->len, target->s,
+                           (int)fl->syms.names[tag].len,
+                           fl->syms.names[tag].s);
+         }
+         if (lt->template_use[n] & LINK_IN_FOREACH)
+            link_check_items (b, lt, n, a, tag, attr, outf);
+         continue;
+      }
+
+      const struct span_t *name = &lt->names.names[id];
+      const char *path = NULL,
+                 *first_path = NULL;
+      size_t line = 0;
+
+      if (fl->tag[n] == lt->link_tag && lt->target[id] == FLAT_NONE) {
+         line = link_line (b, n, &path);
+         fprintf (outf, "%s:%zu: warning: link to unknown target [%.*s]\n",
+                        path, line, (int)name->len, name->s);
+      } else if (fl->tag[n] == lt->section_tag && lt->target[id] != n) {
+         line = link_line (b, n, &path);
+         size_t first = link_line (b, lt->target[id], &first_path);
+         fprintf (outf, "%s:%zu: warning: target [%.*s] is already defined "
+                        "at %s:%zu\n",
+                        path, line, (int)name->len, name->s,
+                        first_path, first);
+      }
+   }
+
+   return lt->nunresolved + lt->nduplicates;
+}
+
+/* ************************************************************** */
+
+// Documents repeat subtrees (a notice, a badge) many times over, and a
+// subtree expands to the same output wherever it is as long as its
+// expansion reads nothing from outside it. The transform keeps the
+// output of such subtrees in a cache of the document and writes later
+// copies from there instead of expanding them again.
+//
+// An entry is keyed by a structural hash of the subtree (its tag,
+// attributes, words and the hashes of its children), combined with a
+// hash of the macro set and with whether a for-each encloses the
+// subtree. The hashes are worked out by a walk of the document on the
+// first transform that uses the cache, and only subtrees that occur more
+// than once keep theirs. A hash match alone is not trusted: an entry
+// remembers the node it was recorded from, and is only used for a
+// subtree that is the same node for node (see memo_same()).
+//
+// Whether an expansion reads from outside its subtree is found while
+// expanding it (see xform_escape()); a subtree that does is remembered
+// as such, so that it is not recorded again.
+//
+// The walk costs about as much as hashing the text of the document, so
+// the cache is off unless a limit is set. Once it holds more than its
+// limit, the least recently used entries are evicted.
+
+// Smaller subtrees are expanded about as quickly as they are looked up.
+#define MEMO_MIN_NODES     (3)
+
+// An entry may take at most this share of the limit.
+#define MEMO_MAX_SHARE     (8)
+
+#define MEMO_SEED          (0x9e3779b97f4a7c15u)
+
+struct memo_entry_t {
+   uint64_t key;
+   // The node the entry was recorded from, whether it was the root of a
+   // file and whether a for-each enclosed it.
+   uint32_t node;
+   bool fileroot;
+   bool foreach;
+   // Whether the output can be used for every copy of the subtree.
+   bool reusable;
+   char *out;
+   size_t len;
+   // The variables that the subtree inherits from nodes inside it.
+   size_t ninherited;
+   // The entries used before and after this one, most recent first;
+   // free entries are chained through 'next'.
+   uint32_t prev;
+   uint32_t next;
+};
+
+// Nodes of two subtrees being compared, and the next kid of both.
+struct memo_pair_t {
+   uint32_t a;
+   uint32_t c;
+   uint32_t kid;
+};
+
+struct memo_t {
+   // The nodes worth caching and their structural hashes, open
+   // addressed by node; FLAT_NONE where empty.
+   uint32_t *node;
+   uint64_t *node_key;
+   uint32_t nnode_slots;
+
+   struct memo_entry_t *entries;
+   uint32_t entries_size;
+   uint32_t nentries;
+   uint32_t free;
+   uint32_t first;
+   uint32_t last;
+
+   // The entries by key, open addressed; FLAT_NONE where empty.
+   uint32_t *slots;
+   uint32_t nslots;
+   uint32_t nlive;
+
+   // What the entries count against the limit, and their output alone.
+   size_t bytes;
+   size_t outbytes;
+
+   // The stack of memo_same(), kept between calls.
+   struct memo_pair_t *pairs;
+   size_t pairs_size;
+};
+
+static uint64_t memo_mix (uint64_t h, uint64_t v)
+{
+   // The finalizer of splitmix64.
+   uint64_t z = h ^ (v * MEMO_SEED);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9u;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebu;
+   return z ^ (z >> 31);
+}
+
+static uint64_t memo_bytes (uint64_t h, const char *s, size_t len)
+{
+   uint64_t v = 0;
+   unsigned char tail[sizeof v] = { 0 };
+
+   for (; len >= sizeof v; s += sizeof v, len -= sizeof v) {
+      memcpy (&v, s, sizeof v);
+      h = memo_mix (h, v);
+   }
+
+   // The length ends the bytes, so that two runs of them cannot be taken
+   // for one.
+   memcpy (tail, s, len);
+   tail[sizeof v - 1] = (unsigned char)len;
+   memcpy (&v, tail, sizeof v);
+   return memo_mix (h, v);
+}
+
+// How often each hash occurs, up to two.
+struct memo_count_t {
+   uint64_t *keys;
+   uint8_t *count;
+   uint32_t nslots;
+   uint32_t nkeys;
+};
+
+static bool memo_count_add (struct memo_count_t *c, uint64_t key,
+                            uint8_t n)
+{
+   if ((c->nkeys + 1) * 2 > c->nslots) {
+      struct memo_count_t tmp = { NULL, NULL, c->nslots ? c->nslots * 2 : 64,
+                                  0 };
+      if (!(tmp.keys = mem_calloc (tmp.nslots, sizeof *tmp.keys))
+            || !(tmp.count = mem_calloc (tmp.nslots, sizeof *tmp.count))) {
+         LOG_ERR ("OOM\n");
+         mem_free (tmp.keys);
+         return false;
+      }
+      for (uint32_t i=0; i<c->nslots; i++) {
+         if (c->keys[i])
+            memo_count_add (&tmp, c->keys[i], c->count[i]);
+      }
+      mem_free (c->keys);
+      mem_free (c->count);
+      *c = tmp;
+   }
+
+   uint32_t j = (uint32_t)key & (c->nslots - 1);
+   while (c->keys[j] && c->keys[j] != key)
+      j = (j + 1) & (c->nslots - 1);
+   if (!c->keys[j])
+      c->nkeys++;
+   c->keys[j] = key;
+   c->count[j] = c->count[j] + n > 2 ? 2 : (uint8_t)(c->count[j] + n);
+   return true;
+}
+
+static uint8_t memo_count_get (const struct memo_count_t *c, uint64_t key)
+{
+   uint32_t j = (uint32_t)key & (c->nslots - 1);
+   while (c->keys[j] != key)
+      j = (j + 1) & (c->nslots - 1);
+   return c->count[j];
+}
+
+// True if node 'n' has too few nodes under it to be cached.
+static bool memo_small (const struct flat_t *fl, uint32_t n)
+{
+   if (fl->nkids[n] + 1 >= MEMO_MIN_NODES)
+      return false;
+
+   for (uint32_t i=0; i<fl->nkids[n]; i++) {
+      if (fl->type[fl->kids[fl->kids_first[n] + i]] == node_NODE)
+         return false;
+   }
+   return true;
+}
+
+struct memo_visit_t {
+   uint32_t node;
+   uint32_t kid;
+   // Whether the node is hashed, how often it is expanded (up to two),
+   // and whether it is a for-each.
+   bool hashed;
+   uint8_t weight;
+   bool foreach;
+   // The hash so far and the size of the subtree so far, which is only
+   // needed up to MEMO_MIN_NODES.
+   uint64_t h;
+   uint32_t nsub;
+};
+
+struct memo_found_t {
+   uint32_t node;
+   uint64_t key;
+};
+
+// Hashes every node that may occur more than once and everything under
+// it, and counts how often each hash occurs. A node may occur again if
+// its tag does, if it is the root of a file included more than once, or
+// if it is in the body of a for-each, which is written once for every
+// item. Nodes of included files are shared, so each is visited once;
+// 'file_key' keeps the hash of the root of every file.
+//
+// The hashes of subtrees large enough to cache are added to 'found'.
+static bool memo_walk (const babylon_text_t *b, const uint8_t *nincl,
+                       uint64_t *file_key, uint32_t *file_nsub,
+                       struct memo_count_t *counts,
+                       struct memo_found_t **found, uint32_t *nfound)
+{
+   const struct flat_t *fl = &b->flat;
+   uint32_t foreach = symtab_find (&fl->syms, FOREACH_ATTR,
+                                   strlen (FOREACH_ATTR));
+   struct memo_visit_t *stack = NULL;
+   size_t sp = 0,
+          stack_size = 0;
+   uint32_t found_size = 0;
+   bool error = true;
+
+   uint32_t n = b->root;
+   bool hashed = false;
+   uint8_t weight = 1;
+
+   for (;;) {
+      if (n != FLAT_NONE) {
+         if (sp >= stack_size) {
+            size_t newsize = stack_size ? stack_size * 2 : 64;
+            struct memo_visit_t *tmp = mem_realloc (stack,
+                                                    newsize * sizeof *tmp);
+            if (!tmp) {
+               LOG_ERR ("OOM\n");
+               goto errorexit;
+            }
+            stack = tmp;
+            stack_size = newsize;
+         }
+
+         struct memo_visit_t *v = &stack[sp++];
+         v->node = n;
+         v->kid = 0;
+         v->hashed = hashed;
+         v->weight = weight;
+         v->foreach = flat_attr_find (fl, n, foreach) != FLAT_NONE;
+         v->h = 0;
+         v->nsub = 1;
+
+         if (hashed) {
+            v->h = memo_mix (node_NODE, fl->tag[n]);
+            for (uint32_t i=0; i<fl->nattrs[n]; i++) {
+               uint32_t a = fl->attrs_first[n] + i;
+               v->h = memo_mix (v->h, fl->attr_name[a]);
+               v->h = memo_bytes (v->h, fl->attr_value[a].s,
+                                  fl->attr_value[a].len);
+            }
+            v->h = memo_mix (v->h, fl->nkids[n]);
+         }
+      }
+
+      if (!sp)
+         break;
+
+      struct memo_visit_t *v = &stack[sp - 1];
+      n = FLAT_NONE;
+
+      while (v->kid < fl->nkids[v->node]) {
+         uint32_t k = fl->kids[fl->kids_first[v->node] + v->kid++];
+
+         if (fl->type[k] != node_NODE) {
+            if (v->hashed && fl->type[k] == node_VALUE)
+               v->h = memo_bytes (v->h, fl->text[k].s, fl->text[k].len);
+            else if (v->hashed)
+               v->h = memo_mix (v->h, fl->type[k]);
+            v->nsub++;
+            continue;
+         }
+
+         // A file included again has been hashed already.
+         bool root = fl->file[k] != fl->file[v->node];
+         if (root && file_key[fl->file[k]]) {
+            v->h = memo_mix (v->h, file_key[fl->file[k]] ^ 1);
+            v->nsub += file_nsub[fl->file[k]];
+            continue;
+         }
+
+         const uint32_t *nodes = NULL;
+         n = k;
+         weight = v->weight;
+         if (v->foreach || (root && nincl[fl->file[k]] > 1))
+            weight = 2;
+         hashed = v->hashed
+               || ((weight > 1
+                     || (!root && tag_nodes (b, fl->tag[k], &nodes) > 1))
+                  && !(memo_small (fl, k)));
+         break;
+      }
+      if (n != FLAT_NONE)
+         continue;
+
+      // The node is done; it is added to the hash of its parent.
+      uint32_t p = v->node,
+               nsub = v->nsub < MEMO_MIN_NODES ? v->nsub : MEMO_MIN_NODES;
+      uint64_t key = v->h ? v->h : 1;
+      bool root = sp > 1 && fl->file[p] != fl->file[stack[sp - 2].node];
+
+      if (v->hashed && nsub >= MEMO_MIN_NODES) {
+         if (!(memo_count_add (counts, key, v->weight)))
+            goto errorexit;
+         if (*nfound >= found_size) {
+            uint32_t newsize = found_size ? found_size * 2 : 64;
+            if (!(FLAT_GROW (*found, newsize)))
+               goto errorexit;
+            found_size = newsize;
+         }
+         (*found)[*nfound].node = p;
+         (*found)[(*nfound)++].key = key;
+      }
+
+      if (v->hashed && root) {
+         file_key[fl->file[p]] = key;
+         file_nsub[fl->file[p]] = nsub;
+      }
+
+      sp--;
+      if (sp) {
+         stack[sp - 1].h = memo_mix (stack[sp - 1].h, key ^ root);
+         stack[sp - 1].nsub += nsub;
+      }
+   }
+
+   error = false;
+
+errorexit:
+
+   mem_free (stack);
+
+   return !error;
+}
+
+static void memo_del (struct memo_t *m)
+{
+   if (!m)
+      return;
+
+   for (uint32_t i=0; i<m->nentries; i++)
+      mem_free (m->entries[i].out);
+   mem_free (m->entries);
+   mem_free (m->slots);
+   mem_free (m->node);
+   mem_free (m->node_key);
+   mem_free (m->pairs);
+   mem_free (m);
+}
+
+static struct memo_t *memo_new (const babylon_text_t *b)
+{
+   const struct flat_t *fl = &b->flat;
+   struct memo_t *ret = NULL;
+   struct memo_count_t counts = { NULL, NULL, 0, 0 };
+   struct memo_found_t *found = NULL;
+   uint32_t nfound = 0,
+            *file_nsub = NULL;
+   uint64_t *file_key = NULL;
+   uint8_t *nincl = NULL;
+   bool error = true;
+
+   if (!(ret = mem_calloc (1, sizeof *ret))
+         || !(nincl = mem_calloc (b->files.nfiles + 1, sizeof *nincl))
+         || !(file_key = mem_calloc (b->files.nfiles + 1, sizeof *file_key))
+         || !(file_nsub = mem_calloc (b->files.nfiles + 1,
+                                      sizeof *file_nsub))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   ret->free = FLAT_NONE;
+   ret->first = FLAT_NONE;
+   ret->last = FLAT_NONE;
+
+   // The root of an included file is a kid of every node including it.
+   for (uint32_t n=0; n<fl->nnodes; n++) {
+      for (uint32_t i=0; i<fl->nkids[n]; i++) {
+         uint32_t k = fl->kids[fl->kids_first[n] + i];
+         if (fl->file[k] != fl->file[n] && nincl[fl->file[k]] < 2)
+            nincl[fl->file[k]]++;
+      }
+   }
+
+   if (!(memo_walk (b, nincl, file_key, file_nsub, &counts, &found,
+                    &nfound)))
+      goto errorexit;
+
+   // Only subtrees that occur more than once are worth caching.
+   uint32_t nnodes = 0;
+   for (uint32_t i=0; i<nfound; i++) {
+      if (memo_count_get (&counts, found[i].key) > 1)
+         found[nnodes++] = found[i];
+   }
+
+   ret->nnode_slots = 0;
+   if (nnodes) {
+      ret->nnode_slots = 64;
+      while (ret->nnode_slots < nnodes * 2)
+         ret->nnode_slots *= 2;
+      if (!(ret->node = mem_malloc ((size_t)ret->nnode_slots
+                                    * sizeof *ret->node))
+            || !(ret->node_key = mem_malloc ((size_t)ret->nnode_slots
+                                             * sizeof *ret->node_key))) {
+         LOG_ERR ("OOM\n");
+         goto errorexit;
+      }
+   }
+
+   for (uint32_t j=0; j<ret->nnode_slots; j++)
+      ret->node[j] = FLAT_NONE;
+
+   for (uint32_t i=0; i<nnodes; i++) {
+      uint32_t mask = ret->nnode_slots - 1,
+               j = (found[i].node * 2654435761u) & mask;
+      while (ret->node[j] != FLAT_NONE)
+         j = (j + 1) & mask;
+      ret->node[j] = found[i].node;
+      ret->node_key[j] = found[i].key;
+   }
+
+   error = false;
+
+errorexit:
+
+   mem_free (counts.keys);
+   mem_free (counts.count);
+   mem_free (found);
+   mem_free (nincl);
+   mem_free (file_key);
+   mem_free (file_nsub);
+
+   if (error) {
+      memo_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+// Returns the structural hash of node 'n', or zero if it is not worth
+// caching.
+static uint64_t memo_node_key (const struct memo_t *m, uint32_t n)
+{
+   if (!m->nnode_slots)
+      return 0;
+
+   uint32_t mask = m->nnode_slots - 1;
+   for (uint32_t j=(n * 2654435761u) & mask; m->node[j]!=FLAT_NONE;
+                 j=(j + 1) & mask) {
+      if (m->node[j] == n) {
+#ifdef BABYLON_MEMO_COLLIDE
+         // For babylon_memocheck: every subtree collides with every
+         // other, and only memo_same() tells them apart.
+         return 1;
+#else
+         return m->node_key[j];
+#endif
+      }
+   }
+   return 0;
+}
+
+// Compares two nodes without their kids.
+static bool memo_node_same (const struct flat_t *fl, uint32_t a, uint32_t c)
+{
+   if (fl->type[a] != fl->type[c])
+      return false;
+
+   if (fl->type[a] != node_NODE)
+      return fl->text[a].len == fl->text[c].len
+          && !memcmp (fl->text[a].s, fl->text[c].s, fl->text[a].len);
+
+   if (fl->tag[a] != fl->tag[c] || fl->nattrs[a] != fl->nattrs[c]
+         || fl->nkids[a] != fl->nkids[c])
+      return false;
+
+   for (uint32_t i=0; i<fl->nattrs[a]; i++) {
+      uint32_t x = fl->attrs_first[a] + i,
+               y = fl->attrs_first[c] + i;
+      if (fl->attr_name[x] != fl->attr_name[y]
+            || fl->attr_value[x].len != fl->attr_value[y].len
+            || memcmp (fl->attr_value[x].s, fl->attr_value[y].s,
+                       fl->attr_value[x].len))
+         return false;
+   }
+   return true;
+}
+
+// True if the subtrees of 'a' and 'c' are the same: their tags,
+// attributes and words, and where included files start in them. Shared
+// parts (the same file included twice) are not walked. False as well if
+// there is no memory to compare them.
+static bool memo_same (struct memo_t *m, const struct flat_t *fl,
+                       uint32_t a, uint32_t c)
+{
+   size_t sp = 0;
+
+   if (a == c)
+      return true;
+   if (!(memo_node_same (fl, a, c)))
+      return false;
+
+   for (;;) {
+      if (a != FLAT_NONE) {
+         if (sp >= m->pairs_size) {
+            size_t newsize = m->pairs_size ? m->pairs_size * 2 : 64;
+            struct memo_pair_t *tmp = mem_realloc (m->pairs,
+                                                   newsize * sizeof *tmp);
+            if (!tmp) {
+               LOG_ERR ("OOM\n");
+               return false;
+            }
+            m->pairs = tmp;
+            m->pairs_size = newsize;
+         }
+         m->pairs[sp].a = a;
+         m->pairs[sp].c = c;
+         m->pairs[sp++].kid = 0;
+      }
+
+      if (!sp)
+         return true;
+
+      struct memo_pair_t *p = &m->pairs[sp - 1];
+      a = FLAT_NONE;
+
+      while (a == FLAT_NONE && p->kid < fl->nkids[p->a]) {
+         uint32_t ka = fl->kids[fl->kids_first[p->a] + p->kid],
+                  kc = fl->kids[fl->kids_first[p->c] + p->kid++];
+         if ((fl->file[ka] != fl->file[p->a])
+               != (fl->file[kc] != fl->file[p->c]))
+            return false;
+         if (ka == kc)
+            continue;
+         if (!(memo_node_same (fl, ka, kc)))
+            return false;
+         if (fl->type[ka] == node_NODE && fl->nkids[ka]) {
+            a = ka;
+            c = kc;
+         }
+      }
+
+      if (a == FLAT_NONE)
+         sp--;
+   }
+}
+
+static uint32_t memo_find (const struct memo_t *m, uint64_t key)
+{
+   if (!m->nslots)
+      return FLAT_NONE;
+
+   for (uint32_t j=(uint32_t)key & (m->nslots - 1); ;
+                 j=(j + 1) & (m->nslots - 1)) {
+      uint32_t e = m->slots[j];
+      if (e == FLAT_NONE || m->entries[e].key == key)
+         return e;
+   }
+}
+
+static void memo_unlink (struct memo_t *m, uint32_t e)
+{
+   struct memo_entry_t *ent = &m->entries[e];
+
+   if (ent->prev != FLAT_NONE)
+      m->entries[ent->prev].next = ent->next;
+   else
+      m->first = ent->next;
+   if (ent->next != FLAT_NONE)
+      m->entries[ent->next].prev = ent->prev;
+   else
+      m->last = ent->prev;
+}
+
+static void memo_link_first (struct memo_t *m, uint32_t e)
+{
+   struct memo_entry_t *ent = &m->entries[e];
+
+   ent->prev = FLAT_NONE;
+   ent->next = m->first;
+   if (m->first != FLAT_NONE)
+      m->entries[m->first].prev = e;
+   else
+      m->last = e;
+   m->first = e;
+}
+
+static void memo_touch (struct memo_t *m, uint32_t e)
+{
+   if (m->first != e) {
+      memo_unlink (m, e);
+      memo_link_first (m, e);
+   }
+}
+
+static size_t memo_cost (size_t len)
+{
+   return len + sizeof (struct memo_entry_t) + 2 * sizeof (uint32_t);
+}
+
+static void memo_evict (struct memo_t *m, uint32_t e)
+{
+   struct memo_entry_t *ent = &m->entries[e];
+   uint32_t mask = m->nslots - 1,
+            i = (uint32_t)ent->key & mask;
+
+   while (m->slots[i] != e)
+      i = (i + 1) & mask;
+
+   // Later entries of the same run move back into the hole, unless
+   // their own slot is after it.
+   for (uint32_t j=(i + 1) & mask; m->slots[j] != FLAT_NONE;
+                 j=(j + 1) & mask) {
+      uint32_t home = (uint32_t)m->entries[m->slots[j]].key & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+         m->slots[i] = m->slots[j];
+         i = j;
+      }
+   }
+   m->slots[i] = FLAT_NONE;
+
+   memo_unlink (m, e);
+   m->nlive--;
+   m->bytes -= memo_cost (ent->len);
+   m->outbytes -= ent->len;
+   mem_free (ent->out);
+   ent->out = NULL;
+   ent->next = m->free;
+   m->free = e;
+}
+
+// Evicts the least recently used entries until the cache holds at most
+// 'limit' bytes; returns how many it evicted.
+static size_t memo_trim (struct memo_t *m, size_t limit)
+{
+   size_t ret = 0;
+
+   while (m->bytes > limit && m->last != FLAT_NONE) {
+      memo_evict (m, m->last);
+      ret++;
+   }
+
+   return ret;
+}
+
+static bool memo_rehash (struct memo_t *m, uint32_t nslots)
+{
+   uint32_t *slots = mem_malloc ((size_t)nslots * sizeof *slots);
+   if (!slots) {
+      LOG_ERR ("OOM\n");
+      return false;
+   }
+
+   for (uint32_t j=0; j<nslots; j++)
+      slots[j] = FLAT_NONE;
+
+   for (uint32_t e=m->first; e!=FLAT_NONE; e=m->entries[e].next) {
+      uint32_t j = (uint32_t)m->entries[e].key & (nslots - 1);
+      while (slots[j] != FLAT_NONE)
+         j = (j + 1) & (nslots - 1);
+      slots[j] = e;
+   }
+
+   mem_free (m->slots);
+   m->slots = slots;
+   m->nslots = nslots;
+   return true;
+}
+
+// Adds an entry like 'from' with the output 'out' of from->len bytes, or
+// only that the subtree cannot be reused if from->reusable is false.
+static bool memo_store (babylon_text_t *b, const struct memo_entry_t *from,
+                        const char *out)
+{
+   struct memo_t *m = b->memo;
+   size_t cost = memo_cost (from->reusable ? from->len : 0);
+   uint32_t e = FLAT_NONE;
+
+   if (cost > b->memo_limit / MEMO_MAX_SHARE)
+      return true;
+
+   b->stats.memo_evictions += memo_trim (m, b->memo_limit - cost);
+
+   if ((m->nlive + 1) * 2 > m->nslots
+         && !(memo_rehash (m, m->nslots ? m->nslots * 2 : 64)))
+      return false;
+
+   if (m->free != FLAT_NONE) {
+      e = m->free;
+      m->free = m->entries[e].next;
+   } else {
+      if (m->nentries >= m->entries_size) {
+         uint32_t newsize = m->entries_size ? m->entries_size * 2 : 64;
+         if (!(FLAT_GROW (m->entries, newsize)))
+            return false;
+         m->entries_size = newsize;
+      }
+      e = m->nentries++;
+   }
+
+   struct memo_entry_t *ent = &m->entries[e];
+   ent->key = from->key;
+   ent->node = from->node;
+   ent->fileroot = from->fileroot;
+   ent->foreach = from->foreach;
+   ent->reusable = from->reusable;
+   ent->out = NULL;
+   ent->len = from->reusable ? from->len : 0;
+   ent->ninherited = from->ninherited;
+
+   if (ent->len && !(ent->out = mem_malloc (ent->len))) {
+      LOG_ERR ("OOM\n");
+      ent->next = m->free;
+      m->free = e;
+      return false;
+   }
+   if (ent->len)
+      memcpy (ent->out, out, ent->len);
+
+   uint32_t j = (uint32_t)ent->key & (m->nslots - 1);
+   while (m->slots[j] != FLAT_NONE)
+      j = (j + 1) & (m->nslots - 1);
+   m->slots[j] = e;
+
+   memo_link_first (m, e);
+   m->nlive++;
+   m->bytes += cost;
+   m->outbytes += ent->len;
+   return true;
+}
+
+/* ************************************************************** */
+
+void babylon_text_error (babylon_text_t *b, int errcode)
+{
+   static const struct {
+      int         errcode;
+      const char *errmsg;
+   } errors[] = {
+      { BABYLON_EPARAM,     "Bad parameter"      },
+      { BABYLON_EFREAD,     "Input-file error"   },
+      { BABYLON_EINCLUDE,   "Include cycle"      },
+      { BABYLON_ETRANSFORM, "Transform error"    },
+      { BABYLON_EFWRITE,    "Output error"       },
+      { BABYLON_ECANCEL,    "Cancelled"          },
+   };
+
+   char *tmp = NULL;
+
+   if (!b)
+      return;
+
+   for (size_t i=0; i<sizeof errors/sizeof errors[0]; i++) {
+      if (errors[i].errcode == errcode) {
+         if (!(tmp = mem_strdup (errors[i].errmsg))) {
+            LOG_ERR ("Fatal error: OOM\n");
+            return;
+         }
+      }
+   }
+
+   if (!tmp)
+      mem_printf (&tmp, "Unknown error [%i]", errcode);
+
+   if (!tmp) {
+      LOG_ERR ("Fatal error: OOM\n");
+      return;
+   }
+
+   b->errcode = errcode;
+   mem_free (b->errmsg);
+   b->errmsg = tmp;
+}
+
+static babylon_text_t *babylon_text_new (const char *filename)
+{
+   babylon_text_t *ret = NULL;
+
+   if (!(ret = mem_malloc (sizeof *ret))) {
+      LOG_ERR ("OOM\n");
+      return NULL;
+   }
+
+   LOG_DEBUG ("Created\n");
+
+   memset (ret, 0, sizeof *ret);
+   ret->errcode = 0;
+   ret->errmsg = mem_strdup ("Success");
+   ret->root = FLAT_NONE;
+   if (!(ret->arena = arena_new ())
+         || !(ret->filename = arena_strndup (ret->arena, filename,
+                                             strlen (filename)))) {
+      babylon_text_error (ret, BABYLON_EFREAD);
+   }
+
+   return ret;
+}
+
+babylon_text_t *babylon_text_read (const char *filename)
+{
+   babylon_text_t *ret = NULL;
+
+   if (!(ret = babylon_text_new (filename)) || ret->errcode)
+      goto errorexit;
+
+   double start = clock_now ();
+
+   if ((ret->root = node_include (ret, NULL, filename)) == FLAT_NONE) {
+      LOG_ERR ("Failed to read file [%s]:%m\n", filename);
+      // An include cycle found on the way is the better explanation.
+      if (!ret->errcode)
+         babylon_text_error (ret, BABYLON_EFREAD);
+      goto errorexit;
+   }
+
+   double read = clock_now ();
+   ret->stats.read_time = read - start;
+
+   if (!(tag_index (ret)) || !(link_index (ret))) {
+      babylon_text_error (ret, BABYLON_EFREAD);
+      goto errorexit;
+   }
+
+   ret->stats.index_time = clock_now () - read;
+
+errorexit:
+   return ret;
+}
+
+static babylon_text_t *babylon_text_read_units (const char *filename,
+                                                size_t nthreads,
+                                                babylon_text_t *prev,
+                                                bool babc,
+                                                const char *cachedir)
+{
+   babylon_text_t *ret = NULL;
+
+   if (!(ret = babylon_text_new (filename)) || ret->errcode)
+      goto errorexit;
+
+   ret->babc = babc;
+   if (cachedir && !(ret->cachedir = arena_strndup (ret->arena, cachedir,
+                                                    strlen (cachedir)))) {
+      babylon_text_error (ret, BABYLON_EFREAD);
+      goto errorexit;
+   }
+
+   double start = clock_now ();
+
+   if ((ret->root = node_readfile_parallel (ret, filename, nthreads,
+                                            prev)) == FLAT_NONE) {
+      LOG_ERR ("Failed to read file [%s]\n", filename);
+      if (!ret->errcode)
+         babylon_text_error (ret, BABYLON_EFREAD);
+      goto errorexit;
+   }
+
+   double read = clock_now ();
+   ret->stats.read_time = read - start;
+
+   if (!(tag_index (ret)) || !(link_index (ret))) {
+      babylon_text_error (ret, BABYLON_EFREAD);
+      goto errorexit;
+   }
+
+   ret->stats.index_time = clock_now () - read;
+
+errorexit:
+   return ret;
+}
+
+babylon_text_t *babylon_text_read_parallel (const char *filename,
+                                            size_t nthreads)
+{
+   return babylon_text_read_units (filename, nthreads, NULL, false, NULL);
+}
+
+babylon_text_t *babylon_text_read_cached (const char *filename,
+                                          const char *cachedir,
+                                          size_t nthreads)
+{
+   return babylon_text_read_units (filename, nthreads, NULL, true,
+                                   cachedir);
+}
+
+babylon_text_t *babylon_text_reread (babylon_text_t *prev, size_t nthreads)
+{
+   if (!prev || !prev->filename) {
+      LOG_ERR ("NULL object passed to function\n");
+      return NULL;
+   }
+
+   babylon_text_t *ret = babylon_text_read_units (prev->filename, nthreads,
+                                                  prev, prev->babc,
+                                                  prev->cachedir);
+   if (ret)
+      ret->memo_limit = prev->memo_limit;
+
+   return ret;
+}
+
+bool babylon_text_changed (babylon_text_t *b)
+{
+   if (!b)
+      return false;
+
+   // A document none of whose files could be read is retried.
+   if (!b->incs.paths.nnames)
+      return true;
+
+   for (uint32_t i=0; i<b->incs.paths.nnames; i++) {
+      struct filestamp_t stamp;
+      struct incentry_t *e = &b->incs.entries[i];
+      char *canon = file_canon (b->incs.paths.names[i].s, &stamp);
+      bool changed = !canon || stamp.mtime != e->stamp.mtime
+                            || stamp.size != e->stamp.size;
+
+      mem_free (canon);
+      if (changed)
+         return true;
+   }
+
+   return false;
+}
+
+// Paths are escaped the way make expects them.
+static void deps_write_path (FILE *outf, const char *path)
+{
+   for (; *path; path++) {
+      if (*path == ' ' || *path == '#' || *path == '\\')
+         fputc ('\\', outf);
+      if (*path == '$')
+         fputc ('$', outf);
+      fputc (*path, outf);
+   }
+}
+
+bool babylon_text_deps (babylon_text_t *b, FILE *outf)
+{
+   if (!outf)
+      outf = stdout;
+
+   if (!b) {
+      LOG_ERR ("NULL object passed to function\n");
+      return false;
+   }
+
+   for (uint32_t i=0; i<b->files.nfiles; i++) {
+      struct srcfile_t *f = &b->files.files[i];
+      if (!f->ndeps)
+         continue;
+
+      deps_write_path (outf, f->path);
+      fputc (':', outf);
+      for (uint32_t j=0; j<f->ndeps; j++) {
+         fputc (' ', outf);
+         deps_write_path (outf, b->files.files[f->deps[j]].path);
+      }
+      fputc ('\n', outf);
+   }
+
+   return !ferror (outf);
+}
+
+void babylon_text_del (babylon_text_t *b)
+{
+   if (!b)
+      return;
+
+   mem_free (b->errmsg);
+   linktab_del (b->links);
+   memo_del (b->memo);
+   mem_free (b->tag_first);
+   mem_free (b->tag_nodes);
+   flat_free (&b->flat);
+   inccache_free (&b->incs);
+   arena_del (b->arena);
+   mem_free (b);
+}
+
+bool babylon_text_write (babylon_text_t *b, FILE *outf)
+{
+   struct outfile_t o;
+
+   if (!outf)
+      outf = stdout;
+
+   if (!b) {
+      LOG_ERR ("NULL object passed to function\n");
+      return false;
+   }
+
+   if (!(outfile_open (&o, outf))) {
+      babylon_text_error (b, BABYLON_EFWRITE);
+      return false;
+   }
+
+   bool ret = flat_dump (&b->flat, &b->files, b->root, outfile_sink, &o);
+   if (!(outfile_close (&o)) || !ret) {
+      babylon_text_error (b, BABYLON_EFWRITE);
+      return false;
+   }
+
+   return true;
+}
+
+bool babylon_text_write_buffer (babylon_text_t *b, babylon_buffer_t *buf)
+{
+   if (!b || !buf) {
+      LOG_ERR ("NULL object passed to function\n");
+      return false;
+   }
+
+   size_t len = buf->len;
+   if (!(flat_dump (&b->flat, &b->files, b->root, buffer_sink, buf))
+         || !(buffer_sink (buf, "", 0))) {
+      LOG_ERR ("OOM\n");
+      babylon_text_error (b, BABYLON_EFWRITE);
+      if (buf->data)
+         buf->data[buf->len = len] = 0;
+      return false;
+   }
+
+   return true;
+}
+
+// The memory of the tree's columns, counting what has been reserved and
+// not only what is used.
+static size_t flat_bytes (const struct flat_t *fl)
+{
+   size_t node = sizeof *fl->text + sizeof *fl->file,
+          kid = 0,
+          attr = sizeof *fl->attr_value;
+
+   if (!fl->borrowed) {
+      node += sizeof *fl->type + sizeof *fl->tag + sizeof *fl->offset
+            + sizeof *fl->kids_first + sizeof *fl->nkids
+            + sizeof *fl->attrs_first + sizeof *fl->nattrs;
+      kid += sizeof *fl->kids;
+      attr += sizeof *fl->attr_name;
+   }
+
+   return (size_t)fl->nodes_size * node + (size_t)fl->kids_size * kid
+        + (size_t)fl->attrs_size * attr
+        + (size_t)fl->naslots * sizeof *fl->aslots
+        + (size_t)fl->stack_size * sizeof *fl->stack;
+}
+
+bool babylon_text_stats (babylon_text_t *b, babylon_stats_t *stats)
+{
+   if (!b || !stats) {
+      LOG_ERR ("NULL object passed to function\n");
+      return false;
+   }
+
+   const struct flat_t *fl = &b->flat;
+
+   *stats = b->stats;
+   stats->nfiles = b->files.nfiles;
+   stats->nnodes = fl->nnodes;
+   stats->nattrs = 0;
+   stats->nincludes = 0;
+
+   // Every included file is a kid of the node that includes it, rooted in
+   // a file of its own. A file included more than once is one subtree.
+   for (uint32_t n=0; n<fl->nnodes; n++) {
+      stats->nattrs += fl->nattrs[n];
+      for (uint32_t i=0; i<fl->nkids[n]; i++) {
+         uint32_t k = fl->kids[fl->kids_first[n] + i];
+         if (fl->file[k] != fl->file[n])
+            stats->nincludes++;
+      }
+   }
+
+   size_t bytes = (b->arena ? b->arena->nbytes : 0) + flat_bytes (fl);
+   if (b->tag_first)
+      bytes += (fl->syms.nnames + 2 + b->tag_first[fl->syms.nnames])
+             * sizeof *b->tag_first;
+   for (uint32_t i=0; i<b->files.nfiles; i++) {
+      if (b->files.files[i].in)
+         bytes += b->files.files[i].in->len;
+   }
+   // The trees of a parallel read are kept for reading the document
+   // again.
+   for (uint32_t i=0; b->incs.entries && i<b->incs.paths.nnames; i++) {
+      const struct unit_t *u = b->incs.entries[i].unit;
+      if (u)
+         bytes += (u->arena ? u->arena->nbytes : 0) + flat_bytes (&u->flat);
+   }
+   const struct memo_t *m = b->memo;
+   if (m)
+      bytes += (size_t)m->nnode_slots
+                  * (sizeof *m->node + sizeof *m->node_key)
+             + (size_t)m->entries_size * sizeof *m->entries
+             + (size_t)m->nslots * sizeof *m->slots + m->outbytes;
+   stats->bytes_allocated = bytes;
+
+   return true;
+}
+
+void babylon_text_warn_inherited (babylon_text_t *b, bool warn)
+{
+   if (b)
+      b->warn_inherited = warn;
+}
+
+size_t babylon_text_inherited (babylon_text_t *b)
+{
+   return b ? b->ninherited : 0;
+}
+
+void babylon_text_memo_limit (babylon_text_t *b, size_t limit)
+{
+   if (!b)
+      return;
+
+   b->memo_limit = limit;
+   if (b->memo && limit)
+      memo_trim (b->memo, limit);
+   if (b->memo && !limit) {
+      memo_del (b->memo);
+      b->memo = NULL;
+   }
+}
+
+int babylon_text_errcode (babylon_text_t *b)
+{
+   return b ? b->errcode : BABYLON_EPARAM;
+}
+
+const char *babylon_text_errmsg (babylon_text_t *b)
+{
+   return b ? b->errmsg : "bad param";
+}
+
+/* ************************************************************** */
+
+// Every macro body is compiled once, when the macro file is read, into a
+// program of segments. Expanding a macro is then a walk over its
+// segments from first to last; the body text is never scanned again.
+// The programs of all the macros in a set share one array, and the
+// macros themselves are kept in an array sorted by name. Names, bodies
+// and segments are all offsets into the text of the macro file, so a set
+// compiled into the program by babylon_bamc is the same arrays as
+// constants (see babylon_macro_static()).
+//
+// In a body, $(name) is replaced by the value of the variable 'name' and
+// $(_body_) by the implicit variable supplied by the tree processor.
+// $(_id_) is the ID of a link target that is linked to (nothing for any
+// other node) and $(_ref_) the ID of the target of a link.
+// $(_optional_ text) encloses text and references that are left out as a
+// whole when a variable referenced inside it is not set; optional groups
+// may be nested. $$ is a literal $, as is a $ not followed by ( or $.
+//
+// The 'off' and 'len' of a segment are the literal text of an mseg_TEXT
+// and the name of the others. The 'arg' is the mimplicit_t of an
+// mseg_IMPLICIT and, for an mseg_OPTIONAL, the index of the first
+// segment after the group, so that a group can be skipped without
+// visiting its contents.
+
+enum mseg_type_t {
+   mseg_TEXT,
+   mseg_VAR,
+   mseg_IMPLICIT,
+   mseg_OPTIONAL,
+};
+
+// The implicit variables, in the order of mimplicit_names[].
+enum mimplicit_t {
+   mimplicit_BODY,
+   mimplicit_ID,
+   mimplicit_REF,
+};
+
+static const char *mimplicit_names[] = {
+   "_body_",
+   "_id_",
+   "_ref_",
+};
+
+#define MIMPLICIT_COUNT    (sizeof mimplicit_names / sizeof mimplicit_names[0])
+#define MSEG_MAX_DEPTH     (32)
+
+struct babylon_macro_t {
+   char *filename;
+
+   // The text of the macro file.
+   struct instream_t *source;
+
+   struct babylon_mdef_t *macros;
+   uint32_t nmacros;
+   uint32_t macros_size;
+
+   struct babylon_mseg_t *segs;
+   uint32_t nsegs;
+   uint32_t segs_size;
+
+   // Set for a set compiled into the program; the text and the arrays
+   // are its constants and are not freed.
+   bool builtin;
+};
+
+// Names are ordered bytewise, a name before any longer name it is the
+// start of.
+static int macro_cmp (const char *a, size_t alen, const char *b, size_t blen)
+{
+   int ret = memcmp (a, b, alen < blen ? alen : blen);
+   if (ret)
+      return ret;
+   return alen < blen ? -1 : alen > blen;
+}
+
+static const struct babylon_mdef_t *macro_find (const babylon_macro_t *bm,
+                                                const char *name,
+                                                size_t len)
+{
+   const char *data = bm->source->data;
+   uint32_t lo = 0,
+            hi = bm->nmacros;
+
+   while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      const struct babylon_mdef_t *m = &bm->macros[mid];
+      int cmp = macro_cmp (&data[m->name_off], m->name_len, name, len);
+      if (!cmp)
+         return m;
+      if (cmp < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return NULL;
+}
+
+static void macro_dump (babylon_macro_t *bm, const struct babylon_mdef_t *m,
+                        FILE *outf)
+{
+   const char *data = bm->source->data;
+   size_t line = 0,
+          charpos = 0;
+   instream_location (bm->source, m->body_off, &line, &charpos);
+
+   fprintf (outf, "   Macro Name:      [%.*s]\n", (int)m->name_len,
+                                                   &data[m->name_off]);
+   fprintf (outf, "   From:            [%s:%zu:%zu]\n", bm->filename,
+                                                        line,
+                                                        charpos);
+   fprintf (outf, "   Macro body:      [%.*s]\n", (int)m->body_len,
+                                                   &data[m->body_off]);
+   fprintf (outf, "   Program:         [%u segments]\n", m->nsegs);
+
+   // The segments of an optional group are indented below it.
+   uint32_t ends[MSEG_MAX_DEPTH];
+   size_t depth = 0;
+
+   for (uint32_t i=m->seg_first; i<m->seg_first + m->nsegs; i++) {
+      const struct babylon_mseg_t *seg = &bm->segs[i];
+      const char *text = &data[seg->off];
+
+      while (depth && ends[depth - 1] == i)
+         depth--;
+
+      fprintf (outf, "      %*s", (int)depth * 3, "");
+      switch (seg->type) {
+         case mseg_TEXT:
+            fprintf (outf, "text      [%.*s]\n", (int)seg->len, text);
+            break;
+         case mseg_VAR:
+            fprintf (outf, "variable  [%.*s]\n", (int)seg->len, text);
+            break;
+         case mseg_IMPLICIT:
+            fprintf (outf, "implicit  [%.*s]\n", (int)seg->len, text);
+            break;
+         case mseg_OPTIONAL:
+            fprintf (outf, "optional  [%u segments]\n", seg->arg - i - 1);
+            if (depth < MSEG_MAX_DEPTH)
+               ends[depth++] = seg->arg;
+            break;
+      }
+   }
+}
+
+void babylon_macro_dump (babylon_macro_t *bm, FILE *outf)
+{
+   if (!outf)
+      outf = stdout;
+
+   if (!bm) {
+      fprintf (outf, "Error: NULL macro object.\n");
+      return;
+   }
+
+   fprintf (outf, "--------------------------\n");
+   fprintf (outf, "Filename:          %s\n", bm->filename);
+   fprintf (outf, "Number of macros:  %u\n", bm->nmacros);
+   for (uint32_t i=0; i<bm->nmacros; i++) {
+      macro_dump (bm, &bm->macros[i], outf);
+   }
+   fprintf (outf, "--------------------------\n");
+}
+
+static bool span_is_blank_line (const struct span_t *span)
+{
+   return span->len == 0
+       || (span->len == 1 && span->s[0] == '\n')
+       || (span->len == 2 && span->s[0] == '\r' && span->s[1] == '\n');
+}
+
+static void span_trim (struct span_t *span)
+{
+   while (span->len && isspace ((unsigned char)span->s[0])) {
+      span->s++;
+      span->len--;
+   }
+   while (span->len && isspace ((unsigned char)span->s[span->len - 1]))
+      span->len--;
+}
+
+static bool macro_seg (babylon_macro_t *bm, enum mseg_type_t type,
+                       uint32_t off, uint32_t len, uint32_t arg)
+{
+   if (bm->nsegs >= bm->segs_size) {
+      uint32_t newsize = bm->segs_size ? bm->segs_size * 2 : 64;
+      if (!(FLAT_GROW (bm->segs, newsize)))
+         return false;
+      bm->segs_size = newsize;
+   }
+
+   struct babylon_mseg_t *seg = &bm->segs[bm->nsegs++];
+   seg->type = type;
+   seg->off = off;
+   seg->len = len;
+   seg->arg = arg;
+   return true;
+}
+
+static bool macro_text (babylon_macro_t *bm, uint32_t start, uint32_t end)
+{
+   return start >= end || macro_seg (bm, mseg_TEXT, start, end - start, 0);
+}
+
+// Compiles the body of 'm' into its program, reporting syntax errors with
+// the location in the macro file.
+static bool macro_compile (babylon_macro_t *bm, struct babylon_mdef_t *m)
+{
+   bool error = true;
+
+   const char *data = bm->source->data;
+   uint32_t pos = m->body_off,
+            end = m->body_off + m->body_len,
+            lit = pos,
+            where = pos;
+   const char *msg = NULL;
+
+   // The open optional groups, and for each the number of literal
+   // parentheses within it still to be closed.
+   struct {
+      uint32_t seg;
+      uint32_t parens;
+   } groups[MSEG_MAX_DEPTH];
+   size_t depth = 0;
+
+   m->seg_first = bm->nsegs;
+
+   while (pos < end) {
+      char c = data[pos];
+
+      if (depth && c == '(') {
+         groups[depth - 1].parens++;
+         pos++;
+         continue;
+      }
+
+      if (depth && c == ')') {
+         if (groups[depth - 1].parens) {
+            groups[depth - 1].parens--;
+            pos++;
+            continue;
+         }
+         if (!(macro_text (bm, lit, pos)))
+            goto errorexit;
+         depth--;
+         bm->segs[groups[depth].seg].arg = bm->nsegs;
+         lit = ++pos;
          continue;
+      }
 
-      if (c == ']')
-         break;
+      if (c != '$' || pos + 1 >= end
+            || (data[pos + 1] != '(' && data[pos + 1] != '$')) {
+         pos++;
+         continue;
+      }
 
-      unget_char (c, inf);
+      if (!(macro_text (bm, lit, pos)))
+         goto errorexit;
 
-      cur = NULL;
+      if (data[pos + 1] == '$') {
+         lit = pos + 1;
+         pos += 2;
+         continue;
+      }
 
-      if (c == '[')
-         cur = read_tree (inf, filename, line, charpos);
+      where = pos;
+      uint32_t nstart = pos + 2,
+               nend = nstart;
+      while (nend < end && !isspace ((unsigned char)data[nend])
+                        && data[nend] != '(' && data[nend] != ')'
+                        && data[nend] != '$')
+         nend++;
+
+      struct span_t ref = { &data[nstart], nend - nstart };
+      if (!ref.len) {
+         msg = "Missing variable name";
+         goto errorexit;
+      }
 
-      if (c == '#')
-         cur = read_directive (inf, filename, line, charpos);
+      if (span_eq (&ref, "_optional_")) {
+         if (nend >= end || !isspace ((unsigned char)data[nend])) {
+            msg = "Expected text after [$(_optional_]";
+            goto errorexit;
+         }
+         if (depth >= MSEG_MAX_DEPTH) {
+            msg = "Optional groups are nested too deeply";
+            goto errorexit;
+         }
+         groups[depth].seg = bm->nsegs;
+         groups[depth].parens = 0;
+         depth++;
+         if (!(macro_seg (bm, mseg_OPTIONAL, nstart, ref.len, 0)))
+            goto errorexit;
+         // A single whitespace character separates the keyword from the
+         // contents of the group.
+         lit = pos = nend + 1;
+         continue;
+      }
+
+      if (nend >= end || data[nend] != ')') {
+         msg = "Expected [)] after the variable name";
+         goto errorexit;
+      }
 
-      if (!cur)
-         if (!(cur = read_text (inf, filename, line, charpos)))
+      enum mseg_type_t type = mseg_VAR;
+      uint32_t arg = 0;
+      if (ref.s[0] == '_') {
+         for (arg=0; arg<MIMPLICIT_COUNT; arg++) {
+            if (span_eq (&ref, mimplicit_names[arg]))
+               break;
+         }
+         if (arg >= MIMPLICIT_COUNT) {
+            msg = "Unknown implicit variable";
             goto errorexit;
+         }
+         type = mseg_IMPLICIT;
+      }
 
-      if (!cur)
-         break;
+      if (!(macro_seg (bm, type, nstart, ref.len, arg)))
+         goto errorexit;
 
-      if (!(ds_array_ins_tail (&tmp->nodes, cur))) {
-         LOG_ERR ("Failed to append to array\n");
+      lit = pos = nend + 1;
+   }
+
+   if (depth) {
+      where = bm->segs[groups[depth - 1].seg].off - 2;
+      msg = "Unterminated [$(_optional_] group";
+      goto errorexit;
+   }
+
+   if (!(macro_text (bm, lit, end)))
+      goto errorexit;
+
+   m->nsegs = bm->nsegs - m->seg_first;
+   error = false;
+
+errorexit:
+
+   if (msg) {
+      size_t line = 0,
+             charpos = 0;
+      instream_location (bm->source, where, &line, &charpos);
+      LOG_ERR ("%s:%zu:%zu: Macro [%.*s]: %s\n", bm->filename, line + 1,
+                                                  charpos + 1,
+                                                  (int)m->name_len,
+                                                  &data[m->name_off],
+                                                  msg);
+   }
+
+   return !error;
+}
+
+struct macro_key_t {
+   const char *name;
+   uint32_t len;
+   uint32_t index;
+};
+
+static int macro_key_cmp (const void *lhs, const void *rhs)
+{
+   const struct macro_key_t *a = lhs,
+                            *b = rhs;
+   int ret = macro_cmp (a->name, a->len, b->name, b->len);
+   if (ret)
+      return ret;
+   return a->index < b->index ? -1 : a->index > b->index;
+}
+
+// Sorts the macros by name. Of several macros with the same name the
+// last one in the file is kept.
+static bool macro_sort (babylon_macro_t *bm)
+{
+   struct macro_key_t *keys = NULL;
+   struct babylon_mdef_t *sorted = NULL;
+   uint32_t n = 0;
+
+   if (!bm->nmacros)
+      return true;
+
+   if (!(keys = mem_malloc (bm->nmacros * sizeof *keys))
+         || !(sorted = mem_malloc (bm->nmacros * sizeof *sorted))) {
+      LOG_ERR ("OOM\n");
+      mem_free (keys);
+      return false;
+   }
+
+   for (uint32_t i=0; i<bm->nmacros; i++) {
+      keys[i].name = &bm->source->data[bm->macros[i].name_off];
+      keys[i].len = bm->macros[i].name_len;
+      keys[i].index = i;
+   }
+
+   qsort (keys, bm->nmacros, sizeof *keys, macro_key_cmp);
+
+   for (uint32_t i=0; i<bm->nmacros; i++) {
+      if (i + 1 < bm->nmacros
+            && !(macro_cmp (keys[i].name, keys[i].len,
+                            keys[i + 1].name, keys[i + 1].len)))
+         continue;
+      sorted[n++] = bm->macros[keys[i].index];
+   }
+
+   mem_free (keys);
+   mem_free (bm->macros);
+   bm->macros = sorted;
+   bm->nmacros = bm->macros_size = n;
+   return true;
+}
+
+babylon_macro_t *babylon_macro_read (const char *filename)
+{
+   bool error = true;
+   babylon_macro_t *ret = NULL;
+
+   struct span_t input;
+   struct instream_t *in = NULL;
+
+   if (!(ret = mem_malloc (sizeof *ret))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   memset (ret, 0, sizeof *ret);
+
+   if (!(ret->filename = mem_strdup (filename))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   if (!(in = instream_open (filename))) {
+      LOG_ERR ("Failed to open file [%s] for reading: %m\n", filename);
+      goto errorexit;
+   }
+   instream_check_utf8 (in, filename);
+
+   // The macro bodies point into the input buffer.
+   ret->source = in;
+
+   if (in->len > UINT32_MAX) {
+      LOG_ERR ("File [%s] is too large\n", filename);
+      goto errorexit;
+   }
+
+   while ((get_next_line (in, &input))) {
+      // The first non-empty line signifies the start of a macro and
+      // contains the name of the macro.
+      span_trim (&input);
+      if (!input.len) {
+         continue;
+      }
+
+      if (ret->nmacros >= ret->macros_size) {
+         uint32_t newsize = ret->macros_size ? ret->macros_size * 2 : 16;
+         if (!(FLAT_GROW (ret->macros, newsize)))
+            goto errorexit;
+         ret->macros_size = newsize;
+      }
+
+      struct babylon_mdef_t *m = &ret->macros[ret->nmacros];
+      memset (m, 0, sizeof *m);
+      m->name_off = (uint32_t)(input.s - in->data);
+      m->name_len = (uint32_t)input.len;
+
+      // Repeatedly retrieve lines until we get an empty one. The body is
+      // every line in between, which is contiguous in the input buffer.
+      m->body_off = (uint32_t)in->pos;
+      while ((get_next_line (in, &input))) {
+         if (span_is_blank_line (&input))
+            break;
+
+         m->body_len += (uint32_t)input.len;
+      }
+
+      if (!(macro_compile (ret, m)))
          goto errorexit;
+
+      ret->nmacros++;
+   }
+
+   if (!(macro_sort (ret)))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+
+   if (error) {
+      babylon_macro_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+// Only what the tables refer to is checked: the generated source comes
+// from babylon_bamc, which compiled it from a valid macro file.
+babylon_macro_t *babylon_macro_static (const struct babylon_mset_t *set)
+{
+   bool error = true;
+   babylon_macro_t *ret = NULL;
+
+   if (!set || set->version != BABYLON_MSET_VERSION) {
+      LOG_ERR ("Macro set compiled for a different version\n");
+      return NULL;
+   }
+
+   for (uint32_t i=0; i<set->nmacros; i++) {
+      const struct babylon_mdef_t *m = &set->macros[i];
+      if ((uint64_t)m->name_off + m->name_len > set->source_len
+            || (uint64_t)m->body_off + m->body_len > set->source_len
+            || (uint64_t)m->seg_first + m->nsegs > set->nsegs) {
+         LOG_ERR ("Macro set [%s] is damaged\n", set->filename);
+         return NULL;
+      }
+   }
+
+   for (uint32_t i=0; i<set->nsegs; i++) {
+      const struct babylon_mseg_t *seg = &set->segs[i];
+      if ((uint64_t)seg->off + seg->len > set->source_len
+            || seg->type > mseg_OPTIONAL
+            || (seg->type == mseg_IMPLICIT && seg->arg >= MIMPLICIT_COUNT)
+            || (seg->type == mseg_OPTIONAL
+                  && (seg->arg <= i || seg->arg > set->nsegs))) {
+         LOG_ERR ("Macro set [%s] is damaged\n", set->filename);
+         return NULL;
       }
    }
 
+   if (!(ret = mem_calloc (1, sizeof *ret))
+         || !(ret->source = mem_calloc (1, sizeof *ret->source))
+         || !(ret->filename = mem_strdup (set->filename))) {
+      LOG_ERR ("OOM\n");
+      goto errorexit;
+   }
+
+   ret->builtin = true;
+   ret->source->data = set->source;
+   ret->source->len = set->source_len;
+   ret->source->borrowed = true;
+
+   // The arrays are only written while a set is being read from a file.
+   ret->macros = (struct babylon_mdef_t *)set->macros;
+   ret->nmacros = set->nmacros;
+   ret->segs = (struct babylon_mseg_t *)set->segs;
+   ret->nsegs = set->nsegs;
+
    error = false;
 
-errorexit:
+errorexit:
+
+   if (error) {
+      babylon_macro_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+// Writes the text as a C string literal, one line of the text to a line
+// of the literal.
+static void write_c_string (FILE *outf, const char *s, size_t len)
+{
+   fprintf (outf, "   \"");
+   for (size_t i=0; i<len; i++) {
+      unsigned char c = (unsigned char)s[i];
+      if (c == '\n') {
+         fprintf (outf, "\\n\"");
+         if (i + 1 < len)
+            fprintf (outf, "\n   \"");
+         continue;
+      }
+      if (c == '"' || c == '\\' || c == '?')
+         fprintf (outf, "\\%c", c);
+      else if (c < 0x20 || c >= 0x7f)
+         fprintf (outf, "\\%03o", c);
+      else
+         fputc (c, outf);
+   }
+   if (!len || s[len - 1] != '\n')
+      fputc ('"', outf);
+}
+
+bool babylon_macro_write_c (babylon_macro_t *bm, const char *symbol,
+                            FILE *outf)
+{
+   if (!outf)
+      outf = stdout;
+
+   if (!bm || !symbol) {
+      LOG_ERR ("NULL object passed to function\n");
+      return false;
+   }
+
+   fprintf (outf, "// Generated by babylon_bamc from [%s]. Do not edit.\n\n",
+                  bm->filename);
+   fprintf (outf, "#include \"babylon_text.h\"\n\n");
+
+   fprintf (outf, "static const char source[] =\n");
+   write_c_string (outf, bm->source->data, bm->source->len);
+   fprintf (outf, ";\n\n");
+
+   // C has no empty arrays; the counts below are what matter.
+   fprintf (outf, "static const struct babylon_mseg_t segs[] = {\n");
+   for (uint32_t i=0; i<bm->nsegs; i++) {
+      const struct babylon_mseg_t *seg = &bm->segs[i];
+      fprintf (outf, "   { %u, %u, %u, %u },\n", seg->type, seg->off,
+                                                 seg->len, seg->arg);
+   }
+   if (!bm->nsegs)
+      fprintf (outf, "   { 0, 0, 0, 0 },\n");
+   fprintf (outf, "};\n\n");
+
+   fprintf (outf, "static const struct babylon_mdef_t macros[] = {\n");
+   for (uint32_t i=0; i<bm->nmacros; i++) {
+      const struct babylon_mdef_t *m = &bm->macros[i];
+      fprintf (outf, "   { %u, %u, %u, %u, %u, %u },\n",
+                     m->name_off, m->name_len, m->body_off, m->body_len,
+                     m->seg_first, m->nsegs);
+   }
+   if (!bm->nmacros)
+      fprintf (outf, "   { 0, 0, 0, 0, 0, 0 },\n");
+   fprintf (outf, "};\n\n");
+
+   fprintf (outf, "const struct babylon_mset_t %s = {\n", symbol);
+   fprintf (outf, "   BABYLON_MSET_VERSION,\n");
+   fprintf (outf, "   \"");
+   for (const char *c=bm->filename; *c; c++) {
+      if (*c == '"' || *c == '\\')
+         fputc ('\\', outf);
+      fputc (*c, outf);
+   }
+   fprintf (outf, "\",\n");
+   fprintf (outf, "   source, %zu,\n", bm->source->len);
+   fprintf (outf, "   macros, %u,\n", bm->nmacros);
+   fprintf (outf, "   segs, %u,\n", bm->nsegs);
+   fprintf (outf, "};\n");
+
+   return !ferror (outf);
+}
+
+void babylon_macro_del (babylon_macro_t *bm)
+{
+   if (!bm)
+      return;
+
+   if (!bm->builtin) {
+      mem_free (bm->macros);
+      mem_free (bm->segs);
+   }
+
+   mem_free (bm->filename);
+   instream_close (bm->source);
+   mem_free (bm);
+}
+
+/* ************************************************************** */
+
+// The transform expands the document in a single pass in document order.
+// Every piece of output (macro text, attribute values, the words of the
+// tree) is written to the sink the moment it is reached; the output of
+// the children of a node is written where its macro references
+// $(_body_), so nothing is collected and copied into the output of the
+// parent. Words in a body are separated by single spaces.
+//
+// Nodes being expanded are kept on an explicit stack, each with its
+// position in its program. The root of every file has no macro; it is
+// replaced by its body.
+//
+// A variable not set on the node itself is inherited from the nearest
+// enclosing node that sets it. Rather than searching upwards, the
+// transform keeps a shadow stack per name: entering a node pushes each
+// of its attributes onto the stack of its name and leaving the node pops
+// them again, so the innermost definition of every name is always on top
+// and a lookup is a single array access.
+//
+// A node with a for-each=tag attribute writes its body once for every
+// node of 'tag' in the document, in document order, taken from the
+// document's tag index. In that body, $(tag.name) in the text and in
+// attribute values is replaced by the attribute 'name' of the item being
+// written.
+
+struct xframe_t {
+   uint32_t node;
+
+   // The segments segs[pc ... end - 1] of the program remain to be run.
+   const struct babylon_mseg_t *segs;
+   uint32_t pc;
+   uint32_t end;
+
+   // While the body is being written, the next child to write;
+   // otherwise FLAT_NONE.
+   uint32_t kid;
+
+   // The scope entries pushed for this node start here.
+   uint32_t scope_base;
+
+   // For a for-each node, the tag it is over (SYM_NONE if the document
+   // has no such tag), its items and the item whose body is being
+   // written.
+   bool foreach;
+   uint32_t tag;
+   const uint32_t *items;
+   uint32_t nitems;
+   uint32_t item;
+};
+
+// A node whose output is recorded for the expansion cache: the stack
+// index of its frame, its key, where its output starts in the recording,
+// the number of inherited variables before it and the escape of the
+// recordings enclosing it. They are kept apart from the frames so that
+// an expansion without the cache does not carry them.
+struct xrec_t {
+   uint32_t depth;
+   uint64_t key;
+   size_t start;
+   size_t inherited;
+   uint32_t escape;
+   bool fileroot;
+   bool foreach;
+};
+
+// An attribute in scope, and the entry for the same name that it
+// shadows.
+struct xscope_t {
+   uint32_t attr;
+   uint32_t node;
+   uint32_t prev;
+};
+
+struct xform_t {
+   babylon_text_t *b;
+   const babylon_macro_t *bm;
+   babylon_sink_fn *sink;
+   void *ctx;
+
+   // The macro for every name in the document, NULL where there is none.
+   const struct babylon_mdef_t **macros;
+
+   // For every variable segment of the macro set, the id of its name in
+   // the document, SYM_NONE if the document never uses the name.
+   uint32_t *varsyms;
+
+   struct xframe_t *stack;
+   size_t sp;
+   size_t stack_size;
+
+   // For every name in the document, the innermost scope entry defining
+   // it or FLAT_NONE.
+   uint32_t *scope_top;
+   struct xscope_t *scope;
+   uint32_t nscope;
+   uint32_t scope_size;
+
+   // The id of the for-each attribute, the number of for-each nodes on
+   // the stack and the text with their items substituted.
+   uint32_t foreach_attr;
+   uint32_t nforeach;
+   babylon_buffer_t subst;
+
+   // The expansion cache, NULL if it is not used, and the hash of the
+   // macro set for nodes outside and inside a for-each body.
+   struct memo_t *memo;
+   uint64_t memo_salt[2];
+
+   // With the cache, 'sink' is xform_memo_sink() and the output goes on
+   // to 'out'.
+   babylon_sink_fn *out;
+   void *out_ctx;
+
+   // The output of the nodes being recorded for the cache, the nodes,
+   // outermost first, and the lowest stack index that anything expanded
+   // since the innermost of them started read from; see xform_escape().
+   babylon_buffer_t rec;
+   struct xrec_t *recs;
+   uint32_t nrec;
+   uint32_t recs_size;
+   uint32_t escape;
+};
+
+// The program of a file root.
+static const struct babylon_mseg_t xform_body = {
+   mseg_IMPLICIT, 0, 0, mimplicit_BODY
+};
+
+static void xform_error (struct xform_t *x, uint32_t n, const char *msg,
+                         const struct span_t *name)
+{
+   babylon_text_t *b = x->b;
+   struct srcfile_t *f = &b->files.files[b->flat.file[n]];
+   char *tmp = NULL;
+   size_t line = 0,
+          charpos = 0;
+
+   instream_location (f->in, b->flat.offset[n], &line, &charpos);
+   mem_printf (&tmp, "%s:%zu: %s [%.*s]", f->path, line + 1, msg,
+                                             (int)name->len, name->s);
+   LOG_ERR ("%s\n", tmp ? tmp : msg);
+
+   babylon_text_error (b, BABYLON_ETRANSFORM);
+   if (tmp) {
+      mem_free (b->errmsg);
+      b->errmsg = tmp;
+   }
+}
+
+// Stores what was recorded for 'r' in the cache.
+static bool xform_memo_store (struct xform_t *x, const struct xrec_t *r,
+                              bool reusable, const char *out, size_t len,
+                              size_t ninherited)
+{
+   struct memo_entry_t ent;
+
+   memset (&ent, 0, sizeof ent);
+   ent.key = r->key;
+   ent.node = x->stack[r->depth].node;
+   ent.fileroot = r->fileroot;
+   ent.foreach = r->foreach;
+   ent.reusable = reusable;
+   ent.len = len;
+   ent.ninherited = ninherited;
+
+   return memo_store (x->b, &ent, out);
+}
+
+// Gives up recording the nodes whose output would grow past what an
+// entry may hold, remembering them as not worth caching. They are the
+// outermost ones, so the recording then starts where the output of the
+// next one does.
+static bool xform_overflow (struct xform_t *x, size_t len)
+{
+   size_t max = x->b->memo_limit / MEMO_MAX_SHARE,
+          drop = x->rec.len,
+          i = 0;
+
+   for (; i<x->nrec; i++) {
+      const struct xrec_t *r = &x->recs[i];
+      if (x->rec.len + len - r->start <= max) {
+         drop = r->start;
+         break;
+      }
+      if (!(xform_memo_store (x, r, false, NULL, 0, 0)))
+         return false;
+   }
+
+   x->nrec -= (uint32_t)i;
+   memmove (x->recs, &x->recs[i], x->nrec * sizeof *x->recs);
+
+   if (drop)
+      memmove (x->rec.data, &x->rec.data[drop], x->rec.len - drop);
+   x->rec.len -= drop;
+   for (i=0; i<x->nrec; i++)
+      x->recs[i].start -= drop;
+   return true;
+}
+
+// The sink of an expansion that uses the cache: the output is added to
+// the recording of the nodes being recorded before it is passed on.
+static bool xform_memo_sink (void *ctx, const char *data, size_t len)
+{
+   struct xform_t *x = ctx;
+
+   if (x->nrec) {
+      if (x->rec.len + len > x->b->memo_limit / MEMO_MAX_SHARE
+            && !(xform_overflow (x, len)))
+         goto errorexit;
+      if (x->nrec && !(buffer_sink (&x->rec, data, len))) {
+         LOG_ERR ("OOM\n");
+         goto errorexit;
+      }
+   }
+
+   return x->out (x->out_ctx, data, len);
+
+errorexit:
+   babylon_text_error (x->b, BABYLON_ETRANSFORM);
+   return false;
+}
+
+static bool xform_write (struct xform_t *x, const char *data, size_t len)
+{
+   x->b->stats.bytes_written += len;
+   if (!len || x->sink (x->ctx, data, len))
+      return true;
+
+   LOG_ERR ("Failed to write transform output\n");
+   if (!x->b->errcode)
+      babylon_text_error (x->b, BABYLON_EFWRITE);
+   return false;
+}
+
+static bool xform_push (struct xform_t *x, uint32_t n, bool fileroot)
+{
+   const struct flat_t *fl = &x->b->flat;
+
+   if (x->sp >= x->stack_size) {
+      size_t newsize = x->stack_size ? x->stack_size * 2 : 64;
+      struct xframe_t *tmp = mem_realloc (x->stack, newsize * sizeof *tmp);
+      if (!tmp) {
+         LOG_ERR ("OOM\n");
+         return false;
+      }
+      x->stack = tmp;
+      x->stack_size = newsize;
+   }
+
+   struct xframe_t *f = &x->stack[x->sp];
+   f->node = n;
+   f->kid = FLAT_NONE;
+   f->scope_base = x->nscope;
+   f->foreach = false;
+   f->tag = SYM_NONE;
+   f->items = NULL;
+   f->nitems = 0;
+   f->item = 0;
+
+   if (fileroot) {
+      f->segs = &xform_body;
+      f->pc = 0;
+      f->end = 1;
+   } else {
+      const struct babylon_mdef_t *m = x->macros[fl->tag[n]];
+      if (!m) {
+         xform_error (x, n, "No macro for tag", &fl->text[n]);
+         return false;
+      }
+      x->b->stats.nexpansions++;
+      f->segs = x->bm->segs;
+      f->pc = m->seg_first;
+      f->end = m->seg_first + m->nsegs;
+
+      uint32_t a = flat_attr_find (fl, n, x->foreach_attr);
+      if (a != FLAT_NONE) {
+         const struct span_t *tag = &fl->attr_value[a];
+         f->foreach = true;
+         f->tag = symtab_find (&fl->syms, tag->s, tag->len);
+         f->nitems = tag_nodes (x->b, f->tag, &f->items);
+         x->nforeach++;
+      }
+   }
+
+   if (x->nscope + fl->nattrs[n] > x->scope_size) {
+      uint32_t newsize = x->scope_size ? x->scope_size : 256;
+      while (newsize < x->nscope + fl->nattrs[n])
+         newsize *= 2;
+      if (!(FLAT_GROW (x->scope, newsize)))
+         return false;
+      x->scope_size = newsize;
+   }
 
-   if (error) {
-      node_del (ret);
-      return NULL;
+   for (uint32_t i=0; i<fl->nattrs[n]; i++) {
+      uint32_t a = fl->attrs_first[n] + i;
+      struct xscope_t *e = &x->scope[x->nscope];
+      e->attr = a;
+      e->node = n;
+      e->prev = x->scope_top[fl->attr_name[a]];
+      x->scope_top[fl->attr_name[a]] = x->nscope++;
    }
 
-   return parent ? parent : ret;
+   x->sp++;
+   return true;
 }
 
-static node_t *node_readfile (const char *filename)
+static void xform_pop (struct xform_t *x)
 {
-   bool error = true;
-   FILE *inf = NULL;
-
-   node_t *ret = NULL;
+   const struct flat_t *fl = &x->b->flat;
+   struct xframe_t *f = &x->stack[--x->sp];
 
-   size_t line = 0,
-          charpos = 0;
+   if (f->foreach)
+      x->nforeach--;
 
-   if (!(inf = fopen (filename, "r"))) {
-      LOG_ERR ("Failed to open file [%s]:%m\n", filename);
-      goto errorexit;
+   while (x->nscope > f->scope_base) {
+      struct xscope_t *e = &x->scope[--x->nscope];
+      x->scope_top[fl->attr_name[e->attr]] = e->prev;
    }
+}
 
-   if (!(ret = node_read_next (NULL, inf, filename, &line, &charpos))) {
-      LOG_ERR ("Failed to read a node\n");
-      goto errorexit;
-   }
+// Notes that the node being expanded read from the node at stack index
+// 'depth', or, with 'depth' zero, that it found nothing where an
+// enclosing node might have had something. A node being recorded for
+// the cache whose subtree read from below it depends on where it is.
+// Nothing needs noting while no node is.
+static void xform_escape (struct xform_t *x, uint32_t depth)
+{
+   if (x->nrec && depth < x->escape)
+      x->escape = depth;
+}
 
-   error = false;
+// As xform_escape() for a read of the scope entry 'e', or of a variable
+// that is not set if 'e' is NULL. The node that pushed the entry is the
+// last one on the stack whose entries start at or before it.
+static void xform_escape_var (struct xform_t *x, const struct xscope_t *e)
+{
+   uint32_t lo = 0,
+            hi = (uint32_t)x->sp;
 
-errorexit:
-   if (error) {
-      node_del (ret);
-      ret = NULL;
+   if (!x->nrec || !e) {
+      xform_escape (x, 0);
+      return;
    }
 
-   if (inf)
-      fclose (inf);
-
-   return ret;
+   uint32_t i = (uint32_t)(e - x->scope);
+   while (hi - lo > 1) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (x->stack[mid].scope_base <= i)
+         lo = mid;
+      else
+         hi = mid;
+   }
+   xform_escape (x, lo);
 }
 
-/* ************************************************************** */
+// Returns the scope entry holding the value of the variable segment
+// 'seg' in the current node, or NULL if it is not set.
+static const struct xscope_t *xform_var (struct xform_t *x, uint32_t seg)
+{
+   uint32_t id = x->varsyms[seg];
 
-struct babylon_text_t {
-   node_t *root;
+   if (id == SYM_NONE || x->scope_top[id] == FLAT_NONE)
+      return NULL;
 
-   int errcode;
-   char *errmsg;
-};
+   return &x->scope[x->scope_top[id]];
+}
 
-void babylon_text_error (babylon_text_t *b, int errcode)
+// Returns the item being written by the innermost for-each over the tag
+// named 'tag', or FLAT_NONE if there is none.
+static uint32_t xform_item (struct xform_t *x, uint32_t tag)
 {
-   static const struct {
-      int         errcode;
-      const char *errmsg;
-   } errors[] = {
-      { BABYLON_EPARAM, "Bad parameter"      },
-      { BABYLON_EFREAD, "Input-file error"   },
-   };
+   size_t outer = x->sp;
 
-   char *tmp = NULL;
+   for (size_t i=x->sp; tag != SYM_NONE && i-- > 0; ) {
+      const struct xframe_t *f = &x->stack[i];
+      if (f->foreach && f->tag == tag && f->kid != FLAT_NONE) {
+         xform_escape (x, (uint32_t)i);
+         return f->items[f->item];
+      }
+      if (f->foreach)
+         outer = i;
+   }
 
-   if (!b)
-      return;
+   // Inside another for-each, one over 'tag' might enclose it.
+   if (outer < x->sp)
+      xform_escape (x, (uint32_t)outer);
+   return FLAT_NONE;
+}
 
-   for (size_t i=0; i<sizeof errors/sizeof errors[0]; i++) {
-      if (errors[i].errcode == errcode) {
-         if (!(tmp = ds_str_dup (errors[i].errmsg))) {
-            LOG_ERR ("Fatal error: OOM\n");
-            return;
-         }
+// Writes 'text' with every $(tag.name) inside the body of a for-each
+// over 'tag' replaced by the attribute of the item. Any other $( is
+// written as it is. Node 'n' is where an error is reported.
+static bool xform_write_text (struct xform_t *x, uint32_t n,
+                              const struct span_t *text)
+{
+   const struct flat_t *fl = &x->b->flat;
+   const char *s = text->s,
+              *end = text->s + text->len;
+
+   if (!x->nforeach || !memchr (s, '$', text->len))
+      return xform_write (x, s, text->len);
+
+   x->subst.len = 0;
+
+   for (const char *d=s; (d = memchr (d, '$', (size_t)(end - d))); ) {
+      const char *close = NULL,
+                 *dot = NULL;
+      uint32_t item = FLAT_NONE;
+
+      if (end - d < 2 || d[1] != '('
+            || !(close = memchr (d, ')', (size_t)(end - d)))
+            || !(dot = memchr (d, '.', (size_t)(close - d)))
+            || (item = xform_item (x, symtab_find (&fl->syms, &d[2],
+                                            (size_t)(dot - &d[2]))))
+                  == FLAT_NONE) {
+         d++;
+         continue;
       }
-   }
 
-   if (!tmp)
-      ds_str_printf (&tmp, "Unknown error [%i]", errcode);
+      struct span_t ref = { d, (size_t)(close + 1 - d) };
+      uint32_t id = symtab_find (&fl->syms, dot + 1,
+                                 (size_t)(close - (dot + 1)));
+      uint32_t a = flat_attr_find (fl, item, id);
+      if (a == FLAT_NONE) {
+         xform_error (x, n, "Undefined variable", &ref);
+         return false;
+      }
 
-   if (!tmp) {
-      LOG_ERR ("Fatal error: OOM\n");
-      return;
+      if (!(buffer_sink (&x->subst, s, (size_t)(d - s)))
+            || !(buffer_sink (&x->subst, fl->attr_value[a].s,
+                                 fl->attr_value[a].len))) {
+         LOG_ERR ("OOM\n");
+         return false;
+      }
+      s = d = close + 1;
    }
 
-   free (b->errmsg);
-   b->errmsg = tmp;
+   if (!(buffer_sink (&x->subst, s, (size_t)(end - s)))) {
+      LOG_ERR ("OOM\n");
+      return false;
+   }
+
+   return xform_write (x, x->subst.data, x->subst.len);
 }
 
-babylon_text_t *babylon_text_read (const char *filename)
+// Counts, and if asked for reports, a variable of node 'n' whose value
+// comes from an enclosing node.
+static void xform_inherited (struct xform_t *x, uint32_t n,
+                             const struct babylon_mseg_t *seg,
+                             const struct xscope_t *e)
 {
-   babylon_text_t *ret = NULL;
+   babylon_text_t *b = x->b;
+   const struct flat_t *fl = &b->flat;
 
-   if (!(ret = malloc (sizeof *ret))) {
-      LOG_ERR ("OOM\n");
-      goto errorexit;
-   }
+   b->ninherited++;
+   if (!b->warn_inherited || !(LOG_ENABLED (BABYLON_LOG_WARN)))
+      return;
 
-   LOG_ERR ("Created\n");
+   size_t line = 0,
+          charpos = 0,
+          from = 0;
+   struct srcfile_t *f = &b->files.files[fl->file[n]],
+                    *g = &b->files.files[fl->file[e->node]];
+   instream_location (f->in, fl->offset[n], &line, &charpos);
+   instream_location (g->in, fl->offset[e->node], &from, &charpos);
+
+   LOG_INPUT (BABYLON_LOG_WARN, "%s:%zu: warning: [%.*s] inherits "
+              "variable [%.*s] from [%.*s] at %s:%zu",
+              f->path, line + 1,
+              (int)fl->text[n].len, fl->text[n].s,
+              (int)seg->len, &x->bm->source->data[seg->off],
+              (int)fl->text[e->node].len, fl->text[e->node].s,
+              g->path, from + 1);
+}
 
-   memset (ret, 0, sizeof *ret);
-   ret->errcode = 0;
-   ret->errmsg = ds_str_dup ("Success");
-   if (!(ret->root = node_readfile (filename))) {
-      LOG_ERR ("Failed to read file [%s]:%m\n", filename);
-      babylon_text_error (ret, BABYLON_EFREAD);
-      goto errorexit;
+// Size of the buffer for the value of an implicit variable.
+#define XFORM_ID_SIZE      (24)
+
+// True if the implicit variable of 'seg' is set in node 'n', with its
+// value, other than for $(_body_), written into 'buf'.
+static bool xform_implicit (struct xform_t *x, uint32_t n,
+                            const struct babylon_mseg_t *seg, char *buf)
+{
+   const babylon_text_t *b = x->b;
+   const struct linktab_t *lt = b->links;
+   uint32_t tag = SYM_NONE,
+            attr = SYM_NONE;
+
+   if (seg->arg == mimplicit_BODY)
+      return true;
+
+   // Of targets of the same name only the first has an ID.
+   if (seg->arg == mimplicit_ID)
+      xform_escape (x, 0);
+
+   // A link to $(tag.name) is resolved for the item being written.
+   if (seg->arg == mimplicit_REF && lt
+         && link_template_attr (b, lt, n, &tag, &attr) != FLAT_NONE) {
+      uint32_t item = xform_item (x, tag),
+               id = SYM_NONE;
+      if (item == FLAT_NONE
+            || (id = link_item (b, lt, item, attr)) == SYM_NONE)
+         return false;
+      snprintf (buf, XFORM_ID_SIZE, LINK_ID_FORMAT, id);
+      return true;
    }
 
-errorexit:
-   return ret;
+   return link_id (b, n, seg->arg == mimplicit_REF, buf, XFORM_ID_SIZE);
 }
 
-void babylon_text_del (babylon_text_t *b)
+// True if every variable directly inside the optional group is set in
+// node 'n'; groups nested in it are left to decide for themselves.
+static bool xform_group_set (struct xform_t *x, uint32_t n, uint32_t group)
 {
-   if (!b)
-      return;
+   const struct babylon_mseg_t *segs = x->bm->segs;
+   char buf[XFORM_ID_SIZE];
+
+   for (uint32_t i=group + 1; i<segs[group].arg; ) {
+      if (segs[i].type == mseg_OPTIONAL) {
+         i = segs[i].arg;
+         continue;
+      }
+      if (segs[i].type == mseg_VAR) {
+         const struct xscope_t *e = xform_var (x, i);
+         xform_escape_var (x, e);
+         if (!e)
+            return false;
+      }
+      if (segs[i].type == mseg_IMPLICIT
+            && !(xform_implicit (x, n, &segs[i], buf)))
+         return false;
+      i++;
+   }
 
-   free (b->errmsg);
-   node_del (b->root);
-   free (b);
+   return true;
 }
 
-bool babylon_text_write (babylon_text_t *b, FILE *outf)
+// Writes kid 'k' from the cache if it is there, or else pushes it,
+// recording its output for the cache if it occurs elsewhere too. Kept
+// out of line, as inlined it slows down the expansion without the cache.
+__attribute__ ((noinline))
+static bool xform_enter (struct xform_t *x, uint32_t k, bool fileroot)
 {
-   if (!outf)
-      outf = stdout;
+   babylon_text_t *b = x->b;
+   struct memo_t *m = x->memo;
+   uint64_t key = m ? memo_node_key (m, k) : 0;
+
+   bool foreach = x->nforeach > 0;
+
+   if (key) {
+      key = memo_mix (memo_mix (key, fileroot), x->memo_salt[foreach]) | 1;
+
+      // An entry for a different subtree with the same hash is of no
+      // use, and as it holds the key the subtree is not recorded.
+      uint32_t e = memo_find (m, key);
+      if (e != FLAT_NONE) {
+         const struct memo_entry_t *ent = &m->entries[e];
+         bool same = ent->fileroot == fileroot && ent->foreach == foreach
+                  && memo_same (m, &b->flat, ent->node, k);
+         if (same)
+            memo_touch (m, e);
+         if (same && ent->reusable) {
+            b->stats.memo_hits++;
+            b->ninherited += ent->ninherited;
+            return xform_write (x, ent->out, ent->len);
+         }
+         key = 0;
+      }
+      b->stats.memo_misses++;
+   }
 
-   if (!b) {
-      LOG_ERR ("NULL object passed to function\n");
+   if (!(xform_push (x, k, fileroot)))
       return false;
-   }
 
-   node_dump (b->root, outf);
+   if (key) {
+      if (x->nrec >= x->recs_size) {
+         uint32_t newsize = x->recs_size ? x->recs_size * 2 : 16;
+         if (!(FLAT_GROW (x->recs, newsize)))
+            return false;
+         x->recs_size = newsize;
+      }
+      struct xrec_t *r = &x->recs[x->nrec++];
+      r->depth = (uint32_t)x->sp - 1;
+      r->key = key;
+      r->start = x->rec.len;
+      r->inherited = b->ninherited;
+      r->escape = x->escape;
+      r->fileroot = fileroot;
+      r->foreach = foreach;
+      x->escape = UINT32_MAX;
+   }
    return true;
 }
 
-int babylon_text_errcode (babylon_text_t *b)
+// Stores the recorded output of the node on top of the stack, which is
+// done, in the cache.
+static bool xform_remember (struct xform_t *x)
 {
-   return b ? b->errcode : BABYLON_EPARAM;
+   const struct xrec_t *r = &x->recs[--x->nrec];
+   bool reusable = x->escape >= r->depth;
+
+   if (r->escape < x->escape)
+      x->escape = r->escape;
+
+   if (!(xform_memo_store (x, r, reusable, &x->rec.data[r->start],
+                           x->rec.len - r->start,
+                           x->b->ninherited - r->inherited)))
+      return false;
+
+   if (!x->nrec)
+      x->rec.len = 0;
+   return true;
 }
 
-const char *babylon_text_errmsg (babylon_text_t *b)
+static bool xform_run (struct xform_t *x)
 {
-   return b ? b->errmsg : "bad param";
-}
+   const struct flat_t *fl = &x->b->flat;
+   const char *data = x->bm->source->data;
+   char id[XFORM_ID_SIZE];
 
-/* ************************************************************** */
+   if (!(xform_push (x, x->b->root, true)))
+      return false;
 
-struct babylon_macro_t {
-   char *filename;
-   ds_hmap_t *macros;
-};
+   while (x->sp) {
+      struct xframe_t *f = &x->stack[x->sp - 1];
+      uint32_t n = f->node;
+
+      if (f->kid != FLAT_NONE) {
+         if (f->kid >= fl->nkids[n]) {
+            // A for-each body is written again for the next item.
+            if (f->foreach && ++f->item < f->nitems) {
+               f->kid = 0;
+               if (!(xform_write (x, " ", 1)))
+                  return false;
+               continue;
+            }
+            f->kid = FLAT_NONE;
+            continue;
+         }
 
-struct macro_t {
-   char *filename;
-   char *name;
-   char *body;
-   size_t line;
-   size_t charpos;
-};
+         uint32_t k = fl->kids[fl->kids_first[n] + f->kid];
+         if (f->kid++ && !(xform_write (x, " ", 1)))
+            return false;
+
+         if (fl->type[k] == node_VALUE) {
+            if (!(xform_write_text (x, k, &fl->text[k])))
+               return false;
+         } else if (fl->type[k] == node_NODE) {
+            bool fileroot = fl->file[k] != fl->file[n];
+            if (!(x->memo ? xform_enter (x, k, fileroot)
+                          : xform_push (x, k, fileroot)))
+               return false;
+         }
+         continue;
+      }
 
-static void macro_del (struct macro_t *m)
-{
-   if (!m)
-      return;
+      if (f->pc >= f->end) {
+         if (x->nrec && x->recs[x->nrec - 1].depth == x->sp - 1
+               && !(xform_remember (x)))
+            return false;
+         xform_pop (x);
+         continue;
+      }
+
+      uint32_t pc = f->pc++;
+      const struct babylon_mseg_t *seg = &f->segs[pc];
+      const struct xscope_t *e = NULL;
+
+      switch (seg->type) {
+         case mseg_TEXT:
+            if (!(xform_write (x, &data[seg->off], seg->len)))
+               return false;
+            break;
+
+         case mseg_VAR:
+            if (!(e = xform_var (x, pc))) {
+               struct span_t name = { &data[seg->off], seg->len };
+               xform_error (x, n, "Undefined variable", &name);
+               return false;
+            }
+            xform_escape_var (x, e);
+            if (e->node != n)
+               xform_inherited (x, n, seg, e);
+            if (!(xform_write_text (x, n, &fl->attr_value[e->attr])))
+               return false;
+            break;
+
+         case mseg_IMPLICIT:
+            if (seg->arg == mimplicit_BODY) {
+               // A for-each over a tag that the document never uses
+               // has an empty body.
+               f->item = 0;
+               if (!f->foreach || f->nitems)
+                  f->kid = 0;
+               break;
+            }
+            // A target nothing links to has no ID, but a link must have
+            // a target.
+            if (xform_implicit (x, n, seg, id)) {
+               if (!(xform_write (x, id, strlen (id))))
+                  return false;
+            } else if (seg->arg == mimplicit_REF) {
+               xform_error (x, n, "Link to unknown target in",
+                            &fl->text[n]);
+               return false;
+            }
+            break;
+
+         case mseg_OPTIONAL:
+            if (!(xform_group_set (x, n, pc)))
+               f->pc = seg->arg;
+            break;
+      }
+   }
 
-   free (m->filename);
-   free (m->name);
-   free (m->body);
-   free (m);
+   return true;
 }
 
-static struct macro_t *macro_new (const char *filename,
-                                  const char *name, const char *body,
-                                  size_t line, size_t charpos)
+bool babylon_text_transform (babylon_text_t *src, const babylon_macro_t *bm,
+                             babylon_sink_fn *sink, void *ctx)
 {
    bool error = true;
-   struct macro_t *ret = NULL;
+   struct xform_t x = { src, bm, sink, ctx, NULL, NULL, NULL, 0, 0,
+                        NULL, NULL, 0, 0, SYM_NONE, 0, { NULL, 0, 0 },
+                        NULL, { 0, 0 }, NULL, NULL, { NULL, 0, 0 },
+                        NULL, 0, 0, UINT32_MAX };
 
-   if (!(ret = malloc (sizeof *ret))) {
-      LOG_ERR ("OOM error (macro storage)\n");
-      goto errorexit;
+   if (!src || !bm || !sink || src->root == FLAT_NONE) {
+      LOG_ERR ("NULL object passed to function\n");
+      babylon_text_error (src, BABYLON_EPARAM);
+      return false;
    }
 
-   memset (ret, 0, sizeof *ret);
+   const struct symtab_t *syms = &src->flat.syms;
+   double start = clock_now ();
 
-   ret->filename = ds_str_dup (filename);
-   ret->name = ds_str_dup (name);
-   ret->body = ds_str_dup (body);
-   ret->line = line;
-   ret->charpos = charpos;
+   src->stats.nexpansions = 0;
+   src->stats.bytes_written = 0;
+   src->stats.memo_hits = 0;
+   src->stats.memo_misses = 0;
+   src->stats.memo_evictions = 0;
 
-   if (!ret->filename || !ret->name || !ret->body) {
-      LOG_ERR ("OOM error macro fields\n");
+   if (!(x.macros = mem_calloc (syms->nnames + 1, sizeof *x.macros))
+         || !(x.varsyms = mem_malloc ((bm->nsegs + 1) * sizeof *x.varsyms))
+         || !(x.scope_top = mem_malloc ((syms->nnames + 1)
+                                    * sizeof *x.scope_top))) {
+      LOG_ERR ("OOM\n");
       goto errorexit;
    }
 
+   src->ninherited = 0;
+   x.foreach_attr = symtab_find (syms, FOREACH_ATTR, strlen (FOREACH_ATTR));
+   for (uint32_t i=0; i<syms->nnames; i++)
+      x.scope_top[i] = FLAT_NONE;
+
+   // Tags and variables are matched to macros and attributes by name once
+   // here; the expansion itself only compares ids.
+   for (uint32_t i=0; i<syms->nnames; i++)
+      x.macros[i] = macro_find (bm, syms->names[i].s, syms->names[i].len);
+
+   for (uint32_t i=0; i<bm->nsegs; i++) {
+      const struct babylon_mseg_t *seg = &bm->segs[i];
+      x.varsyms[i] = SYM_NONE;
+      if (seg->type == mseg_VAR)
+         x.varsyms[i] = symtab_find (syms, &bm->source->data[seg->off],
+                                     seg->len);
+   }
+
+   // Every node must be expanded for its inherited variables to be
+   // reported.
+   if (src->memo_limit && !src->warn_inherited) {
+      if (!src->memo && !(src->memo = memo_new (src)))
+         goto errorexit;
+      uint64_t h = memo_bytes (MEMO_SEED, bm->source->data,
+                               bm->source->len);
+      x.memo = src->memo;
+      x.memo_salt[0] = memo_mix (h, 0);
+      x.memo_salt[1] = memo_mix (h, 1);
+      x.out = sink;
+      x.out_ctx = ctx;
+      x.sink = xform_memo_sink;
+      x.ctx = &x;
+   }
+
+   if (!(xform_run (&x)))
+      goto errorexit;
+
    error = false;
 
 errorexit:
-   if (error) {
-      macro_del (ret);
-      ret = NULL;
-   }
 
-   return ret;
-}
+   if (error && !src->errcode)
+      babylon_text_error (src, BABYLON_ETRANSFORM);
 
-static void macro_dump (struct macro_t *m, FILE *outf)
-{
-   if (!outf)
-      outf = stdout;
+   src->stats.transform_time = clock_now () - start;
 
-   if (!m) {
-      fprintf (outf, "Error: NULL Macro object!\n");
-      return;
-   }
+   mem_free (x.macros);
+   mem_free (x.varsyms);
+   mem_free (x.stack);
+   mem_free (x.scope_top);
+   mem_free (x.scope);
+   mem_free (x.subst.data);
+   mem_free (x.rec.data);
+   mem_free (x.recs);
 
-   fprintf (outf, "   Macro Name:      [%s]\n", m->name);
-   fprintf (outf, "   From:            [%s:%zu:%zu]\n", m->filename,
-                                                        m->line,
-                                                        m->charpos);
-   fprintf (outf, "   Macro body:      [%s]\n", m->body);
+   return !error;
 }
 
-void babylon_macro_dump (babylon_macro_t *bm, FILE *outf)
+bool babylon_text_transform_file (babylon_text_t *src,
+                                  const babylon_macro_t *bm, FILE *outf)
 {
+   struct outfile_t o;
+
    if (!outf)
       outf = stdout;
 
-   if (!bm) {
-      fprintf (outf, "Error: NULL macro object.\n");
-      return;
+   if (!(outfile_open (&o, outf))) {
+      babylon_text_error (src, BABYLON_EFWRITE);
+      return false;
    }
 
-   char **keys = NULL;
-   size_t *keylens = NULL;
-   size_t nkeys = ds_hmap_keys (bm->macros, (void *)&keys, &keylens);
-
-   fprintf (outf, "--------------------------\n");
-   fprintf (outf, "Filename:          %s\n", bm->filename);
-   fprintf (outf, "Number of macros:  %zu\n", nkeys);
-   for (size_t i=0; i<nkeys; i++) {
-      struct macro_t *value = NULL;
-      size_t valuelen = 0;
-      if (!(ds_hmap_get_str_ptr (bm->macros, keys[i], (void **)&value,
-                                                      &valuelen))) {
-         LOG_ERR ("Internal error: Failed to get value for [%s]\n", keys[i]);
-      } else {
-         macro_dump (value, outf);
-      }
+   bool ret = babylon_text_transform (src, bm, outfile_sink, &o);
+   if (!(outfile_close (&o)) && ret) {
+      babylon_text_error (src, BABYLON_EFWRITE);
+      ret = false;
    }
-   fprintf (outf, "--------------------------\n");
 
-   free (keys);
-   free (keylens);
+   return ret;
 }
 
-babylon_macro_t *babylon_macro_read (const char *filename)
+char *babylon_text_transform_str (babylon_text_t *src,
+                                  const babylon_macro_t *bm, size_t *len)
 {
-   bool error = true;
-   babylon_macro_t *ret = NULL;
+   babylon_buffer_t buf = { NULL, 0, 0 };
 
-   char *input = NULL;
-   char *name = NULL;
-   char *body = NULL;
+   if (!(babylon_text_transform_buffer (src, bm, &buf))) {
+      mem_free (buf.data);
+      return NULL;
+   }
 
-   FILE *inf = NULL;
+   if (len)
+      *len = buf.len;
 
-   size_t line = 0,
-          charpos = 0,
-          p_line = 0,
-          p_charpos = 0;
+   return buf.data;
+}
 
-   if (!(ret = malloc (sizeof *ret))) {
-      LOG_ERR ("OOM\n");
-      goto errorexit;
+bool babylon_text_transform_buffer (babylon_text_t *src,
+                                    const babylon_macro_t *bm,
+                                    babylon_buffer_t *buf)
+{
+   if (!buf) {
+      LOG_ERR ("NULL object passed to function\n");
+      babylon_text_error (src, BABYLON_EPARAM);
+      return false;
    }
 
-   memset (ret, 0, sizeof *ret);
+   size_t len = buf->len;
+   bool ret = babylon_text_transform (src, bm, buffer_sink, buf);
 
-   if (!(ret->filename = ds_str_dup (filename))) {
+   // The NUL after empty output needs memory too.
+   if (ret && !(buffer_sink (buf, "", 0))) {
       LOG_ERR ("OOM\n");
-      goto errorexit;
+      babylon_text_error (src, BABYLON_EFWRITE);
+      ret = false;
    }
 
-   if (!(inf = fopen (filename, "r"))) {
-      LOG_ERR ("Failed to open file [%s] for reading: %m\n", filename);
-      goto errorexit;
-   }
+   if (!ret && buf->data)
+      buf->data[buf->len = len] = 0;
 
-   if (!(ret->macros = ds_hmap_new (10))) {
-      LOG_ERR ("Failed to create hashmap for macros\n");
-      goto errorexit;
-   }
+   return ret;
+}
 
-   while ((input = get_next_line (inf, &line, &charpos))!=NULL) {
-      // The first non-empty line signifies the start of a macro and
-      // contains the name of the macro.
-      ds_str_trim (input);
-      if (!input[0]) {
-         free (input);
-         continue;
-      }
+/* ************************************************************** */
 
-      free (name);
-      name = input;
+// A batch reads and expands its documents as tasks on a pool. The macro
+// set is shared by all of them and only ever read, so the workers need
+// no locking; every document has its own tree, output file and error.
 
-      free (body);
-      body = NULL;
+struct batch_task_t {
+   babylon_job_t *job;
+   const babylon_macro_t *bm;
+};
 
-      p_line = line;
-      p_charpos = charpos;
+static void batch_fail (babylon_job_t *job, int errcode, const char *msg)
+{
+   job->errcode = errcode;
+   mem_free (job->errmsg);
+   job->errmsg = mem_strdup (msg);
+}
 
-      // Repeatedly retrieve lines until we get an empty one
-      while ((input = get_next_line (inf, &line, &charpos))) {
-         if (!input[0] || input[0]=='\n' || (input[0]=='\r' && input[1]=='\n'))
-            break;
+static void batch_task (struct pool_t *pool, size_t worker, void *arg)
+{
+   struct batch_task_t *t = arg;
+   babylon_job_t *job = t->job;
+   babylon_text_t *b = NULL;
+   FILE *outf = NULL;
 
-         if (!(ds_str_append (&body, input, NULL))) {
-            LOG_ERR ("%s:%zu: Macro [%s] Out of memory error\n",
-                      filename, line, name);
-            goto errorexit;
-         }
-         free (input);
-      }
-      free (input);
+   (void)pool;
+   (void)worker;
 
-      if (!body)
-         body = ds_str_dup ("");
+   if (!(b = babylon_text_read (job->input))) {
+      batch_fail (job, BABYLON_EFREAD, "Failed to read the input");
+      goto errorexit;
+   }
 
-      struct macro_t *new_macro = macro_new (filename, name, body,
-                                             p_line, p_charpos);
-      if (!new_macro) {
-         LOG_ERR ("%s:%zu:%zu Failed to create new macro\n", filename,
-                                                             line,
-                                                             charpos);
-         goto errorexit;
-      }
+   if (b->errcode) {
+      batch_fail (job, b->errcode, b->errmsg);
+      goto errorexit;
+   }
 
-      if (!(ds_hmap_set_str_ptr (ret->macros, name, new_macro,
-                                                    sizeof new_macro))) {
-         LOG_ERR ("%s:%zu: Macro [%s]: Failed to store body [%s]\n",
-                     filename, line, name, body);
-         macro_del (new_macro);
-         goto errorexit;
-      }
+   if (!(outf = fopen (job->output, "w"))) {
+      LOG_ERR ("Failed to open [%s] for writing:%m\n", job->output);
+      batch_fail (job, BABYLON_EFWRITE, "Failed to open the output");
+      goto errorexit;
    }
 
-   error = false;
+   if (!(babylon_text_transform_file (b, t->bm, outf))) {
+      batch_fail (job, b->errcode, b->errmsg);
+      goto errorexit;
+   }
 
 errorexit:
-   if (inf)
-      fclose (inf);
 
-   free (input);
-   free (name);
-   free (body);
+   if (outf && fclose (outf) != 0 && !job->errcode)
+      batch_fail (job, BABYLON_EFWRITE, "Failed to write the output");
 
-   if (error) {
-      babylon_macro_del (ret);
-      ret = NULL;
-   }
+   // A partly written output must not be mistaken for a current one.
+   if (outf && job->errcode)
+      remove (job->output);
 
-   return ret;
+   babylon_text_del (b);
 }
 
-void babylon_macro_del (babylon_macro_t *bm)
+size_t babylon_text_batch (babylon_job_t *jobs, size_t njobs,
+                           const babylon_macro_t *bm, size_t nthreads)
 {
-   if (!bm)
-      return;
+   struct batch_task_t *tasks = NULL;
+   struct pool_t *pool = NULL;
+   size_t nfailed = 0;
 
-   free (bm->filename);
-   char **keys = NULL;
-   size_t *keylens = NULL;
-   size_t nkeys = ds_hmap_keys (bm->macros, (void ***)&keys, &keylens);
+   if (!jobs) {
+      LOG_ERR ("NULL object passed to function\n");
+      return njobs;
+   }
 
-   for (size_t i=0; i<nkeys; i++) {
-      struct macro_t *value = NULL;
-      size_t valuelen = 0;
-      if (!(ds_hmap_get_str_ptr (bm->macros, keys[i], (void **)&value,
-                                                      &valuelen))) {
-         LOG_ERR ("Internal error: Failed to get value for [%s]\n", keys[i]);
-      }
-      macro_del (value);
+   for (size_t i=0; i<njobs; i++) {
+      jobs[i].errcode = 0;
+      jobs[i].errmsg = NULL;
+      if (!bm)
+         batch_fail (&jobs[i], BABYLON_EPARAM, "No macro set");
    }
-   free (keylens);
-   free (keys);
 
-   ds_hmap_del (bm->macros);
-   free (bm);
-}
+   if (!bm) {
+      LOG_ERR ("NULL object passed to function\n");
+      return njobs;
+   }
+
+   if (!(tasks = mem_malloc ((njobs + 1) * sizeof *tasks))
+         || !(pool = pool_new (nthreads))) {
+      LOG_ERR ("OOM\n");
+      for (size_t i=0; i<njobs; i++)
+         batch_fail (&jobs[i], BABYLON_EPARAM, "Out of memory");
+      goto errorexit;
+   }
 
+   // Spread over the workers so that they start without stealing.
+   for (size_t i=0; i<njobs; i++) {
+      tasks[i].job = &jobs[i];
+      tasks[i].bm = bm;
+      if (!(pool_submit (pool, i % pool->nworkers, batch_task, &tasks[i])))
+         batch_fail (&jobs[i], BABYLON_EPARAM, "Out of memory");
+   }
+
+   pool_run (pool);
+
+errorexit:
 
+   for (size_t i=0; i<njobs; i++) {
+      if (jobs[i].errcode)
+         nfailed++;
+   }
+
+   pool_del (pool);
+   mem_free (tasks);
+
+   return nfailed;
+}